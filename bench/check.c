@@ -0,0 +1,1133 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <ftw.h>
+
+#include "filesums.h"
+
+
+/***
+ * Correctness Check:
+ *  * Writes generated files of each record format to a temporary
+ *    directory and sums them through the library: with 1 to 8
+ *    children, each reader, posix_spawn, a pool, fs_sum_fd over a
+ *    pipe and fs_sum_buffer.
+ *  * Compares every sum and record count with a reference: a plain
+ *    byte loop, the program's original loop generalised to the other
+ *    formats, which shares no code with the kernels.
+ *  * Checks that the result cache (fs_options.result_cache) replays
+ *    unchanged files and reuses the unchanged blocks of edited ones,
+ *    but never returns the sum of an older version of the file, nor of
+ *    other options.
+ *  * Sums byte ranges and ranges of records (fs_options.range_offset
+ *    and record_start), of files of same length lines and of varied
+ *    ones (which get a record index), also with the index kept in the
+ *    cache and after an edit that renumbers the records.
+ *  * Sums with filters (fs_options.where) of every kind of clause,
+ *    checked against the same conditions written out in C.
+ *  * Sums multi-field lines per key (fs_options.key_column), with short
+ *    keys, long ones sharing a prefix, empty ones and many distinct
+ *    ones, and checks every group against a reference that splits the
+ *    lines itself and sorts their keys.
+ *  * Hands a file's blocks to two workers on loopback (--workers),
+ *    kills one of them mid-run, and checks that its blocks went to
+ *    the other (reassigned_blocks) and the sum is still right.
+ *  * Prints each check that failed, and exits with a failure if any
+ *    did. "make check" builds and runs it.
+ *
+ * Usage: bench/check [--keep]
+ *   --keep: Leave the generated files in place.
+ ***/
+
+
+// Bytes per generated file.
+#define FILE_SIZE (1 << 20)
+#define POOL_WORKERS 2
+// How long to wait before the result cache stores a new file's result:
+// not before it is two seconds old.
+#define CACHE_SETTLE_SECONDS 3
+
+// A record format, and how its files are generated.
+struct check_format {
+  const char * name;
+  int delimiter;
+  int width;
+  bool is_signed;
+  const char * eol; // Ends records without a delimiter, or '\n' ones.
+  bool fixed; // Every record has exactly `width` digits.
+};
+
+// Blocks start after a newline, so without a delimiter lines have to
+// hold whole records.
+static struct check_format formats[] = {
+  { "digits3", FS_NO_DELIMITER, 3, false, "\r\n", true },
+  { "digits5", FS_NO_DELIMITER, 5, false, "\n", true },
+  { "lines5", '\n', 5, false, "\r\n", false },
+  { "commas8/signed", ',', 8, true, NULL, false },
+  { "lines19/signed", '\n', 19, true, "\n", false },
+};
+
+// How a file is summed.
+struct check_run {
+  const char * name;
+  int child_count;
+  enum fs_reader reader;
+  bool spawn;
+  bool pool;
+};
+
+static struct check_run runs[] = {
+  { "stdio, 1 child", 1, FS_READER_STDIO, false, false },
+  { "stdio, 3 children", 3, FS_READER_STDIO, false, false },
+  { "read, 4 children", 4, FS_READER_READ, false, false },
+  { "mmap, 8 children", 8, FS_READER_MMAP, false, false },
+  { "spawn, 3 children", 3, FS_READER_READ, true, false },
+  { "pool, 5 blocks", 5, FS_READER_READ, false, true },
+};
+
+static struct fs_pool * pool = NULL;
+static int failures = 0;
+static bool keep = false;
+
+/***
+* next_random: A small xorshift generator, so the data is the same
+*   on every run.
+*/
+static u_int64_t next_random (u_int64_t * state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/***
+* fill_records: Fills `length` bytes with records of `format`: numbers
+*   of up to two digits more than its width (or exactly its width, if
+*   fixed), some negative in signed formats, and now and then an empty
+*   record.
+*/
+static void fill_records (char * data, size_t length, const struct check_format * format, u_int64_t seed) {
+  u_int64_t state = seed;
+  size_t at = 0;
+
+  while ( at < length ) {
+    char record[64];
+    int used = 0;
+    int digits = format->width;
+    if ( !format->fixed )
+      digits = next_random(&state) % 16 == 0 ? 0 : 1 + next_random(&state) % ( format->width + 2 );
+    if ( format->is_signed && next_random(&state) % 2 )
+      record[used++] = '-';
+    for ( int i = 0; i < digits; i++ )
+      record[used++] = '0' + next_random(&state) % 10;
+    if ( format->delimiter == FS_NO_DELIMITER || format->delimiter == '\n' )
+      used += sprintf(record + used, "%s", format->eol);
+    else
+      record[used++] = format->delimiter;
+    for ( int i = 0; i < used && at < length; i++ )
+      data[at++] = record[i];
+  }
+}
+
+// Which records the reference sums: those numbered from `first` (from
+// 0) for `count` records (0 for all the rest), whose values pass
+// `pass` (if not NULL). Records are numbered before the filter.
+struct check_select {
+  u_int64_t first;
+  u_int64_t count;
+  bool (*pass)(int64_t value);
+};
+
+/***
+* reference_selects: Whether record number `number` is selected.
+*/
+static bool reference_selects (u_int64_t value, u_int64_t number, const struct check_select * select) {
+  return select == NULL || ( number >= select->first
+      && ( select->count == 0 || number - select->first < select->count )
+      && ( select->pass == NULL || select->pass((int64_t)value) ) );
+}
+
+/***
+* reference_add: Adds record number `number` to the sum, if selected.
+*/
+static void reference_add (u_int64_t value, u_int64_t number, const struct check_select * select,
+    u_int64_t * sum, u_int64_t * records) {
+  if ( !reference_selects(value, number, select) )
+    return;
+  *sum += value;
+  *records += 1;
+}
+
+/***
+* reference_sum: Sums `length` bytes of `format` records one byte at a
+*   time, the way the program's original loop did: a record is every
+*   `width` digits without a delimiter, or else the first `width`
+*   digits before the delimiter (and a '-' before them, if signed).
+*   Only the records `select` picks count, or all of them if NULL.
+*/
+static u_int64_t reference_sum (const char * data, size_t length, const struct check_format * format,
+    const struct check_select * select, u_int64_t * records) {
+  int boundary = format->delimiter == FS_NO_DELIMITER ? '\n' : format->delimiter;
+  u_int64_t value = 0;
+  u_int64_t sum = 0;
+  u_int64_t number = 0;
+  int digits = 0;
+  bool negative = false;
+
+  *records = 0;
+  for ( size_t i = 0; i <= length; i++ ) {
+    // The end of the data ends the last record.
+    int c = i < length ? (unsigned char)data[i] : EOF;
+    if ( c >= '0' && c <= '9' && digits < format->width ) {
+      value = value * 10 + ( c - '0' );
+      digits += 1;
+    }
+    if ( format->delimiter == FS_NO_DELIMITER ) {
+      if ( digits == format->width ) {
+        reference_add(value, number++, select, &sum, records);
+        value = 0;
+        digits = 0;
+      }
+    } else if ( c == boundary || c == EOF ) {
+      if ( digits > 0 )
+        reference_add(negative ? 0 - value : value, number++, select, &sum, records);
+      value = 0;
+      digits = 0;
+      negative = false;
+    } else if ( format->is_signed && c == '-' && digits == 0 ) {
+      negative = true;
+    }
+  }
+  return sum;
+}
+
+/***
+* expect: Checks a sum and record count against the reference's,
+*   printing the check if it failed (or didn't get a result).
+*/
+static void expect (const char * check, const char * how, int status, const struct fs_result * result,
+    u_int64_t sum, u_int64_t records) {
+  if ( status == -1 ) {
+    printf("FAILED %s (%s): %s: %s\n", check, how, fs_last_error(), strerror(errno));
+    failures += 1;
+  } else if ( result->sum != sum || result->records != records ) {
+    printf("FAILED %s (%s): sum %ld, %lu records; expected %ld, %lu records\n", check, how,
+        (long)result->sum, (unsigned long)result->records, (long)sum, (unsigned long)records);
+    failures += 1;
+  }
+}
+
+/***
+* expect_true: Checks a condition, printing the check and what was
+*   expected if it failed.
+*/
+static void expect_true (const char * check, const char * how, const char * what, bool passed) {
+  if ( !passed ) {
+    printf("FAILED %s (%s): expected %s\n", check, how, what);
+    failures += 1;
+  }
+}
+
+/***
+* format_options: The options for `format`'s records.
+*/
+static void format_options (struct fs_options * options, const struct check_format * format) {
+  fs_options_init(options);
+  options->delimiter = format->delimiter;
+  options->width = format->width;
+  options->is_signed = format->is_signed;
+}
+
+/***
+* write_file: Writes `length` bytes to `path`. Returns false if it can't.
+*/
+static bool write_file (const char * path, const char * data, size_t length) {
+  FILE * file = fopen(path, "w");
+
+  if ( file == NULL || fwrite(data, 1, length, file) != length || fclose(file) != 0 ) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+// A generated file that has to be two seconds old before its results
+// (or record index) are stored: written before the wait for them all.
+struct check_file {
+  const struct check_format * format;
+  char path[4096];
+  char * data; // FILE_SIZE bytes, with room for a few more.
+  struct stat stat_buf;
+};
+
+/***
+* prepare_file: Writes a file of `format` records named `name`.
+*   Returns false if it can't.
+*/
+static bool prepare_file (struct check_file * file, const char * directory, const char * name,
+    const struct check_format * format, u_int64_t seed) {
+  file->format = format;
+  file->data = malloc(FILE_SIZE + 16);
+  if ( file->data == NULL ) {
+    perror("malloc");
+    return false;
+  }
+  fill_records(file->data, FILE_SIZE, format, seed);
+  snprintf(file->path, sizeof(file->path), "%s/%s", directory, name);
+  if ( !write_file(file->path, file->data, FILE_SIZE) || stat(file->path, &file->stat_buf) == -1 )
+    return false;
+  return true;
+}
+
+/***
+* edit_file: Writes `data[at]` over the file's byte at `at`, then sets
+*   its modification time back, as a tool that hides its edits would.
+*   Returns false if it can't.
+*/
+static bool edit_file (struct check_file * file, size_t at) {
+  struct timespec times[2] = { file->stat_buf.st_atim, file->stat_buf.st_mtim };
+  int fd = open(file->path, O_WRONLY);
+
+  if ( fd == -1 || pwrite(fd, file->data + at, 1, at) != 1 || futimens(fd, times) == -1 ) {
+    perror(file->path);
+    if ( fd != -1 )
+      close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+/***
+* check_format: Sums a file of `format` every way there is, and a pipe
+*   and a buffer of it.
+*/
+static bool check_format (const char * directory, const struct check_format * format) {
+  char * data = malloc(FILE_SIZE);
+  char path[4096];
+  struct fs_options options;
+  struct fs_result result;
+  u_int64_t sum, records;
+  int pipe_fds[2];
+  int status;
+
+  if ( data == NULL ) {
+    perror("malloc");
+    return false;
+  }
+  fill_records(data, FILE_SIZE, format, 0x9e3779b97f4a7c15ULL);
+  snprintf(path, sizeof(path), "%s/format.dat", directory);
+  if ( !write_file(path, data, FILE_SIZE) ) {
+    free(data);
+    return false;
+  }
+  sum = reference_sum(data, FILE_SIZE, format, NULL, &records);
+
+  for ( size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++ ) {
+    format_options(&options, format);
+    options.child_count = runs[i].child_count;
+    options.reader = runs[i].reader;
+    options.spawn = runs[i].spawn;
+    options.pool = runs[i].pool ? pool : NULL;
+    status = fs_sum_file(path, &options, &result);
+    expect(format->name, runs[i].name, status, &result, sum, records);
+    if ( status == 0 )
+      fs_result_free(&result);
+  }
+
+  format_options(&options, format);
+  status = fs_sum_buffer(data, FILE_SIZE, &options, &result);
+  expect(format->name, "fs_sum_buffer", status, &result, sum, records);
+  if ( status == 0 )
+    fs_result_free(&result);
+
+  // A pipe, written by a child while this process reads it.
+  if ( pipe(pipe_fds) == 0 ) {
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+      close(pipe_fds[0]);
+      for ( size_t at = 0; at < FILE_SIZE; ) {
+        ssize_t wrote = write(pipe_fds[1], data + at, FILE_SIZE - at);
+        if ( wrote <= 0 )
+          _exit(EXIT_FAILURE);
+        at += wrote;
+      }
+      _exit(EXIT_SUCCESS);
+    }
+    close(pipe_fds[1]);
+    status = pid == -1 ? -1 : fs_sum_fd(pipe_fds[0], &options, &result);
+    close(pipe_fds[0]);
+    if ( pid != -1 )
+      waitpid(pid, NULL, 0);
+    expect(format->name, "fs_sum_fd", status, &result, sum, records);
+    if ( status == 0 )
+      fs_result_free(&result);
+  }
+
+  if ( !keep )
+    unlink(path);
+  free(data);
+  return true;
+}
+
+/***
+* reused_count: How many of a result's partials came from the cache.
+*/
+static int reused_count (const struct fs_result * result) {
+  int reused = 0;
+  for ( int i = 0; i < result->partial_count; i++ )
+    reused += result->partials[i].reused;
+  return reused;
+}
+
+/***
+* cache_run: Sums `path` with the result cache, checking the result
+*   against `data`'s and how much of it came from the cache: whether
+*   all of it (from_cache), and how many blocks were reused (or -1 for
+*   any number).
+*/
+static void cache_run (const char * check, const char * path, struct fs_options * options, const char * data,
+    size_t length, const struct check_format * format, bool from_cache, int reused) {
+  struct fs_result result;
+  u_int64_t sum, records;
+  char what[64];
+  int status = fs_sum_file(path, options, &result);
+
+  sum = reference_sum(data, length, format, NULL, &records);
+  expect("cache", check, status, &result, sum, records);
+  if ( status == -1 )
+    return;
+  expect_true("cache", check, from_cache ? "a replay" : "no replay", result.from_cache == from_cache);
+  snprintf(what, sizeof(what), "%d reused blocks, not %d", reused, reused_count(&result));
+  expect_true("cache", check, what, reused == -1 || reused_count(&result) == reused);
+  fs_result_free(&result);
+}
+
+/***
+* check_cache: Edits, replaces and grows a file between runs with the
+*   result cache, checking that every run gets the file's current sum.
+*/
+static bool check_cache (const char * directory, struct check_file * file) {
+  const struct check_format * format = file->format;
+  struct check_format narrow = *format;
+  const char * path = file->path;
+  char * data = file->data;
+  char cache_dir[4096];
+  char temp_path[4160];
+  struct fs_options options;
+  struct timespec times[2] = { file->stat_buf.st_atim, file->stat_buf.st_mtim };
+  size_t edit_at = FILE_SIZE / 2 + FILE_SIZE / 8;
+  int fd;
+
+  snprintf(cache_dir, sizeof(cache_dir), "%s/cache", directory);
+  format_options(&options, format);
+  options.child_count = 4;
+  options.result_cache = true;
+  options.result_cache_dir = cache_dir;
+  cache_run("first run", path, &options, data, FILE_SIZE, format, false, 0);
+  cache_run("unchanged file", path, &options, data, FILE_SIZE, format, true, 4);
+  // Other options have their own entries.
+  narrow.width = 3;
+  options.width = 3;
+  cache_run("another width", path, &options, data, FILE_SIZE, &narrow, false, 0);
+  options.width = format->width;
+  options.child_count = 3;
+  cache_run("other blocks", path, &options, data, FILE_SIZE, format, false, 0);
+  options.child_count = 4;
+
+  // An edit in the third block, with the modification time set back:
+  // the change time still gives it away, and only that block is summed.
+  while ( data[edit_at] < '0' || data[edit_at] > '9' )
+    edit_at += 1;
+  data[edit_at] = data[edit_at] == '9' ? '0' : data[edit_at] + 1;
+  if ( !edit_file(file, edit_at) )
+    return false;
+  cache_run("edited in place", path, &options, data, FILE_SIZE, format, false, 3);
+  cache_run("edited again", path, &options, data, FILE_SIZE, format, false, 3);
+
+  // A new file in its place, with the same size and times.
+  fill_records(data, FILE_SIZE, format, 0x5851f42d4c957f2dULL);
+  snprintf(temp_path, sizeof(temp_path), "%s.new", path);
+  if ( !write_file(temp_path, data, FILE_SIZE) || utimensat(AT_FDCWD, temp_path, times, 0) == -1
+       || rename(temp_path, path) == -1 ) {
+    perror(temp_path);
+    return false;
+  }
+  cache_run("replaced", path, &options, data, FILE_SIZE, format, false, 0);
+
+  // Grown by a record: the blocks move, so nothing is reused.
+  memcpy(data + FILE_SIZE, "12345\n", 6);
+  fd = open(path, O_WRONLY | O_APPEND);
+  if ( fd == -1 || write(fd, data + FILE_SIZE, 6) != 6 ) {
+    perror(path);
+    return false;
+  }
+  close(fd);
+  cache_run("grown", path, &options, data, FILE_SIZE + 6, format, false, 0);
+  return true;
+}
+
+static bool above_500 (int64_t value) { return value > 500; }
+static bool from_100_to_200 (int64_t value) { return value >= 100 && value <= 200; }
+static bool in_set (int64_t value) { return value == 7 || value == 11 || value == 13 || value == 500; }
+static bool not_0_or_1 (int64_t value) { return value != 0 && value != 1; }
+static bool remainder_1_of_3 (int64_t value) { return ( value % 3 + 3 ) % 3 == 1; }
+static bool even_above_500 (int64_t value) { return value > 500 && value % 2 == 0; }
+static bool nothing (int64_t value) { return false; }
+static bool below_minus_100 (int64_t value) { return value < -100; }
+static bool around_0 (int64_t value) { return value >= -50 && value <= 50 && value != 0; }
+
+// Filters, and what they mean.
+struct check_filter {
+  const char * text;
+  bool (*pass)(int64_t value);
+  bool is_signed; // Only for signed formats.
+};
+
+static struct check_filter filters[] = {
+  { ">500", above_500, false },
+  { "100..200", from_100_to_200, false },
+  { "=7|11|13|500", in_set, false },
+  { "!=0|1", not_0_or_1, false },
+  { "%3=1", remainder_1_of_3, false },
+  { ">500,%2=0", even_above_500, false },
+  { ">10,<5", nothing, false },
+  { "<-100", below_minus_100, true },
+  { "-50..50,!=0", around_0, true },
+};
+
+/***
+* check_filters: Sums a file of `format` with each filter that fits
+*   it, every way there is, and with a record range.
+*/
+static bool check_filters (const char * directory, const struct check_format * format) {
+  char * data = malloc(FILE_SIZE);
+  char path[4096];
+
+  if ( data == NULL ) {
+    perror("malloc");
+    return false;
+  }
+  fill_records(data, FILE_SIZE, format, 0x9e3779b97f4a7c15ULL);
+  snprintf(path, sizeof(path), "%s/where.dat", directory);
+  if ( !write_file(path, data, FILE_SIZE) ) {
+    free(data);
+    return false;
+  }
+
+  for ( size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); i++ ) {
+    struct check_select all = { 0, 0, filters[i].pass };
+    struct check_select some = { 70000, 1000, filters[i].pass };
+    struct fs_options options;
+    struct fs_result result;
+    u_int64_t sum, records;
+    char check[128];
+    int status;
+
+    if ( filters[i].is_signed && !format->is_signed )
+      continue;
+    snprintf(check, sizeof(check), "%s where '%s'", format->name, filters[i].text);
+    sum = reference_sum(data, FILE_SIZE, format, &all, &records);
+    for ( size_t j = 0; j < sizeof(runs) / sizeof(runs[0]); j++ ) {
+      format_options(&options, format);
+      options.where = filters[i].text;
+      options.child_count = runs[j].child_count;
+      options.reader = runs[j].reader;
+      options.spawn = runs[j].spawn;
+      options.pool = runs[j].pool ? pool : NULL;
+      status = fs_sum_file(path, &options, &result);
+      expect(check, runs[j].name, status, &result, sum, records);
+      if ( status == 0 )
+        fs_result_free(&result);
+    }
+
+    format_options(&options, format);
+    options.where = filters[i].text;
+    status = fs_sum_buffer(data, FILE_SIZE, &options, &result);
+    expect(check, "fs_sum_buffer", status, &result, sum, records);
+    if ( status == 0 )
+      fs_result_free(&result);
+
+    options.child_count = 4;
+    options.record_start = some.first;
+    options.record_count = some.count;
+    sum = reference_sum(data, FILE_SIZE, format, &some, &records);
+    status = fs_sum_file(path, &options, &result);
+    expect(check, "records 70000:1000", status, &result, sum, records);
+    if ( status == 0 )
+      fs_result_free(&result);
+  }
+
+  if ( !keep )
+    unlink(path);
+  free(data);
+  return true;
+}
+
+// Byte ranges: offset and length (0 for up to the end).
+static u_int64_t byte_ranges[][2] = {
+  { 0, 1000 }, { 12345, 300000 }, { FILE_SIZE / 3, 0 }, { FILE_SIZE - 100, 50 }, { FILE_SIZE - 10, 0 },
+};
+
+// Record ranges: first record and count (0 for all the rest). Every
+// 65536th record is indexed.
+static struct check_select record_ranges[] = {
+  { 0, 10 }, { 70000, 1000 }, { 65536, 65536 }, { 131071, 2 }, { 150000, 0 }, { 10000000, 5 },
+};
+
+/***
+* range_runs: Sums every record range of `path` with 1 and 4 children,
+*   with `options` (which may keep the index in the cache).
+*/
+static void range_runs (const char * path, struct fs_options * options, const char * data,
+    const struct check_format * format, const char * how) {
+  for ( size_t i = 0; i < sizeof(record_ranges) / sizeof(record_ranges[0]); i++ ) {
+    for ( int children = 1; children <= 4; children += 3 ) {
+      struct fs_result result;
+      u_int64_t sum, records;
+      char check[128];
+      int status;
+
+      options->child_count = children;
+      options->record_start = record_ranges[i].first;
+      options->record_count = record_ranges[i].count;
+      status = fs_sum_file(path, options, &result);
+      sum = reference_sum(data, FILE_SIZE, format, &record_ranges[i], &records);
+      snprintf(check, sizeof(check), "%s records %lu:%lu", format->name, (unsigned long)record_ranges[i].first,
+          (unsigned long)record_ranges[i].count);
+      expect(check, how, status, &result, sum, records);
+      if ( status == 0 )
+        fs_result_free(&result);
+    }
+  }
+}
+
+/***
+* check_ranges: Sums byte and record ranges of a file of `format`.
+*   Files of varied lines then get an edit that renumbers the records
+*   after it, which a stored record index must not survive.
+*/
+static bool check_ranges (const char * directory, struct check_file * file) {
+  const struct check_format * format = file->format;
+  const char * path = file->path;
+  char * data = file->data;
+  char cache_dir[4096];
+  struct fs_options options;
+  size_t edit_at = 1000;
+
+  snprintf(cache_dir, sizeof(cache_dir), "%s/range-cache", directory);
+  for ( size_t i = 0; i < sizeof(byte_ranges) / sizeof(byte_ranges[0]); i++ ) {
+    u_int64_t offset = byte_ranges[i][0];
+    u_int64_t length;
+    // Without a delimiter, blocks start at lines; so has the range,
+    // for them to agree on where the records are.
+    if ( format->delimiter == FS_NO_DELIMITER )
+      offset -= offset % ( format->width + strlen(format->eol) );
+    length = byte_ranges[i][1] != 0 ? byte_ranges[i][1] : FILE_SIZE - offset;
+    for ( int children = 1; children <= 4; children += 3 ) {
+      struct fs_result result;
+      u_int64_t sum, records;
+      char check[128];
+      int status;
+
+      format_options(&options, format);
+      options.child_count = children;
+      options.range_offset = offset;
+      options.range_length = byte_ranges[i][1];
+      status = fs_sum_file(path, &options, &result);
+      // As if the file started and ended there.
+      sum = reference_sum(data + offset, length, format, NULL, &records);
+      snprintf(check, sizeof(check), "%s bytes %lu+%lu", format->name, (unsigned long)offset,
+          (unsigned long)byte_ranges[i][1]);
+      expect(check, children == 1 ? "1 child" : "4 children", status, &result, sum, records);
+      if ( status == 0 )
+        fs_result_free(&result);
+    }
+  }
+
+  format_options(&options, format);
+  range_runs(path, &options, data, format, "no cache");
+  options.result_cache = true;
+  options.result_cache_dir = cache_dir;
+  range_runs(path, &options, data, format, "storing the index");
+  range_runs(path, &options, data, format, "stored index");
+
+  if ( !format->fixed ) {
+    // Joins two records into one, with the modification time set back.
+    while ( data[edit_at] != format->delimiter && !( format->delimiter == FS_NO_DELIMITER && data[edit_at] == '\n' ) )
+      edit_at += 1;
+    data[edit_at] = '7';
+    if ( !edit_file(file, edit_at) )
+      return false;
+    range_runs(path, &options, data, format, "after an edit");
+  }
+  return true;
+}
+
+// Files of multi-field lines, and how they are summed per key.
+struct check_grouping {
+  const char * name;
+  int separator;
+  int key_column; // From 1.
+  int value_column;
+  int width;
+  bool is_signed;
+  const char * key_format; // printf format of a key, from a number.
+  int keys; // Distinct keys, at most.
+  int fields; // Per line.
+};
+
+static struct check_grouping groupings[] = {
+  { "short keys", ',', 2, 3, 6, false, "k%d", 2000, 4 },
+  { "long keys, last field", '\t', 3, 1, 19, true, "customer-account-%07d", 200000, 3 },
+  { "empty fields", ';', 1, 2, 3, false, "%d", 50, 2 },
+};
+
+// A record of the group reference.
+struct check_record {
+  const char * key;
+  size_t length;
+  u_int64_t value;
+};
+
+// Filters and record ranges of the grouped files.
+static struct {
+  const char * name;
+  const char * where;
+  struct check_select select;
+} group_selects[] = {
+  { "where '>500'", ">500", { 0, 0, above_500 } },
+  { "records 1000:5000", NULL, { 1000, 5000, NULL } },
+  { "records 10000:", NULL, { 10000, 0, NULL } },
+  { "records 65535:2, where '>500'", ">500", { 65535, 2, above_500 } },
+};
+
+/***
+* fill_groups: Fills `length` bytes with "\r\n" lines of `grouping`'s
+*   fields. The key field holds one of its keys (or is empty, or the
+*   line is cut short, now and then); the value field holds a number
+*   (or nothing, now and then); the other fields, some letters.
+*/
+static void fill_groups (char * data, size_t length, const struct check_grouping * grouping, u_int64_t seed) {
+  u_int64_t state = seed;
+  size_t at = 0;
+
+  while ( at < length ) {
+    char line[256];
+    int used = 0;
+    int fields = next_random(&state) % 32 == 0 ? 1 : grouping->fields;
+    for ( int field = 1; field <= fields; field++ ) {
+      if ( field > 1 )
+        line[used++] = grouping->separator;
+      if ( field == grouping->key_column && next_random(&state) % 64 != 0 ) {
+        used += sprintf(line + used, grouping->key_format, (int)( next_random(&state) % grouping->keys ));
+      } else if ( field == grouping->value_column && next_random(&state) % 16 != 0 ) {
+        int digits = 1 + next_random(&state) % grouping->width;
+        if ( grouping->is_signed && next_random(&state) % 2 )
+          line[used++] = '-';
+        for ( int i = 0; i < digits; i++ )
+          line[used++] = '0' + next_random(&state) % 10;
+      } else if ( field != grouping->key_column && field != grouping->value_column ) {
+        used += sprintf(line + used, "x%d", (int)( next_random(&state) % 100 ));
+      }
+    }
+    used += sprintf(line + used, "\r\n");
+    for ( int i = 0; i < used && at < length; i++ )
+      data[at++] = line[i];
+  }
+}
+
+/***
+* compare_records: For qsort: by key (bytes, then length).
+*/
+static int compare_records (const void * a, const void * b) {
+  const struct check_record * x = a;
+  const struct check_record * y = b;
+  int order = memcmp(x->key, y->key, x->length < y->length ? x->length : y->length);
+  if ( order != 0 )
+    return order;
+  return x->length < y->length ? -1 : x->length > y->length;
+}
+
+/***
+* reference_records: Splits `length` bytes of lines into fields,
+*   returning each selected line's key and value, sorted by key. Lines
+*   without a digit in their value field aren't records (and aren't
+*   numbered).
+*/
+static struct check_record * reference_records (const char * data, size_t length,
+    const struct check_grouping * grouping, const struct check_select * select, size_t * count) {
+  struct check_record * records = malloc(( length / 2 + 1 ) * sizeof(struct check_record));
+  const char * line = data;
+  const char * end = data + length;
+  u_int64_t number = 0;
+
+  *count = 0;
+  if ( records == NULL )
+    return NULL;
+  while ( line < end ) {
+    const char * line_end = memchr(line, '\n', end - line);
+    const char * field = line;
+    struct check_record record = { "", 0, 0 };
+    int digits = 0;
+    bool negative = false;
+
+    if ( line_end == NULL )
+      line_end = end;
+    for ( int column = 1; field <= line_end; column++ ) {
+      const char * field_end = memchr(field, grouping->separator, line_end - field);
+      if ( field_end == NULL )
+        field_end = line_end;
+      if ( column == grouping->key_column ) {
+        record.key = field;
+        record.length = field_end - field;
+        if ( record.length > 0 && field[record.length - 1] == '\r' )
+          record.length -= 1;
+      } else if ( column == grouping->value_column ) {
+        for ( const char * c = field; c < field_end; c++ ) {
+          if ( *c >= '0' && *c <= '9' && digits < grouping->width ) {
+            record.value = record.value * 10 + ( *c - '0' );
+            digits += 1;
+          } else if ( grouping->is_signed && *c == '-' && digits == 0 ) {
+            negative = true;
+          }
+        }
+      }
+      field = field_end + 1;
+    }
+    if ( negative )
+      record.value = 0 - record.value;
+    if ( digits > 0 && reference_selects(record.value, number++, select) )
+      records[(*count)++] = record;
+    line = line_end + 1;
+  }
+  qsort(records, *count, sizeof(struct check_record), compare_records);
+  return records;
+}
+
+/***
+* expect_groups: Checks a result's groups (and total) against the
+*   sorted reference records.
+*/
+static void expect_groups (const char * check, const char * how, int status, const struct fs_result * result,
+    const struct check_record * records, size_t count) {
+  u_int64_t sum = 0;
+  u_int64_t groups = 0;
+  char what[128];
+
+  for ( size_t i = 0; i < count; i++ )
+    sum += records[i].value;
+  expect(check, how, status, result, sum, count);
+  if ( status == -1 )
+    return;
+  for ( size_t i = 0; i < count; groups++ ) {
+    const struct fs_group * group = &result->groups[groups];
+    u_int64_t group_sum = 0;
+    size_t first = i;
+
+    for ( ; i < count && compare_records(&records[i], &records[first]) == 0; i++ )
+      group_sum += records[i].value;
+    if ( groups >= result->group_count ) {
+      snprintf(what, sizeof(what), "more than %lu groups", (unsigned long)result->group_count);
+      expect_true(check, how, what, false);
+      return;
+    }
+    if ( group->key_length != records[first].length || memcmp(group->key, records[first].key, group->key_length) != 0
+         || group->sum != group_sum || group->records != i - first ) {
+      snprintf(what, sizeof(what), "group %lu to be '%.*s' with %ld in %lu records", (unsigned long)groups,
+          (int)records[first].length, records[first].key, (long)group_sum, (unsigned long)( i - first ));
+      expect_true(check, how, what, false);
+      return;
+    }
+  }
+  snprintf(what, sizeof(what), "%lu groups, not %lu", (unsigned long)groups, (unsigned long)result->group_count);
+  expect_true(check, how, what, groups == result->group_count);
+}
+
+/***
+* group_options: The options for summing `grouping`'s lines per key.
+*/
+static void group_options (struct fs_options * options, const struct check_grouping * grouping) {
+  fs_options_init(options);
+  options->key_column = grouping->key_column;
+  options->value_column = grouping->value_column;
+  options->separator = grouping->separator;
+  options->width = grouping->width;
+  options->is_signed = grouping->is_signed;
+}
+
+/***
+* check_groups: Sums a file of `grouping`'s lines per key every way
+*   that supports groups, also with a filter, and checks that the
+*   ways that don't refuse to.
+*/
+static bool check_groups (const char * directory, const struct check_grouping * grouping) {
+  char * data = malloc(FILE_SIZE);
+  char path[4096];
+  struct check_record * records;
+  struct fs_options options;
+  struct fs_result result;
+  size_t count;
+  int status;
+
+  if ( data == NULL ) {
+    perror("malloc");
+    return false;
+  }
+  fill_groups(data, FILE_SIZE, grouping, 0x9e3779b97f4a7c15ULL);
+  snprintf(path, sizeof(path), "%s/groups.csv", directory);
+  records = reference_records(data, FILE_SIZE, grouping, NULL, &count);
+  if ( records == NULL || !write_file(path, data, FILE_SIZE) ) {
+    perror("groups");
+    free(data);
+    free(records);
+    return false;
+  }
+
+  for ( size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++ ) {
+    if ( runs[i].pool )
+      continue;
+    group_options(&options, grouping);
+    options.child_count = runs[i].child_count;
+    options.reader = runs[i].reader;
+    options.spawn = runs[i].spawn;
+    status = fs_sum_file(path, &options, &result);
+    expect_groups(grouping->name, runs[i].name, status, &result, records, count);
+    if ( status == 0 )
+      fs_result_free(&result);
+  }
+  group_options(&options, grouping);
+  status = fs_sum_buffer(data, FILE_SIZE, &options, &result);
+  expect_groups(grouping->name, "fs_sum_buffer", status, &result, records, count);
+  if ( status == 0 )
+    fs_result_free(&result);
+
+  // Groups can't be summed by a pool's workers.
+  options.pool = pool;
+  status = fs_sum_file(path, &options, &result);
+  expect_true(grouping->name, "pool", "an error", status == -1);
+  if ( status == 0 )
+    fs_result_free(&result);
+  options.pool = NULL;
+
+  // Filtered and ranged: records are lines with a value, numbered
+  // before the filter.
+  for ( size_t i = 0; i < sizeof(group_selects) / sizeof(group_selects[0]); i++ ) {
+    free(records);
+    records = reference_records(data, FILE_SIZE, grouping, &group_selects[i].select, &count);
+    if ( records == NULL ) {
+      perror("groups");
+      free(data);
+      return false;
+    }
+    for ( int children = 1; children <= 4; children += 3 ) {
+      char how[128];
+      group_options(&options, grouping);
+      options.where = group_selects[i].where;
+      options.record_start = group_selects[i].select.first;
+      options.record_count = group_selects[i].select.count;
+      options.child_count = children;
+      snprintf(how, sizeof(how), "%s, %d child%s", group_selects[i].name, children, children == 1 ? "" : "ren");
+      status = fs_sum_file(path, &options, &result);
+      expect_groups(grouping->name, how, status, &result, records, count);
+      if ( status == 0 )
+        fs_result_free(&result);
+    }
+  }
+
+  if ( !keep )
+    unlink(path);
+  free(records);
+  free(data);
+  return true;
+}
+
+/***
+* start_worker: Forks a worker listening on a free loopback port, in a
+*   process group of its own (with the processes it forks for each
+*   coordinator). Returns its pid, or -1.
+*/
+static pid_t start_worker (int * port) {
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  struct fs_options options;
+  int fd = fs_worker_listen("0");
+  pid_t pid;
+
+  if ( fd == -1 || getsockname(fd, (struct sockaddr *)&address, &length) == -1 ) {
+    perror(fs_last_error());
+    return -1;
+  }
+  *port = ntohs(address.sin_port);
+  pid = fork();
+  if ( pid == 0 ) {
+    setpgid(0, 0);
+    fs_options_init(&options);
+    fs_worker_serve(fd, &options);
+    _exit(EXIT_FAILURE);
+  }
+  // So the kill below can't miss the group.
+  if ( pid > 0 )
+    setpgid(pid, pid);
+  close(fd);
+  return pid;
+}
+
+/***
+* stop_worker: Kills a worker and the processes it forked.
+*/
+static void stop_worker (pid_t pid) {
+  kill(-pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+/***
+* check_workers: Sums a file with two workers on loopback, killing one
+*   once the first block is back, and checks the sum and that the lost
+*   worker's blocks were reassigned.
+*/
+static bool check_workers (struct check_file * file) {
+  const struct check_format * format = file->format;
+  u_int64_t records;
+  u_int64_t sum = reference_sum(file->data, FILE_SIZE, format, NULL, &records);
+  struct fs_options options;
+  struct fs_result result;
+  struct fs_partial partial;
+  struct fs_job * job;
+  char workers[64];
+  pid_t pids[2];
+  int ports[2];
+  int status;
+  bool killed = false;
+
+  for ( int i = 0; i < 2; i++ ) {
+    pids[i] = start_worker(&ports[i]);
+    if ( pids[i] == -1 ) {
+      if ( i == 1 )
+        stop_worker(pids[0]);
+      return false;
+    }
+  }
+  snprintf(workers, sizeof(workers), "127.0.0.1:%d,127.0.0.1:%d", ports[0], ports[1]);
+  format_options(&options, format);
+  options.workers = workers;
+  options.child_count = 64;
+  job = fs_job_start(file->path, &options, &result);
+  status = job == NULL ? -1 : 0;
+  while ( job != NULL && ( status = fs_job_next(job, &partial) ) == 1 ) {
+    if ( !killed ) {
+      stop_worker(pids[1]);
+      killed = true;
+    }
+  }
+  if ( job != NULL && fs_job_finish(job) == -1 )
+    status = -1;
+  expect(format->name, "workers, one killed", status, &result, sum, records);
+  if ( status != -1 ) {
+    expect_true(format->name, "workers, one killed", "reassigned blocks", result.reassigned_blocks > 0);
+    fs_result_free(&result);
+  }
+  stop_worker(pids[0]);
+  if ( !killed )
+    stop_worker(pids[1]);
+  return true;
+}
+
+/***
+* remove_entry: Removes a file or (emptied) directory, for nftw.
+*/
+static int remove_entry (const char * path, const struct stat * stat_buf, int type, struct FTW * ftw) {
+  remove(path);
+  return 0;
+}
+
+int main (int argc, char ** argv) {
+  char directory[] = "/tmp/file-sums-check-XXXXXX";
+  struct check_file cache_file;
+  struct check_file range_files[sizeof(formats) / sizeof(formats[0])];
+  char name[64];
+  time_t prepared;
+
+  // Children started with posix_spawn run this program.
+  fs_child_main(argc, argv);
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "--keep") == 0 ) {
+      keep = true;
+    } else {
+      fprintf(stderr, "Usage: %s [--keep]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if ( mkdtemp(directory) == NULL ) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  pool = fs_pool_create(POOL_WORKERS, 0, 0);
+  if ( pool == NULL ) {
+    perror(fs_last_error());
+    return EXIT_FAILURE;
+  }
+
+  // The files the caches are checked with, first: their results are
+  // only stored once they are two seconds old.
+  if ( !prepare_file(&cache_file, directory, "cache.dat", &formats[2], 0x2545f4914f6cdd1dULL) )
+    return EXIT_FAILURE;
+  for ( size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++ ) {
+    snprintf(name, sizeof(name), "range%zu.dat", i);
+    if ( !prepare_file(&range_files[i], directory, name, &formats[i], 0xda942042e4dd58b5ULL) )
+      return EXIT_FAILURE;
+  }
+  prepared = time(NULL);
+
+  for ( size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++ )
+    if ( !check_format(directory, &formats[i]) || !check_filters(directory, &formats[i]) )
+      return EXIT_FAILURE;
+  while ( time(NULL) <= prepared + CACHE_SETTLE_SECONDS )
+    sleep(1);
+  if ( !check_cache(directory, &cache_file) )
+    return EXIT_FAILURE;
+  for ( size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++ )
+    if ( !check_ranges(directory, &range_files[i]) )
+      return EXIT_FAILURE;
+  for ( size_t i = 0; i < sizeof(groupings) / sizeof(groupings[0]); i++ )
+    if ( !check_groups(directory, &groupings[i]) )
+      return EXIT_FAILURE;
+  if ( !check_workers(&range_files[4]) )
+    return EXIT_FAILURE;
+
+  fs_pool_destroy(pool);
+  if ( !keep )
+    nftw(directory, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  printf("%s\n", failures == 0 ? "All checks passed." : "Some checks FAILED.");
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,228 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "filesums.h"
+
+
+/***
+ * Many Small Files Benchmark:
+ *  * Writes a corpus of --files small files (10000 by default, 1 to
+ *    8 KB of three digit numbers each) to a temporary directory, and
+ *    sums all of them:
+ *    * fork: fs_sum_file per file, with one child (a fork per block),
+ *    * pool: the same with a pool of workers (fs_options.pool),
+ *    * async: fs_sum_files, with 1 and with 64 files in flight per thread.
+ *  * With --cold, the files are dropped from the page cache before
+ *    each way (posix_fadvise), so the opens and reads wait on the disk.
+ *  * Checks every file's sum against the one computed while writing it.
+ *
+ * Usage: bench/files [--files N] [--cold] [--keep]
+ ***/
+
+
+#define DEFAULT_FILES 10000
+#define POOL_WORKERS 4
+
+/***
+* now_ns: The monotonic clock in nanoseconds.
+*/
+static u_int64_t now_ns (void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/***
+* write_corpus: Writes the files, filling in their expected sums.
+*/
+static bool write_corpus (char ** paths, int count, u_int64_t * sums) {
+  char data[8192];
+  struct fs_result result;
+
+  srand(7);
+  for ( int i = 0; i < count; i++ ) {
+    size_t length = 1000 + rand() % (sizeof(data) - 1000);
+    for ( size_t j = 0; j < length; j++ )
+      data[j] = '0' + rand() % 10;
+    FILE * file = fopen(paths[i], "w");
+    if ( file == NULL || fwrite(data, 1, length, file) != length || fclose(file) != 0 ) {
+      perror(paths[i]);
+      return false;
+    }
+    if ( fs_sum_buffer(data, length, NULL, &result) == -1 )
+      return false;
+    sums[i] = result.sum;
+    fs_result_free(&result);
+  }
+  return true;
+}
+
+/***
+* drop_cache: Drops the files from the page cache.
+*/
+static void drop_cache (char ** paths, int count) {
+  for ( int i = 0; i < count; i++ ) {
+    int fd = open(paths[i], O_RDONLY);
+    if ( fd == -1 )
+      continue;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+/***
+* run_jobs: Sums the files one after another with fs_sum_file. Returns
+*   the number of wrong sums (or failures).
+*/
+static int run_jobs (char ** paths, int count, u_int64_t * sums, struct fs_options * options) {
+  struct fs_result result;
+  int wrong = 0;
+
+  for ( int i = 0; i < count; i++ ) {
+    if ( fs_sum_file(paths[i], options, &result) == -1 ) {
+      wrong += 1;
+      continue;
+    }
+    wrong += result.sum != sums[i];
+    fs_result_free(&result);
+  }
+  return wrong;
+}
+
+/***
+* run_async: Sums the files with fs_sum_files. Returns the number of
+*   wrong sums (or failures).
+*/
+static int run_async (char ** paths, int count, u_int64_t * sums, struct fs_options * options) {
+  struct fs_result * results = calloc(count, sizeof(struct fs_result));
+  int * errors = calloc(count, sizeof(int));
+  int wrong = 0;
+
+  if ( results == NULL || errors == NULL ) {
+    free(results);
+    free(errors);
+    return count;
+  }
+  fs_sum_files((const char * const *)paths, count, options, results, errors);
+  for ( int i = 0; i < count; i++ ) {
+    wrong += errors[i] != 0 || results[i].sum != sums[i];
+    fs_result_free(&results[i]);
+  }
+  free(results);
+  free(errors);
+  return wrong;
+}
+
+int main (int argc, char ** argv) {
+  int count = DEFAULT_FILES;
+  bool cold = false;
+  bool keep = false;
+  char directory[] = "/tmp/file-sums-files-XXXXXX";
+  char ** paths;
+  u_int64_t * sums;
+  struct fs_options options;
+  struct fs_pool * pool;
+  bool ok = true;
+  const char * modes[] = { "fork", "pool", "async, 1 in flight", "async, 64 in flight" };
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "--files") == 0 && i + 1 < argc ) {
+      count = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "--cold") == 0 ) {
+      cold = true;
+    } else if ( strcmp(argv[i], "--keep") == 0 ) {
+      keep = true;
+    } else {
+      fprintf(stderr, "Usage: %s [--files N] [--cold] [--keep]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if ( count < 1 ) {
+    fprintf(stderr, "%s: --files must be at least 1.\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if ( mkdtemp(directory) == NULL ) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  paths = calloc(count, sizeof(char *));
+  sums = calloc(count, sizeof(u_int64_t));
+  if ( paths == NULL || sums == NULL ) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+  for ( int i = 0; i < count; i++ )
+    if ( asprintf(&paths[i], "%s/f%05d.dat", directory, i) == -1 ) {
+      perror("asprintf");
+      return EXIT_FAILURE;
+    }
+  if ( !write_corpus(paths, count, sums) )
+    return EXIT_FAILURE;
+
+  pool = fs_pool_create(POOL_WORKERS, 0, 0);
+  if ( pool == NULL ) {
+    perror(fs_last_error());
+    return EXIT_FAILURE;
+  }
+
+  printf("%d files in %s%s\n", count, directory, cold ? ", cold" : "");
+  printf("%-20s %10s %10s %8s\n", "mode", "total ms", "us/file", "check");
+  for ( int mode = 0; mode < 4; mode++ ) {
+    u_int64_t started;
+    u_int64_t elapsed;
+    int wrong;
+
+    fs_options_init(&options);
+    if ( mode == 1 )
+      options.pool = pool;
+    options.async_depth = mode == 2 ? 1 : 64;
+    if ( cold )
+      drop_cache(paths, count);
+    started = now_ns();
+    if ( mode < 2 )
+      wrong = run_jobs(paths, count, sums, &options);
+    else
+      wrong = run_async(paths, count, sums, &options);
+    elapsed = now_ns() - started;
+    printf("%-20s %10.1f %10.1f %8s\n", modes[mode], elapsed / 1e6, elapsed / 1e3 / count, wrong ? "FAILED" : "ok");
+    if ( wrong )
+      fprintf(stderr, "%s: %d files summed wrong.\n", modes[mode], wrong);
+    ok = ok && wrong == 0;
+  }
+  fs_pool_destroy(pool);
+
+  if ( !keep ) {
+    for ( int i = 0; i < count; i++ )
+      unlink(paths[i]);
+    rmdir(directory);
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,429 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "fs_kernel.h"
+
+
+/***
+ * Kernel Microbenchmarks:
+ *  * Feeds in-memory buffers to every scan kernel in fs_kernel.h, with
+ *    no fork or I/O involved, across buffer sizes, alignments, line
+ *    endings and digit widths. Delimited formats are fed both records
+ *    of mixed lengths and fixed length records (kernel "<name>/fixed"),
+ *    which take the SWAR runs.
+ *  * Also times the filtered kernels (variant "where") with a filter
+ *    that about half of the records pass, in no particular order, so
+ *    any branch on the filter's answer would mispredict often.
+ *  * Checks each kernel against a reference: the fgetc loop the
+ *    program started out with (over fmemopen), generalised to the
+ *    other record formats. Kernels are also fed the buffer in small
+ *    chunks, to check records that span chunks.
+ *  * Reports ns/record and GB/s, as the median (and spread) of
+ *    several repetitions.
+ *
+ * Usage: bench/kernels [--quick] [--json]
+ *   --quick: Fewer sizes and repetitions (a few seconds).
+ *   --json: One JSON object per result, for scripts (see perf-check).
+ *
+ * Exits with a failure status if any kernel disagrees with the reference.
+ ***/
+
+
+// Repetitions per case; the median is reported.
+#define REPETITIONS 7
+#define QUICK_REPETITIONS 3
+// Each repetition scans at least this many bytes, so small
+// buffers aren't timed by the clock's resolution.
+#define MIN_BYTES_PER_REPETITION (1024 * 1024)
+#define QUICK_MIN_BYTES_PER_REPETITION (256 * 1024)
+// The reference loop is only timed up to this size; it is slow.
+#define MAX_REFERENCE_TIMING 65536
+// The chunk size for the chunked correctness check.
+#define CHECK_CHUNK 61
+
+// A kernel under test.
+struct bench_kernel {
+  const char * name;
+  int delimiter;
+  int width;
+  bool is_signed;
+  fs_kernel_fn unbounded;
+  fs_kernel_fn scalar; // The same kernel without the SWAR fast path.
+  fs_kernel_fn where; // The same kernel, summing only what passes `filter`.
+};
+
+// Every kernel from FS_KERNEL_FORMATS...
+#define BENCH_KERNEL(NAME, DELIM, WIDTH, SIGNED) \
+  { #NAME, DELIM, WIDTH, SIGNED, fs_scan_##NAME, fs_scan_##NAME##_scalar, fs_scan_##NAME##_where },
+static struct bench_kernel kernels[] = {
+  FS_KERNEL_FORMATS(BENCH_KERNEL)
+};
+#undef BENCH_KERNEL
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+// ...and the sizes, alignments and line endings they are fed.
+static size_t sizes[] = { 4096, 65536, 1 << 20, 4 << 20 };
+static size_t quick_sizes[] = { 4096, 1 << 20 };
+static size_t alignments[] = { 0, 1, 7 };
+static const char * line_endings[] = { "\n", "\r\n" };
+
+// The filter the kernels and the reference apply, or NULL.
+static const struct fs_where * filter = NULL;
+
+// The options.
+static bool quick = false;
+static bool json = false;
+static size_t min_bytes = MIN_BYTES_PER_REPETITION;
+
+/***
+* next_random: A small xorshift generator, so the data is the same
+*   on every run.
+*/
+static u_int64_t next_random (u_int64_t * state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/***
+* fill_records: Fills `length` bytes with records for `kernel`: numbers
+*   of up to its width (negative ones too, for signed formats), ended
+*   by its delimiter or `eol` when it has none (or is '\n'). If `fixed`,
+*   every record is a number of exactly its width.
+*/
+static void fill_records (char * data, size_t length, struct bench_kernel * kernel, const char * eol, bool fixed) {
+  u_int64_t state = 0x9e3779b97f4a7c15ULL;
+  size_t at = 0;
+
+  while ( at < length ) {
+    char record[64];
+    int used = 0;
+    int digits = kernel->width;
+    // Delimited records vary in length, some with more digits than the width.
+    if ( kernel->delimiter != FS_NO_DELIMITER && !fixed )
+      digits = 1 + next_random(&state) % ( kernel->width + 2 );
+    if ( kernel->is_signed && !fixed && next_random(&state) % 2 )
+      record[used++] = '-';
+    for ( int i = 0; i < digits; i++ )
+      record[used++] = '0' + next_random(&state) % 10;
+    if ( kernel->delimiter == FS_NO_DELIMITER || kernel->delimiter == '\n' )
+      used += sprintf(record + used, "%s", eol);
+    else
+      record[used++] = kernel->delimiter;
+    for ( int i = 0; i < used && at < length; i++ )
+      data[at++] = record[i];
+  }
+}
+
+/***
+* reference_sum: The program's original fgetc/atoi loop over a stream
+*   of the buffer, generalised to delimited, wider and signed records.
+*   Slow on purpose: this is what the kernels are checked against.
+*/
+static u_int64_t reference_sum (const char * data, size_t length, struct bench_kernel * kernel, u_int64_t * records) {
+  FILE * file = fmemopen((void *)data, length, "r");
+  int boundary = kernel->delimiter == FS_NO_DELIMITER ? '\n' : kernel->delimiter;
+  // Hold the digits
+  char buf[FS_MAX_WIDTH + 1] = {0};
+  // Hold the current character.
+  int c;
+  // Hold the current digit place.
+  int c_count = 0;
+  bool negative = false;
+  u_int64_t sum = 0;
+
+  *records = 0;
+  if ( file == NULL ) {
+    perror("fmemopen");
+    exit(EXIT_FAILURE);
+  }
+  do {
+    c = fgetc(file);
+    // read digits into buf
+    if ( c != EOF && c_count < kernel->width && c >= '0' && c <= '9' ) {
+      buf[c_count] = c;
+      c_count += 1;
+      buf[c_count] = '\0';
+    }
+    if ( kernel->delimiter == FS_NO_DELIMITER ) {
+      // Add the digit results into the sum.
+      if ( c_count >= kernel->width ) {
+        u_int64_t value = strtoull(buf, NULL, 10);
+        if ( filter == NULL || fs_where_test(filter, value) ) {
+          sum += value;
+          *records += 1;
+        }
+        c_count = 0;
+      }
+    } else if ( c == boundary || c == EOF ) {
+      // The record ends here.
+      if ( c_count > 0 ) {
+        u_int64_t value = strtoull(buf, NULL, 10);
+        if ( negative )
+          value = 0 - value;
+        if ( filter == NULL || fs_where_test(filter, value) ) {
+          sum += value;
+          *records += 1;
+        }
+      }
+      c_count = 0;
+      negative = false;
+    } else if ( kernel->is_signed && c == '-' && c_count == 0 ) {
+      negative = true;
+    }
+  } while ( c != EOF );
+  fclose(file);
+  return sum;
+}
+
+/***
+* kernel_sum: Runs a kernel over a buffer, `chunk` bytes at a time
+*   (or all at once, with chunk 0).
+*/
+static u_int64_t kernel_sum (struct bench_kernel * kernel, fs_kernel_fn fn, const char * data, size_t length,
+    size_t chunk, u_int64_t * records) {
+  struct fs_scan scan;
+
+  fs_scan_init(&scan, kernel->delimiter, kernel->width, kernel->is_signed);
+  scan.where = filter;
+  if ( chunk == 0 )
+    chunk = length;
+  for ( size_t at = 0; at < length; at += chunk )
+    fn(&scan, data + at, length - at < chunk ? length - at : chunk, 0);
+  fs_scan_finish(&scan);
+  *records = scan.records;
+  return scan.sum;
+}
+
+/***
+* seconds_since: The time since `start`.
+*/
+static double seconds_since (struct timespec * start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/***
+* compare_doubles: For sorting the repetitions.
+*/
+static int compare_doubles (const void * a, const void * b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/***
+* report: Outputs one result, from the repetitions' seconds per pass.
+*/
+static void report (const char * kernel, const char * variant, size_t size, size_t alignment, const char * eol,
+    u_int64_t records, double * seconds, int repetitions) {
+  double median, spread;
+
+  qsort(seconds, repetitions, sizeof(double), compare_doubles);
+  median = seconds[repetitions / 2];
+  // How far the slowest repetition is from the fastest, relative to the median.
+  spread = median > 0 ? (seconds[repetitions - 1] - seconds[0]) / median : 0;
+  if ( json )
+    printf("{\"kernel\": \"%s\", \"variant\": \"%s\", \"size\": %zu, \"alignment\": %zu, \"eol\": \"%s\", "
+        "\"ns_per_record\": %.3f, \"gb_per_s\": %.3f, \"spread\": %.3f}\n",
+        kernel, variant, size, alignment, eol[0] == '\r' ? "crlf" : "lf",
+        records ? median * 1e9 / records : 0, size / median / 1e9, spread);
+  else
+    printf("%-22s %-9s %9zu %5zu %-4s %10.3f %8.3f %7.1f%%\n",
+        kernel, variant, size, alignment, eol[0] == '\r' ? "crlf" : "lf",
+        records ? median * 1e9 / records : 0, size / median / 1e9, spread * 100);
+}
+
+/***
+* time_kernel: Times a kernel on a buffer, returning the seconds per
+*   pass of each repetition in `seconds`.
+*/
+static void time_kernel (struct bench_kernel * kernel, fs_kernel_fn fn, const char * data, size_t length,
+    double * seconds, int repetitions) {
+  size_t passes = min_bytes / length + 1;
+  u_int64_t records;
+  // Keeps the sums used, so the passes can't be optimised away.
+  static volatile u_int64_t sink;
+
+  for ( int r = 0; r < repetitions; r++ ) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( size_t p = 0; p < passes; p++ )
+      sink += kernel_sum(kernel, fn, data, length, 0, &records);
+    seconds[r] = seconds_since(&start) / passes;
+  }
+}
+
+/***
+* time_reference: Times the reference loop on a buffer.
+*/
+static void time_reference (struct bench_kernel * kernel, const char * data, size_t length, double * seconds, int repetitions) {
+  u_int64_t records;
+  static volatile u_int64_t sink;
+
+  for ( int r = 0; r < repetitions; r++ ) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sink += reference_sum(data, length, kernel, &records);
+    seconds[r] = seconds_since(&start);
+  }
+}
+
+/***
+* check: Compares a kernel with the reference on a buffer, fed at once
+*   and in chunks. Returns false (after saying why) if they disagree.
+*/
+static bool check (struct bench_kernel * kernel, fs_kernel_fn fn, const char * variant, const char * data,
+    size_t length, u_int64_t expected, u_int64_t expected_records) {
+  size_t chunks[] = { 0, CHECK_CHUNK, 1 };
+
+  for ( size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++ ) {
+    u_int64_t records;
+    u_int64_t sum;
+    // Byte at a time is slow; only do it on the smaller buffers.
+    if ( chunks[i] == 1 && length > 65536 )
+      continue;
+    sum = kernel_sum(kernel, fn, data, length, chunks[i], &records);
+    if ( sum != expected || records != expected_records ) {
+      fprintf(stderr, "MISMATCH %s (%s), %zu bytes in chunks of %zu: sum %lu, records %lu; reference %lu, %lu\n",
+          kernel->name, variant, length, chunks[i] ? chunks[i] : length, sum, records, expected, expected_records);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main (int argc, char ** argv) {
+  size_t * size_list = sizes;
+  size_t size_count = sizeof(sizes) / sizeof(sizes[0]);
+  int repetitions = REPETITIONS;
+  size_t largest;
+  char * buffer;
+  double seconds[REPETITIONS];
+  bool ok = true;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "--quick") == 0 ) {
+      quick = true;
+    } else if ( strcmp(argv[i], "--json") == 0 ) {
+      json = true;
+    } else {
+      fprintf(stderr, "Usage: %s [--quick] [--json]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if ( quick ) {
+    size_list = quick_sizes;
+    size_count = sizeof(quick_sizes) / sizeof(quick_sizes[0]);
+    repetitions = QUICK_REPETITIONS;
+    min_bytes = QUICK_MIN_BYTES_PER_REPETITION;
+  }
+  largest = size_list[size_count - 1];
+  buffer = malloc(largest + 64);
+  if ( buffer == NULL ) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+
+  if ( !json )
+    printf("%-22s %-9s %9s %5s %-4s %10s %8s %8s\n",
+        "kernel", "variant", "bytes", "align", "eol", "ns/record", "GB/s", "spread");
+  for ( size_t k = 0; k < KERNEL_COUNT; k++ ) {
+    struct bench_kernel * kernel = &kernels[k];
+    // Line endings only matter to formats that end records with lines.
+    size_t eol_count = kernel->delimiter == ',' ? 1 : 2;
+    // Records without a delimiter are always fixed length.
+    int layout_count = kernel->delimiter == FS_NO_DELIMITER ? 1 : 2;
+    // Half of the digits' values are at least 5 followed by zeros.
+    char half_text[32] = ">=5";
+    struct fs_where half;
+
+    for ( int i = 1; i < kernel->width; i++ )
+      strcat(half_text, "0");
+    if ( !fs_where_compile(half_text, kernel->width, kernel->is_signed, &half) ) {
+      fprintf(stderr, "Bad filter %s.\n", half_text);
+      return EXIT_FAILURE;
+    }
+
+    for ( int layout = 0; layout < layout_count; layout++ ) {
+      char name[64];
+      snprintf(name, sizeof(name), "%s%s", kernel->name, layout == 1 ? "/fixed" : "");
+      for ( size_t e = 0; e < eol_count; e++ ) {
+        for ( size_t s = 0; s < size_count; s++ ) {
+          size_t size = size_list[s];
+          for ( size_t a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++ ) {
+            char * data = buffer + alignments[a];
+            // The data is the same at every alignment.
+            static u_int64_t expected_records;
+            static u_int64_t expected;
+
+            // Check the specialised, scalar and generic kernels against the reference.
+            fill_records(data, size, kernel, line_endings[e], layout == 1);
+            if ( a == 0 )
+              expected = reference_sum(data, size, kernel, &expected_records);
+            ok = check(kernel, kernel->unbounded, "special", data, size, expected, expected_records) && ok;
+            ok = check(kernel, kernel->scalar, "scalar", data, size, expected, expected_records) && ok;
+            ok = check(kernel, fs_scan_generic, "generic", data, size, expected, expected_records) && ok;
+
+            time_kernel(kernel, kernel->unbounded, data, size, seconds, repetitions);
+            report(name, "special", size, alignments[a], line_endings[e], expected_records, seconds, repetitions);
+            // The rest only once per size, to keep the run short.
+            if ( a > 0 )
+              continue;
+            time_kernel(kernel, kernel->scalar, data, size, seconds, repetitions);
+            report(name, "scalar", size, alignments[a], line_endings[e], expected_records, seconds, repetitions);
+            time_kernel(kernel, fs_scan_generic, data, size, seconds, repetitions);
+            report(name, "generic", size, alignments[a], line_endings[e], expected_records, seconds, repetitions);
+            if ( size <= MAX_REFERENCE_TIMING ) {
+              time_reference(kernel, data, size, seconds, repetitions);
+              report(name, "fgetc", size, alignments[a], line_endings[e], expected_records, seconds, repetitions);
+            }
+
+            // The filtered kernels, specialised and generic.
+            u_int64_t where_records;
+            u_int64_t where_expected;
+            filter = &half;
+            where_expected = reference_sum(data, size, kernel, &where_records);
+            ok = check(kernel, kernel->where, "where", data, size, where_expected, where_records) && ok;
+            ok = check(kernel, fs_scan_generic_where, "generic where", data, size, where_expected, where_records) && ok;
+            time_kernel(kernel, kernel->where, data, size, seconds, repetitions);
+            // (Per record scanned, like the others.)
+            report(name, "where", size, alignments[a], line_endings[e], expected_records, seconds, repetitions);
+            filter = NULL;
+          }
+        }
+      }
+    }
+  }
+
+  free(buffer);
+  if ( !ok ) {
+    fprintf(stderr, "Some kernels disagree with the reference loop.\n");
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
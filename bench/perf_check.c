@@ -0,0 +1,410 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "filesums.h"
+#include "fs_kernel.h"
+
+
+/***
+ * Performance Regression Check:
+ *  * Runs a fixed set of benchmarks on generated data: every scan kernel
+ *    on a buffer in memory, and whole runs of the library (readers and
+ *    child counts) on a generated file.
+ *  * Compares their throughput with a baseline (bench/baseline.json),
+ *    and fails if any of them got slower than the tolerance allows.
+ *
+ * Usage: bench/perf_check [--baseline FILE] [--tolerance FRACTION] [--update]
+ *   --baseline: The baseline to compare with (bench/baseline.json).
+ *   --tolerance: How much slower than the baseline is still fine, as a
+ *     fraction (0.25 = 25%). Defaults to the baseline's own tolerance.
+ *   --update: Write the results as the new baseline instead (the
+ *     median of a few rounds), keeping the old one's tolerance.
+ *
+ * A benchmark only counts as a regression if it stays too slow over
+ * a few rounds, since shared machines have slow spells.
+ *
+ * Baselines are per machine: after changing machines, run with
+ * --update (make perf-baseline) before relying on the check.
+ *
+ * Baseline format:
+ *   {
+ *     "tolerance": 0.25,
+ *     "results": {
+ *       "kernel/digits3": 0.912,
+ *       ...
+ *     }
+ *   }
+ * with throughput in GB/s (higher is better).
+ ***/
+
+
+// The default tolerance, for baselines written where there was none.
+#define DEFAULT_TOLERANCE 0.25
+// Repetitions per benchmark. The fastest is compared: noise from
+// other work on the machine only ever makes a repetition slower.
+#define REPETITIONS 7
+// The kernel buffer, scanned this many times per repetition.
+#define KERNEL_BUFFER_SIZE (1 << 20)
+#define KERNEL_PASSES 16
+// The generated file for the library benchmarks.
+#define FILE_SIZE (32 << 20)
+// The most benchmarks in a run or a baseline.
+#define MAX_RESULTS 64
+// Shared machines have slow spells, so a regression only counts if
+// it is still there after re-running the whole set (up to this many
+// rounds, keeping each benchmark's best).
+#define CHECK_ROUNDS 3
+// A new baseline is the median of this many rounds, so one lucky
+// round doesn't make every later check fail.
+#define UPDATE_ROUNDS 3
+
+// A benchmark's throughput.
+struct bench_result {
+  char name[64];
+  double gb_per_s;
+};
+
+// The library benchmarks: a reader and a child count.
+static const struct {
+  const char * name;
+  enum fs_reader reader;
+  int children;
+} file_benchmarks[] = {
+  { "file/stdio/1", FS_READER_STDIO, 1 },
+  { "file/read/1", FS_READER_READ, 1 },
+  { "file/mmap/1", FS_READER_MMAP, 1 },
+  { "file/read/4", FS_READER_READ, 4 }
+};
+
+/***
+* seconds_since: The time since `start`.
+*/
+static double seconds_since (struct timespec * start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/***
+* compare_doubles: For sorting rounds.
+*/
+static int compare_doubles (const void * a, const void * b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/***
+* fastest: The smallest of `count` times.
+*/
+static double fastest (double * seconds, int count) {
+  double best = seconds[0];
+  for ( int i = 1; i < count; i++ )
+    if ( seconds[i] < best )
+      best = seconds[i];
+  return best;
+}
+
+/***
+* fill_digits: Fills a buffer with three digit numbers on CRLF lines,
+*   like the included .dat files.
+*/
+static void fill_digits (char * data, size_t length) {
+  u_int64_t state = 0x9e3779b97f4a7c15ULL;
+  for ( size_t i = 0; i < length; i++ ) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    data[i] = i % 5 == 3 ? '\r' : i % 5 == 4 ? '\n' : '0' + state % 10;
+  }
+}
+
+/***
+* bench_kernels: Times every kernel on the same buffer. Formats with
+*   a delimiter see its lines as records, which is the same work.
+*/
+static int bench_kernels (struct bench_result * results) {
+  char * data = malloc(KERNEL_BUFFER_SIZE);
+  struct {
+    const char * name;
+    int delimiter;
+    int width;
+    bool is_signed;
+    fs_kernel_fn fn;
+  } kernels[] = {
+#define CHECK_KERNEL(NAME, DELIM, WIDTH, SIGNED) \
+    { #NAME, DELIM, WIDTH, SIGNED, fs_scan_##NAME },
+    FS_KERNEL_FORMATS(CHECK_KERNEL)
+#undef CHECK_KERNEL
+  };
+  int count = sizeof(kernels) / sizeof(kernels[0]);
+  static volatile u_int64_t sink;
+
+  if ( data == NULL ) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  fill_digits(data, KERNEL_BUFFER_SIZE);
+  for ( int k = 0; k < count; k++ ) {
+    double seconds[REPETITIONS];
+    // The first repetition only warms up (caches, branch predictors, clock speed).
+    for ( int r = -1; r < REPETITIONS; r++ ) {
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for ( int p = 0; p < KERNEL_PASSES; p++ ) {
+        struct fs_scan scan;
+        fs_scan_init(&scan, kernels[k].delimiter, kernels[k].width, kernels[k].is_signed);
+        kernels[k].fn(&scan, data, KERNEL_BUFFER_SIZE, 0);
+        fs_scan_finish(&scan);
+        sink += scan.sum;
+      }
+      if ( r >= 0 )
+        seconds[r] = seconds_since(&start) / KERNEL_PASSES;
+    }
+    snprintf(results[k].name, sizeof(results[k].name), "kernel/%s", kernels[k].name);
+    results[k].gb_per_s = KERNEL_BUFFER_SIZE / fastest(seconds, REPETITIONS) / 1e9;
+  }
+  free(data);
+  return count;
+}
+
+/***
+* bench_files: Times whole library runs on a generated file.
+*/
+static int bench_files (struct bench_result * results) {
+  char path[] = "/tmp/file-sums-perf-XXXXXX";
+  int count = sizeof(file_benchmarks) / sizeof(file_benchmarks[0]);
+  int fd = mkstemp(path);
+  char * data = malloc(FILE_SIZE);
+
+  if ( fd == -1 || data == NULL ) {
+    perror("Error creating the benchmark file");
+    exit(EXIT_FAILURE);
+  }
+  fill_digits(data, FILE_SIZE);
+  if ( write(fd, data, FILE_SIZE) != FILE_SIZE ) {
+    perror("Error writing the benchmark file");
+    unlink(path);
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  free(data);
+
+  for ( int b = 0; b < count; b++ ) {
+    double seconds[REPETITIONS];
+    struct fs_options options;
+    fs_options_init(&options);
+    options.reader = file_benchmarks[b].reader;
+    options.child_count = file_benchmarks[b].children;
+    for ( int r = 0; r < REPETITIONS; r++ ) {
+      struct fs_result result;
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if ( fs_sum_file(path, &options, &result) == -1 ) {
+        perror(fs_last_error());
+        unlink(path);
+        exit(EXIT_FAILURE);
+      }
+      seconds[r] = seconds_since(&start);
+      fs_result_free(&result);
+    }
+    snprintf(results[b].name, sizeof(results[b].name), "%s", file_benchmarks[b].name);
+    results[b].gb_per_s = FILE_SIZE / fastest(seconds, REPETITIONS) / 1e9;
+  }
+  unlink(path);
+  return count;
+}
+
+/***
+* run_all: Runs every benchmark once. Returns how many there are.
+*/
+static int run_all (struct bench_result * results) {
+  int count = bench_kernels(results);
+  return count + bench_files(results + count);
+}
+
+/***
+* find_result: The result called `name`, or NULL.
+*/
+static struct bench_result * find_result (struct bench_result * results, int count, const char * name) {
+  for ( int i = 0; i < count; i++ )
+    if ( strcmp(results[i].name, name) == 0 )
+      return &results[i];
+  return NULL;
+}
+
+/***
+* count_regressions: How many results are slower than the baseline
+*   by more than the tolerance.
+*/
+static int count_regressions (struct bench_result * results, int count, struct bench_result * baseline,
+    int baseline_count, double tolerance) {
+  int regressions = 0;
+  for ( int i = 0; i < count; i++ ) {
+    struct bench_result * base = find_result(baseline, baseline_count, results[i].name);
+    if ( base != NULL && results[i].gb_per_s / base->gb_per_s - 1 < -tolerance )
+      regressions += 1;
+  }
+  return regressions;
+}
+
+/***
+* load_baseline: Reads a baseline's results and tolerance. Only reads
+*   the format perf_check writes: "name": number pairs.
+*   Returns the number of results, or -1 if it can't be read.
+*/
+static int load_baseline (const char * path, struct bench_result * results, double * tolerance) {
+  FILE * file = fopen(path, "r");
+  char line[256];
+  int count = 0;
+
+  if ( file == NULL )
+    return -1;
+  while ( fgets(line, sizeof(line), file) != NULL ) {
+    char name[64];
+    double value;
+    if ( sscanf(line, " \"%63[^\"]\" : %lf", name, &value) != 2 )
+      continue;
+    if ( strcmp(name, "tolerance") == 0 ) {
+      *tolerance = value;
+    } else if ( count < MAX_RESULTS ) {
+      strcpy(results[count].name, name);
+      results[count].gb_per_s = value;
+      count += 1;
+    }
+  }
+  fclose(file);
+  return count;
+}
+
+/***
+* save_baseline: Writes results as a baseline.
+*/
+static int save_baseline (const char * path, struct bench_result * results, int count, double tolerance) {
+  FILE * file = fopen(path, "w");
+
+  if ( file == NULL )
+    return -1;
+  fprintf(file, "{\n  \"tolerance\": %.2f,\n  \"results\": {\n", tolerance);
+  for ( int i = 0; i < count; i++ )
+    fprintf(file, "    \"%s\": %.3f%s\n", results[i].name, results[i].gb_per_s, i + 1 < count ? "," : "");
+  fprintf(file, "  }\n}\n");
+  return fclose(file);
+}
+
+int main (int argc, char ** argv) {
+  const char * baseline_path = "bench/baseline.json";
+  double tolerance = -1;
+  double baseline_tolerance = DEFAULT_TOLERANCE;
+  bool update = false;
+  struct bench_result results[MAX_RESULTS];
+  struct bench_result baseline[MAX_RESULTS];
+  int count;
+  int baseline_count;
+  int regressions = 0;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "--baseline") == 0 && i + 1 < argc ) {
+      baseline_path = argv[++i];
+    } else if ( strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc ) {
+      tolerance = atof(argv[++i]);
+    } else if ( strcmp(argv[i], "--update") == 0 ) {
+      update = true;
+    } else {
+      fprintf(stderr, "Usage: %s [--baseline FILE] [--tolerance FRACTION] [--update]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ( update ) {
+    double rounds[UPDATE_ROUNDS][MAX_RESULTS];
+    for ( int r = 0; r < UPDATE_ROUNDS; r++ ) {
+      count = run_all(results);
+      for ( int i = 0; i < count; i++ )
+        rounds[r][i] = results[i].gb_per_s;
+    }
+    for ( int i = 0; i < count; i++ ) {
+      double values[UPDATE_ROUNDS];
+      for ( int r = 0; r < UPDATE_ROUNDS; r++ )
+        values[r] = rounds[r][i];
+      qsort(values, UPDATE_ROUNDS, sizeof(double), compare_doubles);
+      results[i].gb_per_s = values[UPDATE_ROUNDS / 2];
+    }
+    if ( tolerance < 0 ) {
+      tolerance = DEFAULT_TOLERANCE;
+      load_baseline(baseline_path, baseline, &tolerance);
+    }
+    if ( save_baseline(baseline_path, results, count, tolerance) != 0 ) {
+      perror("Error writing the baseline");
+      return EXIT_FAILURE;
+    }
+    printf("Wrote %d results to %s.\n", count, baseline_path);
+    return 0;
+  }
+
+  baseline_count = load_baseline(baseline_path, baseline, &baseline_tolerance);
+  if ( baseline_count == -1 ) {
+    perror("Error reading the baseline (make perf-baseline writes one)");
+    return EXIT_FAILURE;
+  }
+  if ( tolerance < 0 )
+    tolerance = baseline_tolerance;
+
+  // Re-run while anything looks like a regression, keeping the best.
+  count = run_all(results);
+  for ( int r = 1; r < CHECK_ROUNDS && count_regressions(results, count, baseline, baseline_count, tolerance) > 0; r++ ) {
+    struct bench_result again[MAX_RESULTS];
+    run_all(again);
+    for ( int i = 0; i < count; i++ )
+      if ( again[i].gb_per_s > results[i].gb_per_s )
+        results[i].gb_per_s = again[i].gb_per_s;
+  }
+
+  printf("%-24s %10s %10s %8s  %s\n", "benchmark", "baseline", "now", "change", "status");
+  for ( int i = 0; i < count; i++ ) {
+    struct bench_result * base = find_result(baseline, baseline_count, results[i].name);
+    if ( base == NULL ) {
+      printf("%-24s %10s %10.3f %8s  new (not in the baseline)\n", results[i].name, "-", results[i].gb_per_s, "-");
+      continue;
+    }
+    double change = results[i].gb_per_s / base->gb_per_s - 1;
+    bool regressed = change < -tolerance;
+    regressions += regressed;
+    printf("%-24s %10.3f %10.3f %+7.1f%%  %s\n", results[i].name, base->gb_per_s, results[i].gb_per_s,
+        change * 100, regressed ? "REGRESSION" : "ok");
+  }
+  for ( int j = 0; j < baseline_count; j++ ) {
+    if ( find_result(results, count, baseline[j].name) == NULL )
+      printf("%-24s %10.3f %10s %8s  missing (in the baseline only)\n", baseline[j].name, baseline[j].gb_per_s, "-", "-");
+  }
+
+  if ( regressions > 0 ) {
+    printf("%d benchmark(s) more than %.0f%% slower than %s (GB/s).\n", regressions, tolerance * 100, baseline_path);
+    return EXIT_FAILURE;
+  }
+  printf("No regressions beyond %.0f%% (GB/s).\n", tolerance * 100);
+  return 0;
+}
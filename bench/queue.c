@@ -0,0 +1,321 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "fs_queue.h"
+
+
+/***
+ * Queue Stress Test and Contention Benchmark:
+ *  * Half the threads push block descriptors into one queue and the
+ *    other half pop them, for the lock free queue (fs_queue.h) and for
+ *    a ring under a mutex, first between threads and then between
+ *    forked processes sharing a MAP_SHARED mapping.
+ *  * Checks that every item came out exactly once, and that each
+ *    consumer saw each producer's items in order; exits with a failure
+ *    if not.
+ *  * Reports the items moved per second. By default it runs at 2, 8,
+ *    64 and 128 threads.
+ *
+ * Usage: bench/queue [--threads N] [--items N] [--capacity N]
+ *   --items is per producer (20000 by default), --capacity a power of
+ *   two (1024 by default).
+ ***/
+
+
+#define DEFAULT_ITEMS 20000
+#define DEFAULT_CAPACITY 1024
+#define MAX_THREADS 512
+// The producer of the items that tell consumers to stop.
+#define STOP_PRODUCER 0xffffffffu
+
+static int thread_counts[] = { 2, 8, 64, 128 };
+
+// What the pool queues: a block of a file.
+struct bench_item {
+  u_int32_t producer;
+  u_int64_t number; // Counts up per producer.
+  u_int64_t seek_to;
+  u_int64_t read_to;
+};
+
+// The same operations on a ring under a (process shared) mutex.
+struct mutex_ring {
+  pthread_mutex_t lock;
+  size_t capacity;
+  size_t head, count;
+  struct bench_item items[];
+};
+
+// Everything the threads or processes share, in one mapping.
+struct bench_shared {
+  bool lock_free; // Which queue to use.
+  int producers, consumers;
+  u_int64_t items; // Per producer.
+  atomic_bool go;
+  atomic_ulong out_of_order;
+  struct fs_queue * queue;
+  struct mutex_ring * ring;
+  atomic_uchar * seen; // Per item: how often it was popped.
+};
+
+static bool ring_push (struct mutex_ring * ring, const struct bench_item * item) {
+  bool pushed = false;
+  pthread_mutex_lock(&ring->lock);
+  if ( ring->count < ring->capacity ) {
+    ring->items[(ring->head + ring->count) % ring->capacity] = *item;
+    ring->count += 1;
+    pushed = true;
+  }
+  pthread_mutex_unlock(&ring->lock);
+  return pushed;
+}
+
+static bool ring_pop (struct mutex_ring * ring, struct bench_item * item) {
+  bool popped = false;
+  pthread_mutex_lock(&ring->lock);
+  if ( ring->count > 0 ) {
+    *item = ring->items[ring->head];
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count -= 1;
+    popped = true;
+  }
+  pthread_mutex_unlock(&ring->lock);
+  return popped;
+}
+
+/***
+* push: Pushes `item`, yielding while the queue is full.
+*/
+static void push (struct bench_shared * shared, const struct bench_item * item) {
+  while ( !(shared->lock_free ? fs_queue_push(shared->queue, item) : ring_push(shared->ring, item)) )
+    sched_yield();
+}
+
+/***
+* pop: Pops an item, yielding while the queue is empty.
+*/
+static void pop (struct bench_shared * shared, struct bench_item * item) {
+  while ( !(shared->lock_free ? fs_queue_pop(shared->queue, item) : ring_pop(shared->ring, item)) )
+    sched_yield();
+}
+
+/***
+* run_role: The loop of thread or process `index`: producers come first.
+*/
+static void run_role (struct bench_shared * shared, int index) {
+  struct bench_item item;
+
+  while ( !atomic_load(&shared->go) )
+    sched_yield();
+  if ( index < shared->producers ) {
+    for ( u_int64_t number = 0; number < shared->items; number++ ) {
+      item.producer = index;
+      item.number = number;
+      item.seek_to = number * 4096;
+      item.read_to = item.seek_to + 4095;
+      push(shared, &item);
+    }
+    return;
+  }
+
+  // The number after the last item seen from each producer.
+  u_int64_t next[MAX_THREADS] = { 0 };
+  for ( ;; ) {
+    pop(shared, &item);
+    if ( item.producer == STOP_PRODUCER )
+      return;
+    if ( item.number < next[item.producer] || item.read_to != item.seek_to + 4095 )
+      atomic_fetch_add(&shared->out_of_order, 1);
+    next[item.producer] = item.number + 1;
+    atomic_fetch_add(&shared->seen[item.producer * shared->items + item.number], 1);
+  }
+}
+
+struct thread_argument {
+  struct bench_shared * shared;
+  int index;
+};
+
+static void * thread_main (void * argument) {
+  struct thread_argument * thread = argument;
+  run_role(thread->shared, thread->index);
+  return NULL;
+}
+
+/***
+* now_ns: The monotonic clock in nanoseconds.
+*/
+static u_int64_t now_ns (void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/***
+* map_shared: Zeroed memory that forked processes share.
+*/
+static void * map_shared (size_t length) {
+  void * memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if ( memory == MAP_FAILED ) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  return memory;
+}
+
+/***
+* run: Moves `items` items per producer through a queue with `threads`
+*   threads (or processes). Prints the rate and returns whether every
+*   item came out once and in order.
+*/
+static bool run (int threads, bool processes, bool lock_free, u_int64_t items, size_t capacity) {
+  struct bench_shared * shared = map_shared(sizeof(struct bench_shared));
+  size_t queue_length = fs_queue_bytes(capacity, sizeof(struct bench_item));
+  size_t ring_length = sizeof(struct mutex_ring) + capacity * sizeof(struct bench_item);
+  size_t seen_length;
+  pthread_t thread_ids[MAX_THREADS];
+  struct thread_argument arguments[MAX_THREADS];
+  pid_t pids[MAX_THREADS];
+  pthread_mutexattr_t attributes;
+  struct bench_item stop = { .producer = STOP_PRODUCER };
+  u_int64_t started, elapsed, missing = 0, repeated = 0;
+
+  shared->lock_free = lock_free;
+  shared->producers = threads / 2;
+  shared->consumers = threads - shared->producers;
+  shared->items = items;
+  seen_length = shared->producers * items;
+  shared->seen = map_shared(seen_length);
+  shared->queue = map_shared(queue_length);
+  fs_queue_init(shared->queue, capacity, sizeof(struct bench_item));
+  shared->ring = map_shared(ring_length);
+  shared->ring->capacity = capacity;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&shared->ring->lock, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+
+  for ( int i = 0; i < threads; i++ ) {
+    if ( processes ) {
+      pids[i] = fork();
+      if ( pids[i] == -1 ) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+      }
+      if ( pids[i] == 0 ) {
+        run_role(shared, i);
+        _exit(0);
+      }
+    } else {
+      arguments[i].shared = shared;
+      arguments[i].index = i;
+      if ( pthread_create(&thread_ids[i], NULL, thread_main, &arguments[i]) != 0 ) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  started = now_ns();
+  atomic_store(&shared->go, true);
+  for ( int i = 0; i < threads; i++ ) {
+    if ( i == shared->producers ) {
+      // The producers are done: stop the consumers.
+      for ( int j = 0; j < shared->consumers; j++ )
+        push(shared, &stop);
+    }
+    if ( processes )
+      waitpid(pids[i], NULL, 0);
+    else
+      pthread_join(thread_ids[i], NULL);
+  }
+  elapsed = now_ns() - started;
+
+  for ( size_t i = 0; i < seen_length; i++ ) {
+    unsigned char count = atomic_load(&shared->seen[i]);
+    if ( count == 0 )
+      missing += 1;
+    else if ( count > 1 )
+      repeated += 1;
+  }
+  bool ok = missing == 0 && repeated == 0 && atomic_load(&shared->out_of_order) == 0;
+  printf("%-9s %-9s %7d %12.2f   %s", processes ? "processes" : "threads", lock_free ? "lock-free" : "mutex",
+         threads, seen_length * 1000.0 / elapsed, ok ? "ok" : "FAILED");
+  if ( !ok )
+    printf(" (%lu missing, %lu repeated, %lu out of order)", (unsigned long)missing, (unsigned long)repeated,
+           (unsigned long)atomic_load(&shared->out_of_order));
+  printf("\n");
+
+  pthread_mutex_destroy(&shared->ring->lock);
+  munmap(shared->ring, ring_length);
+  munmap(shared->queue, queue_length);
+  munmap(shared->seen, seen_length);
+  munmap(shared, sizeof(struct bench_shared));
+  return ok;
+}
+
+int main (int argc, char ** argv) {
+  int threads = 0;
+  u_int64_t items = DEFAULT_ITEMS;
+  size_t capacity = DEFAULT_CAPACITY;
+  bool ok = true;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "--threads") == 0 && i + 1 < argc ) {
+      threads = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "--items") == 0 && i + 1 < argc ) {
+      items = strtoull(argv[++i], NULL, 10);
+    } else if ( strcmp(argv[i], "--capacity") == 0 && i + 1 < argc ) {
+      capacity = strtoul(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Usage: %s [--threads N] [--items N] [--capacity N]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if ( (threads != 0 && (threads < 2 || threads > MAX_THREADS)) || items == 0
+       || capacity < 2 || (capacity & (capacity - 1)) != 0 ) {
+    fprintf(stderr, "%s: threads must be 2 to %d, items at least 1, and the capacity a power of two.\n",
+            argv[0], MAX_THREADS);
+    return EXIT_FAILURE;
+  }
+
+  printf("%-9s %-9s %7s %12s   %s\n", "mode", "queue", "threads", "Mitems/s", "check");
+  for ( int processes = 0; processes < 2; processes++ ) {
+    for ( size_t i = 0; i < sizeof(thread_counts) / sizeof(int); i++ ) {
+      int count = threads != 0 ? threads : thread_counts[i];
+      ok = run(count, processes, true, items, capacity) && ok;
+      ok = run(count, processes, false, items, capacity) && ok;
+      if ( threads != 0 )
+        break;
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
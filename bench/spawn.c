@@ -0,0 +1,158 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "filesums.h"
+
+
+/***
+ * Spawn Latency Benchmark:
+ *  * Sums a small file with 10, 100 and 1000 children, started with
+ *    fork and with posix_spawn (fs_options.spawn), and reports how
+ *    long starting them took (fs_result.start_ns) per child, and the
+ *    whole run.
+ *  * fork copies the parent's page tables, so the parent first fills
+ *    a ballast of --parent-mb megabytes; posix_spawn's cost shouldn't
+ *    depend on it. Run it with --parent-mb 0 for the small parent.
+ *  * Checks that both ways give the same sum.
+ *
+ * Usage: bench/spawn [--parent-mb MB] [--repetitions N] [FILE]
+ *   FILE defaults to file1.dat.
+ ***/
+
+
+#define DEFAULT_PARENT_MB 256
+#define DEFAULT_REPETITIONS 5
+#define MAX_REPETITIONS 64
+
+static int child_counts[] = { 10, 100, 1000 };
+
+/***
+* compare_u64: For qsort.
+*/
+static int compare_u64 (const void * a, const void * b) {
+  u_int64_t x = *(const u_int64_t *)a;
+  u_int64_t y = *(const u_int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/***
+* now_ns: The monotonic clock in nanoseconds.
+*/
+static u_int64_t now_ns (void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/***
+* run: Sums `path` `repetitions` times, filling in the median start
+*   and total times. Returns false if a run failed.
+*/
+static bool run (const char * path, int children, bool spawn, int repetitions,
+    u_int64_t * start_ns, u_int64_t * total_ns, u_int64_t * sum) {
+  u_int64_t starts[MAX_REPETITIONS];
+  u_int64_t totals[MAX_REPETITIONS];
+  struct fs_options options;
+  struct fs_result result;
+
+  fs_options_init(&options);
+  options.child_count = children;
+  options.spawn = spawn;
+  for ( int i = 0; i < repetitions; i++ ) {
+    u_int64_t started = now_ns();
+    if ( fs_sum_file(path, &options, &result) == -1 ) {
+      perror(fs_last_error());
+      return false;
+    }
+    totals[i] = now_ns() - started;
+    starts[i] = result.start_ns;
+    *sum = result.sum;
+    fs_result_free(&result);
+  }
+  qsort(starts, repetitions, sizeof(u_int64_t), compare_u64);
+  qsort(totals, repetitions, sizeof(u_int64_t), compare_u64);
+  *start_ns = starts[repetitions / 2];
+  *total_ns = totals[repetitions / 2];
+  return true;
+}
+
+int main (int argc, char ** argv) {
+  const char * path = "file1.dat";
+  long parent_mb = DEFAULT_PARENT_MB;
+  int repetitions = DEFAULT_REPETITIONS;
+  long page_size = sysconf(_SC_PAGESIZE);
+  char * ballast = NULL;
+  bool ok = true;
+
+  // The spawned children are this program run again.
+  fs_child_main(argc, argv);
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "--parent-mb") == 0 && i + 1 < argc ) {
+      parent_mb = atol(argv[++i]);
+    } else if ( strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc ) {
+      repetitions = atoi(argv[++i]);
+      if ( repetitions < 1 || repetitions > MAX_REPETITIONS )
+        repetitions = DEFAULT_REPETITIONS;
+    } else if ( argv[i][0] != '-' ) {
+      path = argv[i];
+    } else {
+      fprintf(stderr, "Usage: %s [--parent-mb MB] [--repetitions N] [FILE]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Touch every page, so fork has page tables to copy.
+  if ( parent_mb > 0 ) {
+    ballast = malloc(parent_mb * 1024 * 1024);
+    if ( ballast == NULL ) {
+      perror("malloc");
+      return EXIT_FAILURE;
+    }
+    for ( long i = 0; i < parent_mb * 1024 * 1024; i += page_size )
+      ballast[i] = 1;
+  }
+
+  printf("%8s %-6s %9s %10s %12s %10s\n", "children", "mode", "parent MB", "start ms", "us/child", "total ms");
+  for ( size_t c = 0; c < sizeof(child_counts) / sizeof(child_counts[0]); c++ ) {
+    int children = child_counts[c];
+    u_int64_t sums[2];
+    for ( int spawn = 0; spawn < 2; spawn++ ) {
+      u_int64_t start_ns, total_ns;
+      if ( !run(path, children, spawn, repetitions, &start_ns, &total_ns, &sums[spawn]) )
+        return EXIT_FAILURE;
+      printf("%8d %-6s %9ld %10.2f %12.1f %10.2f\n", children, spawn ? "spawn" : "fork", parent_mb,
+          start_ns / 1e6, start_ns / 1e3 / children, total_ns / 1e6);
+    }
+    if ( sums[0] != sums[1] ) {
+      fprintf(stderr, "MISMATCH with %d children: fork %lu, spawn %lu\n", children, sums[0], sums[1]);
+      ok = false;
+    }
+  }
+  free(ballast);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,4790 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <limits.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#include "filesums.h"
+#include "fs_kernel.h"
+#include "fs_queue.h"
+
+
+/***
+ * Library Structure:
+ *  * Automatic tuning
+ *    * Picks the child count from the hardware (auto_tune) and
+ *      remembers which counts were fastest on this host.
+ *  * NUMA placement
+ *    * Pins children to CPUs, with one contiguous run of blocks per node.
+ *  * Block readers
+ *    * Hand out a child's block from stdio, a read buffer or a mapping.
+ *  * Scan kernels (fs_kernel.h)
+ *    * Turn the chunks handed out by the readers into sums.
+ *  * Tracing
+ *    * Records spans per process into shared rings, written out as a
+ *      Chrome trace (trace_file).
+ *  * Result cache
+ *    * Replays the result of an unchanged file from disk instead of
+ *      summing it again, or only the blocks that changed (result_cache).
+ *  * Groups
+ *    * Sends each child's per key sums (fs_group.h) to the parent,
+ *      which merges them (key_column).
+ *  * Child process handling
+ *    * Forks the children, which sum their block and write the
+ *      result to a pipe.
+ *  * "epoll" polling
+ *    * Watches the pipes and notifies of writes by children.
+ *  * Remote workers
+ *    * Hands the blocks to `sums --worker` processes over TCP instead
+ *      (workers), and serves them on the worker side.
+ *  * Worker pool
+ *    * Keeps forked workers around for many jobs (fs_pool_create),
+ *      fed blocks through a lock free queue in shared memory (fs_queue.h).
+ *  * Async engine
+ *    * Sums many small files in threads, each with many files in
+ *      flight through io_uring (fs_sum_files).
+ *  * Public API
+ *    * fs_job_* and fs_sum_* (see filesums.h).
+ ***/
+
+
+// A file being summed by children (see fs_job_start).
+struct fs_job {
+  struct fs_options options;
+  char * path;
+  struct stat stat_buf;
+  struct fs_result * result;
+  int epoll_fd;
+  struct child_info * children; // result->child_count children.
+  u_int16_t waiting_for; // Children that have yet to return their sum.
+  bool failed; // Whether a child died without a result (or a worker failed).
+  int failed_errno; // And why, for fs_job_finish.
+  const char * failed_step;
+  struct tune_info * tune;
+  struct timespec collecting; // When fs_job_start handed over to fs_job_next.
+  struct trace * trace; // NULL unless tracing.
+  // With remote workers (options.workers) instead of children:
+  struct remote_worker * workers;
+  int worker_count;
+  int workers_alive;
+  u_int16_t * pending; // Blocks waiting for a worker, taken from the end.
+  int pending_count;
+  char * wire_path; // The path sent to the workers.
+  bool pool_claimed; // Whether it is using options.pool.
+  // The part of the file being summed (see range_bounds).
+  u_int64_t range_start;
+  u_int64_t range_end;
+  // The compiled options.where, and `filter` pointing to it (NULL
+  // without one; see filter_compile).
+  struct fs_where where;
+  const struct fs_where * filter;
+  // The groups of options.key_column, and `groups` pointing to them
+  // (NULL without; see groups_start). A child's own, in a child.
+  struct fs_groups group_table;
+  struct fs_groups * groups;
+  // With the result cache (options.result_cache):
+  struct timespec started_real; // When the job started, by the wall clock.
+  char cache_identity[256]; // The file and options.
+  char cache_version[128]; // The file's size and timestamps.
+  char * cache_entry; // The file the result is stored in.
+  struct fs_partial * stored; // The partials that were stored, or NULL.
+  u_int16_t stored_count;
+  struct fs_partial * replay; // The partials of a cache hit, or NULL.
+  u_int16_t replayed; // How many of them fs_job_next has handed out.
+};
+
+// Which step failed, for fs_last_error.
+static __thread const char * last_error = "No error";
+
+const char * fs_last_error (void) {
+  return last_error;
+}
+
+/***
+* fail: Records which step failed, and returns -1 for convenience.
+*   errno is left as the failing call set it.
+*/
+static int fail (const char * what) {
+  last_error = what;
+  return -1;
+}
+
+/***
+ *
+ * Automatic Tuning Section
+ *
+ */
+
+// Below this many bytes per child, forking the child costs
+// more time than it saves.
+#define AUTO_MIN_BLOCK (1024 * 1024)
+// More children than this would run into the open file limit
+// (two pipe ends per child).
+#define AUTO_MAX_CHILDREN 256
+// The page cache probe maps this much of the file at a time,
+// so the residency vector stays small for very large files.
+#define AUTO_PROBE_WINDOW (256 * 1024 * 1024)
+// Older measurements are averaged over at most this many runs,
+// so the cache still adapts when the host changes.
+#define AUTO_MAX_RUNS 8
+
+// What auto_tune found out about the host and the input file.
+struct tune_info {
+  char host[64];
+  int cpus; // CPUs the affinity mask allows.
+  double quota; // CPUs the cgroup allows, 0 if unlimited.
+  double cached; // Fraction of the file in the page cache.
+  bool is_cached; // Whether the file is (mostly) cached.
+  int size_class; // log2 of the file size.
+  int max_children;
+  struct timespec start; // When the children were started.
+};
+
+// One remembered measurement (a line in the tune cache file).
+struct tune_entry {
+  char host[64];
+  int size_class;
+  int is_cached;
+  int children;
+  double bytes_per_sec;
+  int runs;
+};
+
+/***
+* available_cpus: The number of CPUs this process is allowed to run on.
+*/
+static int available_cpus (void) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if ( sched_getaffinity(0, sizeof(set), &set) == 0 )
+    return CPU_COUNT(&set);
+  // Fall back to all online CPUs.
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  return online > 0 ? online : 1;
+}
+
+/***
+* cgroup_cpu_quota: The CPU quota of the cgroup, in CPUs.
+*   Returns 0 if there is no quota (or it can't be read).
+*/
+static double cgroup_cpu_quota (void) {
+  long long quota = -1, period = 0;
+  char max[32];
+  FILE * file;
+
+  // cgroup v2: "<quota> <period>" or "max <period>".
+  if ( ( file = fopen("/sys/fs/cgroup/cpu.max", "r") ) != NULL ) {
+    if ( fscanf(file, "%31s %lld", max, &period) == 2 && strcmp(max, "max") != 0 )
+      quota = atoll(max);
+    fclose(file);
+    return quota > 0 && period > 0 ? (double)quota / period : 0;
+  }
+
+  // cgroup v1: two files, with a quota of -1 meaning unlimited.
+  if ( ( file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r") ) != NULL ) {
+    if ( fscanf(file, "%lld", &quota) != 1 )
+      quota = -1;
+    fclose(file);
+  }
+  if ( ( file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r") ) != NULL ) {
+    if ( fscanf(file, "%lld", &period) != 1 )
+      period = 0;
+    fclose(file);
+  }
+  return quota > 0 && period > 0 ? (double)quota / period : 0;
+}
+
+/***
+* cached_fraction: How much of a file is in the page cache (0 to 1).
+*   Maps the file window by window and asks mincore which pages
+*   are resident. Nothing is read, so this doesn't pull the file in.
+*
+* `path` (char *): The path to the file to probe.
+* `size` (u_int64_t): The size of the file.
+*/
+static double cached_fraction (const char * path, u_int64_t size) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  u_int64_t resident = 0, pages = 0;
+  unsigned char * vec;
+  int fd = open(path, O_RDONLY);
+
+  if ( fd == -1 || size == 0 ) {
+    if ( fd != -1 )
+      close(fd);
+    return 0;
+  }
+  vec = malloc(AUTO_PROBE_WINDOW / page_size);
+  if ( vec == NULL ) {
+    close(fd);
+    return 0;
+  }
+
+  for ( u_int64_t offset = 0; offset < size; offset += AUTO_PROBE_WINDOW ) {
+    size_t length = size - offset < AUTO_PROBE_WINDOW ? size - offset : AUTO_PROBE_WINDOW;
+    size_t count = (length + page_size - 1) / page_size;
+    void * map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, offset);
+
+    if ( map == MAP_FAILED )
+      break;
+    if ( mincore(map, length, vec) == 0 ) {
+      for ( size_t i = 0; i < count; i++ )
+        resident += vec[i] & 1;
+      pages += count;
+    }
+    munmap(map, length);
+  }
+
+  free(vec);
+  close(fd);
+  return pages ? (double)resident / pages : 0;
+}
+
+/***
+* cache_path: Writes the location of one of the caches into `path`.
+*
+* `chosen` (const char *): The location chosen in the options, or NULL.
+* `name` (const char *): The default name, under "$XDG_CACHE_HOME/file-sums".
+*/
+static void cache_path (const char * chosen, const char * name, char * path, size_t length) {
+  char * cache_home = getenv("XDG_CACHE_HOME");
+  char * home = getenv("HOME");
+
+  if ( chosen != NULL )
+    snprintf(path, length, "%s", chosen);
+  else if ( cache_home != NULL && cache_home[0] != '\0' )
+    snprintf(path, length, "%s/file-sums/%s", cache_home, name);
+  else
+    snprintf(path, length, "%s/.cache/file-sums/%s", home ? home : ".", name);
+}
+
+/***
+* make_parent_dirs: Creates the directories `path` is in
+*   (e.g. "~/.cache" and "file-sums"), ignoring any errors.
+*/
+static void make_parent_dirs (char * path) {
+  for ( char * slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/') ) {
+    *slash = '\0';
+    mkdir(path, 0755);
+    *slash = '/';
+  }
+}
+
+/***
+* tune_load: Reads every entry in the tune cache.
+*   Returns a malloc'd array (or NULL), with the length in `count`.
+*/
+static struct tune_entry * tune_load (const char * path, int * count) {
+  struct tune_entry * entries = NULL;
+  struct tune_entry entry;
+  FILE * file = fopen(path, "r");
+
+  *count = 0;
+  if ( file == NULL )
+    return NULL;
+  while ( fscanf(file, "%63s %d %d %d %lf %d",
+        entry.host, &entry.size_class, &entry.is_cached,
+        &entry.children, &entry.bytes_per_sec, &entry.runs) == 6 ) {
+    entries = realloc(entries, (*count + 1) * sizeof(struct tune_entry));
+    entries[*count] = entry;
+    *count += 1;
+  }
+  fclose(file);
+  return entries;
+}
+
+/***
+* tune_matches: Whether an entry was measured for this host and input.
+*/
+static bool tune_matches (struct tune_entry * entry, struct tune_info * tune) {
+  return strcmp(entry->host, tune->host) == 0
+    && entry->size_class == tune->size_class
+    && entry->is_cached == tune->is_cached;
+}
+
+/***
+* tune_pick: Picks the number of children for auto_tune.
+*   Starts from what the hardware suggests, then uses (and explores
+*   around) the fastest count remembered for this host.
+*
+* `tune` (struct tune_info *): Filled in with what was found out.
+* `path` (const char *): The input file.
+* `size` (u_int64_t): The size of the input file.
+* `tune_cache` (const char *): The tune cache from the options, or NULL.
+*/
+static int tune_pick (struct tune_info * tune, const char * path, u_int64_t size, const char * tune_cache) {
+  char cache_file[4096];
+  int count;
+  int usable;
+  int children;
+  struct tune_entry * entries;
+  struct tune_entry * best = NULL;
+
+  memset(tune, 0, sizeof(*tune));
+  gethostname(tune->host, sizeof(tune->host) - 1);
+  tune->cpus = available_cpus();
+  tune->quota = cgroup_cpu_quota();
+  tune->cached = cached_fraction(path, size);
+  tune->is_cached = tune->cached >= 0.5;
+  tune->size_class = size ? 63 - __builtin_clzll(size) : 0;
+
+  // A quota of 1.5 CPUs can still keep two children busy part of the time.
+  usable = tune->cpus;
+  if ( tune->quota > 0 && tune->quota < usable )
+    usable = (int)tune->quota + ( tune->quota > (int)tune->quota );
+  if ( usable < 1 )
+    usable = 1;
+
+  // Never more children than there are worthwhile blocks.
+  tune->max_children = size / AUTO_MIN_BLOCK;
+  if ( tune->max_children > usable * 2 )
+    tune->max_children = usable * 2;
+  if ( tune->max_children > AUTO_MAX_CHILDREN )
+    tune->max_children = AUTO_MAX_CHILDREN;
+  if ( tune->max_children < 1 )
+    tune->max_children = 1;
+
+  // A cached file is CPU bound: one child per CPU. Otherwise the
+  // disk is the bottleneck, and twice as many children keep more
+  // reads in flight.
+  children = tune->is_cached ? usable : usable * 2;
+  if ( children > tune->max_children )
+    children = tune->max_children;
+
+  // Look for the fastest setting measured on this host.
+  cache_path(tune_cache, "auto-tune", cache_file, sizeof(cache_file));
+  entries = tune_load(cache_file, &count);
+  for ( int i = 0; i < count; i++ ) {
+    if ( tune_matches(&entries[i], tune) && entries[i].children <= tune->max_children
+        && ( best == NULL || entries[i].bytes_per_sec > best->bytes_per_sec ) )
+      best = &entries[i];
+  }
+
+  if ( best != NULL ) {
+    // Try the neighbours of the fastest count once each, so
+    // repeated runs climb towards the measured optimum.
+    int neighbours[2] = { best->children * 2, best->children / 2 };
+    children = best->children;
+    for ( int n = 0; n < 2 && children == best->children; n++ ) {
+      bool measured = false;
+      if ( neighbours[n] < 1 || neighbours[n] > tune->max_children )
+        continue;
+      for ( int i = 0; i < count; i++ )
+        if ( tune_matches(&entries[i], tune) && entries[i].children == neighbours[n] )
+          measured = true;
+      if ( !measured )
+        children = neighbours[n];
+    }
+  }
+
+  free(entries);
+  return children;
+}
+
+/***
+* tune_record: Remembers how fast the run was, for later auto_tune runs.
+*   Failing to write the cache only produces a warning.
+*
+* `tune` (struct tune_info *): What tune_pick found out.
+* `children` (int): The number of children that were used.
+* `size` (u_int64_t): The size of the input file.
+* `tune_cache` (const char *): The tune cache from the options, or NULL.
+*/
+static void tune_record (struct tune_info * tune, int children, u_int64_t size, const char * tune_cache) {
+  char path[4096];
+  char temp_path[4160];
+  int count;
+  struct timespec end;
+  struct tune_entry * entries;
+  struct tune_entry * entry = NULL;
+  double seconds;
+  FILE * file;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - tune->start.tv_sec) + (end.tv_nsec - tune->start.tv_nsec) / 1e9;
+  if ( seconds <= 0 )
+    return;
+
+  cache_path(tune_cache, "auto-tune", path, sizeof(path));
+  entries = tune_load(path, &count);
+  for ( int i = 0; i < count; i++ )
+    if ( tune_matches(&entries[i], tune) && entries[i].children == children )
+      entry = &entries[i];
+  if ( entry == NULL ) {
+    entries = realloc(entries, (count + 1) * sizeof(struct tune_entry));
+    entry = &entries[count];
+    count += 1;
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->host, tune->host);
+    entry->size_class = tune->size_class;
+    entry->is_cached = tune->is_cached;
+    entry->children = children;
+  }
+  // Running average over the last few runs.
+  if ( entry->runs < AUTO_MAX_RUNS )
+    entry->runs += 1;
+  entry->bytes_per_sec += (size / seconds - entry->bytes_per_sec) / entry->runs;
+
+  make_parent_dirs(path);
+
+  // Write a temporary file and rename it over the cache, so
+  // concurrent runs never see a half written cache.
+  snprintf(temp_path, sizeof(temp_path), "%s.%d", path, getpid());
+  file = fopen(temp_path, "w");
+  if ( file == NULL ) {
+    fprintf(stderr, "Warn: could not write tune cache %s.\n", path);
+    free(entries);
+    return;
+  }
+  for ( int i = 0; i < count; i++ )
+    fprintf(file, "%s %d %d %d %.0f %d\n",
+        entries[i].host, entries[i].size_class, entries[i].is_cached,
+        entries[i].children, entries[i].bytes_per_sec, entries[i].runs);
+  if ( fclose(file) != 0 || rename(temp_path, path) != 0 ) {
+    fprintf(stderr, "Warn: could not write tune cache %s.\n", path);
+    unlink(temp_path);
+  }
+  free(entries);
+}
+
+/***
+ *
+ * NUMA Placement Section
+ *
+ */
+
+// Nodes beyond this are folded into the last one.
+#define NUMA_MAX_NODES 64
+
+// Which CPUs belong to which NUMA node, limited to the
+// CPUs this process is allowed to run on.
+struct numa_topology {
+  int node_count;
+  int node_ids[NUMA_MAX_NODES]; // The kernel's number for each node.
+  cpu_set_t cpus[NUMA_MAX_NODES];
+};
+
+// Filled in by numa_discover before the children are forked.
+static struct numa_topology numa_topology = { .node_count = 0 };
+
+/***
+* parse_cpulist: Adds the CPUs in a sysfs cpulist ("0-3,8,10-11") to `set`.
+*/
+static void parse_cpulist (char * list, cpu_set_t * set) {
+  char * range = strtok(list, ",\n");
+  while ( range != NULL ) {
+    int first, last;
+    int matched = sscanf(range, "%d-%d", &first, &last);
+    if ( matched == 1 )
+      last = first;
+    for ( int cpu = first; matched >= 1 && cpu <= last && cpu < CPU_SETSIZE; cpu++ )
+      CPU_SET(cpu, set);
+    range = strtok(NULL, ",\n");
+  }
+}
+
+/***
+* numa_discover: Reads the NUMA nodes from sysfs into numa_topology.
+*   Machines without NUMA information are treated as a single node.
+*/
+static void numa_discover (void) {
+  cpu_set_t allowed;
+  cpu_set_t online; // The node numbers, in the same list format.
+  char path[64];
+  char list[4096];
+  FILE * file;
+
+  CPU_ZERO(&allowed);
+  CPU_ZERO(&online);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  numa_topology.node_count = 0;
+
+  // Only look at the nodes that exist; probing every possible node
+  // costs about a millisecond per job.
+  if ( ( file = fopen("/sys/devices/system/node/online", "r") ) != NULL ) {
+    if ( fgets(list, sizeof(list), file) != NULL )
+      parse_cpulist(list, &online);
+    fclose(file);
+  }
+
+  for ( int node = 0; node < CPU_SETSIZE && numa_topology.node_count < NUMA_MAX_NODES; node++ ) {
+    cpu_set_t * cpus = &numa_topology.cpus[numa_topology.node_count];
+    if ( !CPU_ISSET(node, &online) )
+      continue;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if ( ( file = fopen(path, "r") ) == NULL )
+      continue;
+    CPU_ZERO(cpus);
+    if ( fgets(list, sizeof(list), file) != NULL )
+      parse_cpulist(list, cpus);
+    fclose(file);
+    // Skip memory-only nodes, and nodes we may not run on.
+    CPU_AND(cpus, cpus, &allowed);
+    if ( CPU_COUNT(cpus) == 0 )
+      continue;
+    numa_topology.node_ids[numa_topology.node_count] = node;
+    numa_topology.node_count += 1;
+  }
+
+  if ( numa_topology.node_count == 0 ) {
+    numa_topology.node_count = 1;
+    numa_topology.node_ids[0] = 0;
+    numa_topology.cpus[0] = allowed;
+  }
+}
+
+/***
+* numa_node_of: The node (as numbered by the kernel) a CPU belongs to,
+*   or -1 if it isn't known.
+*/
+static int numa_node_of (int cpu) {
+  for ( int i = 0; cpu >= 0 && i < numa_topology.node_count; i++ )
+    if ( CPU_ISSET(cpu, &numa_topology.cpus[i]) )
+      return numa_topology.node_ids[i];
+  return -1;
+}
+
+/***
+* numa_place: Pins the calling child to a single CPU.
+*   Children are split into one contiguous run per node, so each node
+*   reads one contiguous range of the file, and then spread over the
+*   CPUs of their node. Memory the child allocates (including page
+*   cache filled by its reads) is preferred on the same node.
+*
+* `child_num` (u_int16_t): Which child is being placed.
+* `child_count` (u_int16_t): How many children there are in total.
+*/
+static void numa_place (u_int16_t child_num, u_int16_t child_count) {
+  int index = (u_int64_t)child_num * numa_topology.node_count / child_count;
+  // The first child on the same node, to spread the node's children
+  // over its CPUs starting from its first CPU.
+  int first = (index * child_count + numa_topology.node_count - 1) / numa_topology.node_count;
+  cpu_set_t * node_cpus = &numa_topology.cpus[index];
+  int nth = (child_num - first) % CPU_COUNT(node_cpus);
+  unsigned long node_mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+  int node = numa_topology.node_ids[index];
+  cpu_set_t pin;
+
+  for ( int cpu = 0; cpu < CPU_SETSIZE; cpu++ ) {
+    if ( CPU_ISSET(cpu, node_cpus) && nth-- == 0 ) {
+      CPU_ZERO(&pin);
+      CPU_SET(cpu, &pin);
+      if ( sched_setaffinity(0, sizeof(pin), &pin) == -1 )
+        perror("Warn: could not pin child");
+      break;
+    }
+  }
+
+  // Not fatal: kernels without NUMA support refuse this.
+  if ( node < (int)(8 * sizeof(node_mask)) ) {
+    node_mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, node_mask, 8 * sizeof(node_mask));
+  }
+}
+
+/***
+ *
+ * Block Reader Section
+ *
+ */
+
+// Size of a child's read buffer; two 2 MB huge pages on x86-64.
+// Multi-megabyte reads also keep O_DIRECT efficient.
+#define READ_BUFFER_SIZE (4 * 1024 * 1024)
+// O_DIRECT offsets and lengths must be multiples of the device's
+// logical block size; 4 KB covers the devices in use today.
+#define DIRECT_ALIGN 4096
+// How much to read at a time once past the end of the block,
+// while looking for the end of the last line.
+#define READ_TAIL_SIZE 4096
+// How much the stdio reader copies out of stdio at a time.
+#define STDIO_CHUNK_SIZE (64 * 1024)
+// How large to make an input pipe, so a producer can get further
+// ahead before it blocks (capped by /proc/sys/fs/pipe-max-size).
+#define STREAM_PIPE_SIZE (1024 * 1024)
+
+static const char * page_kind_names[] = { "small", "thp", "hugetlb" };
+
+const char * fs_page_kind_name (int page_kind) {
+  if ( page_kind < FS_PAGES_SMALL || page_kind > FS_PAGES_HUGETLB )
+    return "unknown";
+  return page_kind_names[page_kind];
+}
+
+// Hands out a child's part of the file one chunk at a time,
+// from stdio, from a read buffer or from a mapping of the file.
+struct block_reader {
+  int fd;
+  FILE * file; // For the stdio reader (fd is then its descriptor).
+  void * stdio_buffer; // The huge page backed stdio buffer.
+  u_int64_t offset; // File offset of the next chunk.
+  u_int64_t read_to; // Last byte of the block.
+  u_int64_t file_size;
+  char * buffer; // The read buffer.
+  size_t buffer_size;
+  char * map; // Or the mapping, from map_offset to the end of the file.
+  u_int64_t map_offset;
+  size_t map_length;
+  enum fs_page_kind page_kind;
+  bool direct; // Opened with O_DIRECT.
+  bool stream; // A stream (such as a pipe), read with read() to its end.
+  bool drop_cache; // Drop chunks from the page cache once parsed.
+  u_int64_t prefetch; // The prefetch window, 0 for none.
+  u_int64_t dropped_to; // For --drop-cache: dropped from the cache up to here.
+  u_int64_t prefetched_to; // For --prefetch: asked to be read up to here.
+  struct timespec first_byte; // When the first chunk was handed out.
+};
+
+/***
+* range_bounds: Sets the job's range_start and range_end from its
+*   options' byte range, within the file.
+*/
+static void range_bounds (struct fs_job * job) {
+  u_int64_t size = job->stat_buf.st_size;
+
+  job->range_start = job->options.range_offset < size ? job->options.range_offset : size;
+  job->range_end = size;
+  if ( job->options.range_length > 0 && job->options.range_length < size - job->range_start )
+    job->range_end = job->range_start + job->options.range_length;
+}
+
+/***
+* block_open_at: Where reading a block starts: one byte before it, so
+*   the handlers can see if the block starts on a new record, except
+*   for the block at the start of the range.
+*/
+static u_int64_t block_open_at (struct fs_job * job, u_int64_t seek_to) {
+  return seek_to > job->range_start ? seek_to - 1 : seek_to;
+}
+
+/***
+* prefetch_hint: Tells the kernel a child reads front to back from
+*   `offset`, which makes readahead ramp up faster from the seek point,
+*   and asks for the first --prefetch window to be read right away.
+*   Returns where the prefetched window ends.
+*/
+static u_int64_t prefetch_hint (struct fs_job * job, int fd, u_int64_t offset) {
+  u_int64_t size = job->range_end;
+  u_int64_t window = job->options.prefetch;
+
+  posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+  if ( window == 0 || job->options.direct )
+    return offset;
+  if ( offset + window > size )
+    window = size > offset ? size - offset : 0;
+  posix_fadvise(fd, offset, window, POSIX_FADV_WILLNEED);
+  return offset + window;
+}
+
+/***
+* reader_prefetch: Keeps the --prefetch window ahead of the reader.
+*   Asks for more once half the window has been used, rather than
+*   for every chunk.
+*/
+static void reader_prefetch (struct block_reader * reader) {
+  u_int64_t window = reader->prefetch;
+  u_int64_t target = reader->offset + window;
+
+  if ( window == 0 || reader->direct || reader->prefetched_to >= reader->file_size )
+    return;
+  if ( target > reader->file_size )
+    target = reader->file_size;
+  if ( target < reader->prefetched_to + window / 2 && target != reader->file_size )
+    return;
+  if ( target > reader->prefetched_to ) {
+    u_int64_t from = reader->prefetched_to > reader->offset ? reader->prefetched_to : reader->offset;
+    posix_fadvise(reader->fd, from, target - from, POSIX_FADV_WILLNEED);
+    reader->prefetched_to = target;
+  }
+}
+
+/***
+* alloc_read_buffer: Allocates a read buffer, backed by huge pages
+*   if they are wanted and available.
+*   Falls back to transparent huge pages, then to regular pages.
+*
+* `size` (size_t): Size of the buffer, a multiple of the huge page size.
+* `huge` (bool): Whether huge pages should be tried.
+* `kind` (enum fs_page_kind *): Set to what the buffer ended up backed by.
+*/
+static void * alloc_read_buffer (size_t size, bool huge, enum fs_page_kind * kind) {
+  void * buffer = MAP_FAILED;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  *kind = FS_PAGES_SMALL;
+  if ( huge ) {
+    // Only works if huge pages were reserved (vm.nr_hugepages).
+    buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if ( buffer != MAP_FAILED )
+      *kind = FS_PAGES_HUGETLB;
+  }
+  if ( buffer == MAP_FAILED )
+    buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if ( buffer == MAP_FAILED )
+    return NULL;
+  if ( huge && *kind == FS_PAGES_SMALL && madvise(buffer, size, MADV_HUGEPAGE) == 0 )
+    *kind = FS_PAGES_THP;
+  return buffer;
+}
+
+/***
+* open_and_seek_to: Opens a file, seeks to a given position
+* and then returns the opened/seeked stream (or NULL).
+*
+* `path` (const char *): The path to the file to open.
+* `position` (u_int64_t): The position within the file to seek to.
+*/
+static FILE * open_and_seek_to (const char * path, u_int64_t position) {
+  FILE * file = fopen(path, "r");
+  if ( file != NULL )
+    fseek(file, position, SEEK_SET);
+  return file;
+}
+
+/***
+* reader_stdio_buffers: Allocates the buffer the stdio reader copies
+*   chunks into, and gives stdio a huge page backed buffer if wanted.
+*/
+static int reader_stdio_buffers (struct block_reader * reader, bool huge) {
+  if ( huge ) {
+    reader->stdio_buffer = alloc_read_buffer(READ_BUFFER_SIZE, true, &reader->page_kind);
+    if ( reader->stdio_buffer != NULL )
+      setvbuf(reader->file, reader->stdio_buffer, _IOFBF, READ_BUFFER_SIZE);
+  }
+  reader->buffer_size = STDIO_CHUNK_SIZE;
+  reader->buffer = alloc_read_buffer(STDIO_CHUNK_SIZE, false, &(enum fs_page_kind){0});
+  return reader->buffer != NULL ? 0 : -1;
+}
+
+/***
+* reader_open_stream: Prepares a reader for a stream that can't be
+*   split (such as a pipe), read to its end. The reader takes over `fd`.
+*   Data is read straight into the read buffer, without going through
+*   stdio; pipes are also enlarged so the producer blocks less often.
+*/
+static int reader_open_stream (struct block_reader * reader, int fd, bool huge) {
+  struct stat stat_buf;
+
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = fd;
+  reader->stream = true;
+  reader->read_to = (u_int64_t)-2;
+  reader->file_size = (u_int64_t)-1;
+  if ( fstat(fd, &stat_buf) == 0 && S_ISFIFO(stat_buf.st_mode) )
+    // Best effort: the pipe keeps its size if this isn't allowed.
+    fcntl(fd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+  reader->buffer_size = READ_BUFFER_SIZE;
+  reader->buffer = alloc_read_buffer(READ_BUFFER_SIZE, huge, &reader->page_kind);
+  return reader->buffer != NULL ? 0 : -1;
+}
+
+/***
+* reader_open: Prepares a reader for the part of the job's file starting
+*   at `offset`, as set up by the reader, huge_pages and direct options.
+*   Returns -1 (with errno set) if the file can't be opened or mapped.
+*/
+static int reader_open (struct block_reader * reader, struct fs_job * job, u_int64_t offset, u_int64_t read_to) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  bool mapped = job->options.reader == FS_READER_MMAP;
+  bool huge = job->options.huge_pages;
+
+  memset(reader, 0, sizeof(*reader));
+  reader->offset = offset;
+  reader->read_to = read_to;
+  // The range's end is the end of the file, as far as blocks go.
+  reader->file_size = job->range_end;
+  reader->dropped_to = offset;
+  reader->drop_cache = job->options.drop_cache;
+  reader->prefetch = job->options.prefetch;
+  reader->fd = -1;
+
+  if ( job->options.reader == FS_READER_STDIO ) {
+    // Open the file for reading and seek to the
+    // start of the block that this child is responsible for.
+    reader->file = open_and_seek_to(job->path, offset);
+    if ( reader->file == NULL )
+      return -1;
+    reader->fd = fileno(reader->file);
+    reader->prefetched_to = prefetch_hint(job, reader->fd, offset);
+    return reader_stdio_buffers(reader, huge);
+  }
+
+  if ( job->options.direct ) {
+    reader->fd = open(job->path, O_RDONLY | O_DIRECT);
+    reader->direct = reader->fd != -1;
+    // Some filesystems (e.g. tmpfs) refuse O_DIRECT;
+    // dropping the pages after reading comes closest.
+    if ( reader->fd == -1 && errno == EINVAL )
+      reader->drop_cache = true;
+  }
+  if ( reader->fd == -1 )
+    reader->fd = open(job->path, O_RDONLY);
+  if ( reader->fd == -1 )
+    return -1;
+  reader->prefetched_to = prefetch_hint(job, reader->fd, offset);
+
+  if ( !mapped ) {
+    reader->buffer_size = READ_BUFFER_SIZE;
+    reader->buffer = alloc_read_buffer(READ_BUFFER_SIZE, huge, &reader->page_kind);
+    return reader->buffer != NULL ? 0 : -1;
+  }
+
+  // Map to the end of the file, since the last line of the
+  // block may go past read_to. Pages that aren't touched
+  // are never read.
+  reader->map_offset = offset - offset % page_size;
+  reader->map_length = reader->file_size - reader->map_offset;
+  if ( reader->map_length == 0 )
+    return 0;
+  reader->map = mmap(NULL, reader->map_length, PROT_READ, MAP_PRIVATE, reader->fd, reader->map_offset);
+  if ( reader->map == MAP_FAILED ) {
+    reader->map = NULL;
+    return -1;
+  }
+  madvise(reader->map, reader->map_length, MADV_SEQUENTIAL);
+  // Filesystems with large folio support can back the mapping
+  // with huge pages; others just ignore the advice.
+  if ( huge && madvise(reader->map, reader->map_length, MADV_HUGEPAGE) == 0 )
+    reader->page_kind = FS_PAGES_THP;
+  return 0;
+}
+
+/***
+* reader_drop: Drops what has been read so far from the page cache
+*   (for --drop-cache). Only whole pages are dropped by the kernel.
+*/
+static void reader_drop (struct block_reader * reader) {
+  // Pages that are still mapped can't be dropped; mapped
+  // readers drop everything in reader_close instead.
+  if ( reader->map != NULL )
+    return;
+  if ( reader->drop_cache && reader->offset > reader->dropped_to ) {
+    posix_fadvise(reader->fd, reader->dropped_to, reader->offset - reader->dropped_to, POSIX_FADV_DONTNEED);
+    reader->dropped_to = reader->offset;
+  }
+}
+
+/***
+* reader_next_direct: reader_next for O_DIRECT, which can only read
+*   whole, aligned blocks into the (page aligned) buffer. The chunk
+*   starts inside the first block, and may run past the end of the
+*   block being summed; the caller only parses what it needs.
+*/
+static ssize_t reader_next_direct (struct block_reader * reader, const char ** data, size_t want) {
+  u_int64_t aligned = reader->offset - reader->offset % DIRECT_ALIGN;
+  size_t skip = reader->offset - aligned;
+  // Round the length up to whole blocks; the file's unaligned
+  // tail comes back as a short read.
+  size_t length = (skip + want + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+  ssize_t got;
+
+  if ( length > READ_BUFFER_SIZE )
+    length = READ_BUFFER_SIZE;
+  got = pread(reader->fd, reader->buffer, length, aligned);
+  if ( got <= (ssize_t)skip )
+    return got < 0 ? -1 : 0;
+  // Whole blocks can go past the end of the range.
+  if ( (size_t)got - skip > want )
+    got = skip + want;
+  *data = reader->buffer + skip;
+  reader->offset += got - skip;
+  return got - skip;
+}
+
+/***
+* reader_next_stream: Reads the next chunk of a stream, as much as is
+*   available up to `want` bytes. Returns 0 at the end of the stream.
+*/
+static ssize_t reader_next_stream (struct block_reader * reader, const char ** data, size_t want) {
+  ssize_t length;
+
+  do
+    length = read(reader->fd, reader->buffer, want);
+  while ( length == -1 && errno == EINTR );
+  if ( length > 0 ) {
+    *data = reader->buffer;
+    reader->offset += length;
+  }
+  return length;
+}
+
+/***
+* reader_read: Points `data` at the next chunk of the file (see reader_next).
+*/
+static ssize_t reader_read (struct block_reader * reader, const char ** data) {
+  ssize_t length;
+  size_t want;
+
+  // The previous chunk has been parsed by now.
+  reader_drop(reader);
+
+  if ( reader->map != NULL ) {
+    // Hand out the mapping a buffer's worth at a time, so the
+    // reader knows how far the child got.
+    length = reader->map_offset + reader->map_length - reader->offset;
+    if ( length > READ_BUFFER_SIZE )
+      length = READ_BUFFER_SIZE;
+    *data = reader->map + (reader->offset - reader->map_offset);
+    reader->offset += length;
+    reader_prefetch(reader);
+    return length;
+  }
+  if ( reader->buffer == NULL )
+    return 0;
+
+  // Read up to the end of the block, then only small pieces
+  // while the last line is being finished.
+  if ( reader->offset <= reader->read_to && reader->read_to - reader->offset < reader->buffer_size )
+    want = reader->read_to + 1 - reader->offset;
+  else if ( reader->offset <= reader->read_to )
+    want = reader->buffer_size;
+  else
+    want = READ_TAIL_SIZE;
+  // Stop at the end of the range (streams have no end).
+  if ( reader->offset >= reader->file_size )
+    return 0;
+  if ( want > reader->file_size - reader->offset )
+    want = reader->file_size - reader->offset;
+
+  if ( reader->direct )
+    return reader_next_direct(reader, data, want);
+  if ( reader->stream )
+    return reader_next_stream(reader, data, want);
+  if ( reader->file != NULL ) {
+    length = fread(reader->buffer, 1, want, reader->file);
+    if ( length == 0 && ferror(reader->file) )
+      return -1;
+    *data = reader->buffer;
+    reader->offset += length;
+    return length;
+  }
+  length = pread(reader->fd, reader->buffer, want, reader->offset);
+  if ( length > 0 ) {
+    *data = reader->buffer;
+    reader->offset += length;
+    reader_prefetch(reader);
+  }
+  return length;
+}
+
+/***
+* reader_next: Points `data` at the next chunk of the file.
+*   Returns the chunk length, 0 at the end of the file, or -1 on error.
+*/
+static ssize_t reader_next (struct block_reader * reader, const char ** data) {
+  ssize_t length = reader_read(reader, data);
+  // Remember when the first data arrived, for --stats.
+  if ( length > 0 && reader->first_byte.tv_sec == 0 && reader->first_byte.tv_nsec == 0 )
+    clock_gettime(CLOCK_MONOTONIC, &reader->first_byte);
+  return length;
+}
+
+/***
+* reader_close: Releases the reader's buffer or mapping and its file.
+*/
+static void reader_close (struct block_reader * reader) {
+  // Mapped pages can only be dropped once they are unmapped.
+  if ( reader->map != NULL )
+    munmap(reader->map, reader->map_length);
+  reader->map = NULL;
+  reader_drop(reader);
+  if ( reader->buffer != NULL )
+    munmap(reader->buffer, reader->buffer_size);
+  if ( reader->file != NULL )
+    fclose(reader->file);
+  else if ( reader->fd != -1 )
+    close(reader->fd);
+  if ( reader->stdio_buffer != NULL )
+    munmap(reader->stdio_buffer, READ_BUFFER_SIZE);
+}
+
+/***
+ *
+ * Hardware Counter Section
+ *
+ */
+
+// The --counters events, in the order of the fs_partial fields.
+#define COUNTER_COUNT 4
+static const struct {
+  u_int32_t type;
+  u_int64_t config;
+} counter_events[COUNTER_COUNT] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  // What perf calls cache-misses: last level cache misses.
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES }
+};
+
+// The --counters counters, opened as one group so they are
+// scheduled (and multiplexed) together.
+struct counter_group {
+  int leader;
+  int fds[COUNTER_COUNT]; // -1 for the ones that aren't available.
+};
+
+/***
+* perf_open: Opens a hardware counter for the calling process
+*   (user space only, so it works with perf_event_paranoid=2).
+*   A counter without a group starts disabled; one in a group
+*   follows its leader. Returns -1 if it isn't available.
+*
+* `type` (u_int32_t): The perf event type (e.g. PERF_TYPE_HW_CACHE).
+* `config` (u_int64_t): The event within the type.
+* `group` (int): The group leader, or -1 for a counter of its own.
+* `read_format` (u_int64_t): What a read returns (e.g. PERF_FORMAT_GROUP).
+*/
+static int perf_open (u_int32_t type, u_int64_t config, int group, u_int64_t read_format) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = group == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = read_format;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/***
+* perf_read: Reads a counter's value, or returns -1 if it isn't open.
+*/
+static u_int64_t perf_read (int fd) {
+  u_int64_t value;
+  if ( fd == -1 || read(fd, &value, sizeof(value)) != sizeof(value) )
+    return -1;
+  return value;
+}
+
+/***
+* counters_open: Opens and starts the --counters group. The first
+*   event that is available leads the group.
+*/
+static void counters_open (struct counter_group * group) {
+  group->leader = -1;
+  for ( int i = 0; i < COUNTER_COUNT; i++ ) {
+    group->fds[i] = perf_open(counter_events[i].type, counter_events[i].config, group->leader, PERF_FORMAT_GROUP);
+    if ( group->leader == -1 )
+      group->leader = group->fds[i];
+  }
+  if ( group->leader != -1 )
+    ioctl(group->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/***
+* counters_close: Stops the --counters group and reads it into
+*   `values` (in counter_events order, -1 where not available).
+*/
+static void counters_close (struct counter_group * group, u_int64_t * values) {
+  // The number of counters, then their values in the order they joined.
+  u_int64_t data[1 + COUNTER_COUNT];
+  u_int64_t joined = 0;
+  bool have_data;
+
+  if ( group->leader != -1 )
+    ioctl(group->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  have_data = group->leader != -1 && read(group->leader, data, sizeof(data)) >= (ssize_t)sizeof(u_int64_t);
+  for ( int i = 0; i < COUNTER_COUNT; i++ ) {
+    values[i] = -1;
+    if ( group->fds[i] == -1 )
+      continue;
+    if ( have_data && joined < data[0] )
+      values[i] = data[1 + joined];
+    joined += 1;
+    close(group->fds[i]);
+  }
+}
+
+/***
+ *
+ * Tracing Section
+ *
+ */
+
+// Spans kept per child; a child records only a handful.
+#define TRACE_CHILD_SPANS 64
+// Spans kept for the parent, per child (fork, collect) plus a few.
+#define TRACE_PARENT_SPANS_PER_CHILD 4
+#define TRACE_PARENT_SPANS 16
+
+// A finished span. `name` is a string literal, which is at the same
+// address in the children since they are forks of the parent.
+struct trace_span {
+  const char * name;
+  u_int64_t start_ns;
+  u_int64_t end_ns;
+};
+
+// The spans of one process. Each ring has a single writer and is
+// only read once that writer is done (its result read from its pipe,
+// or it was reaped), so there are no locks. When full, the oldest
+// spans are overwritten.
+struct trace_ring {
+  u_int32_t capacity;
+  u_int32_t count; // Spans ever recorded.
+  struct trace_span spans[];
+};
+
+// The rings of a job: rings[0] is the parent's, rings[n + 1] child n's.
+// They live in one shared mapping, made before forking, so the
+// parent sees what the children recorded.
+struct trace {
+  const char * path;
+  int ring_count;
+  struct trace_ring ** rings;
+  void * map;
+  size_t map_length;
+};
+
+/***
+* trace_now: The CLOCK_MONOTONIC time in nanoseconds.
+*/
+static inline u_int64_t trace_now (void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/***
+* trace_record: Adds a span from `start_ns` to `end_ns` to a ring.
+*/
+static void trace_record (struct trace_ring * ring, const char * name, u_int64_t start_ns, u_int64_t end_ns) {
+  struct trace_span * span = &ring->spans[ring->count % ring->capacity];
+  span->name = name;
+  span->start_ns = start_ns;
+  span->end_ns = end_ns;
+  ring->count += 1;
+}
+
+// Spans cost one predictable branch when tracing is off.
+// TRACE_BEGIN returns the start time to pass to TRACE_END.
+#define TRACE_RING(TRACE, N) ( (TRACE) != NULL ? (TRACE)->rings[N] : NULL )
+#define TRACE_BEGIN(RING) ( (RING) != NULL ? trace_now() : 0 )
+#define TRACE_END(RING, NAME, START) \
+  do { if ( (RING) != NULL ) trace_record((RING), (NAME), (START), trace_now()); } while ( 0 )
+
+/***
+* trace_open: Allocates the rings for a parent and `children` children,
+*   to be written to `path`. Returns NULL on failure.
+*/
+static struct trace * trace_open (const char * path, int children) {
+  struct trace * trace = calloc(1, sizeof(struct trace));
+  size_t parent_size = sizeof(struct trace_ring)
+    + (TRACE_PARENT_SPANS + (size_t)children * TRACE_PARENT_SPANS_PER_CHILD) * sizeof(struct trace_span);
+  size_t child_size = sizeof(struct trace_ring) + TRACE_CHILD_SPANS * sizeof(struct trace_span);
+  char * at;
+
+  if ( trace == NULL )
+    return NULL;
+  trace->path = path;
+  trace->ring_count = children + 1;
+  trace->rings = calloc(trace->ring_count, sizeof(struct trace_ring *));
+  trace->map_length = parent_size + (size_t)children * child_size;
+  // Only the pages that are written to get memory.
+  trace->map = mmap(NULL, trace->map_length, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if ( trace->rings == NULL || trace->map == MAP_FAILED ) {
+    free(trace->rings);
+    free(trace);
+    return NULL;
+  }
+  at = trace->map;
+  for ( int i = 0; i < trace->ring_count; i++ ) {
+    trace->rings[i] = (struct trace_ring *)at;
+    trace->rings[i]->capacity = ( i == 0 ? parent_size : child_size ) - sizeof(struct trace_ring);
+    trace->rings[i]->capacity /= sizeof(struct trace_span);
+    at += i == 0 ? parent_size : child_size;
+  }
+  return trace;
+}
+
+/***
+* trace_write: Writes the spans as a Chrome trace (JSON, for
+*   chrome://tracing or Perfetto), with one track per process.
+*   Returns -1 if the file can't be written.
+*/
+static int trace_write (struct trace * trace) {
+  FILE * file = fopen(trace->path, "w");
+  u_int64_t origin = (u_int64_t)-1;
+  bool first = true;
+  int pid = getpid();
+
+  if ( file == NULL )
+    return -1;
+  // Start the trace at the earliest span.
+  for ( int i = 0; i < trace->ring_count; i++ ) {
+    struct trace_ring * ring = trace->rings[i];
+    u_int32_t kept = ring->count < ring->capacity ? ring->count : ring->capacity;
+    for ( u_int32_t j = 0; j < kept; j++ )
+      if ( ring->spans[j].start_ns < origin )
+        origin = ring->spans[j].start_ns;
+  }
+
+  fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  for ( int i = 0; i < trace->ring_count; i++ ) {
+    struct trace_ring * ring = trace->rings[i];
+    u_int32_t kept = ring->count < ring->capacity ? ring->count : ring->capacity;
+    if ( kept == 0 )
+      continue;
+    fprintf(file, "%s{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %d, "
+        "\"args\": {\"name\": \"", first ? "" : ",\n", pid, i);
+    if ( i == 0 )
+      fprintf(file, "parent\"}}");
+    else
+      fprintf(file, "child %d\"}}", i - 1);
+    first = false;
+    // Oldest first.
+    for ( u_int32_t j = ring->count - kept; j < ring->count; j++ ) {
+      struct trace_span * span = &ring->spans[j % ring->capacity];
+      fprintf(file, ",\n{\"ph\": \"X\", \"name\": \"%s\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+          span->name, pid, i, (span->start_ns - origin) / 1e3, (span->end_ns - span->start_ns) / 1e3);
+    }
+  }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0 ? 0 : -1;
+}
+
+/***
+* trace_close: Writes the trace (if `write` is set) and frees it.
+*   Returns -1 if the trace couldn't be written.
+*/
+static int trace_close (struct trace * trace, bool write) {
+  int status = 0;
+
+  if ( trace == NULL )
+    return 0;
+  if ( write )
+    status = trace_write(trace);
+  munmap(trace->map, trace->map_length);
+  free(trace->rings);
+  free(trace);
+  return status;
+}
+
+/***
+ *
+ * Result Cache Section
+ *
+ * With fs_options.result_cache, finished results are kept in a
+ * directory with a small file per file and options, and a later job
+ * on the same unchanged file replays the stored partials instead of
+ * starting any children.
+ *
+ * The file is identified by its device and inode, and is unchanged
+ * while its size and modification and change times (to the
+ * nanosecond) are the same. The change time can't be set back the way
+ * the modification time can, so a rewritten file is never replayed.
+ *
+ * Each partial is stored with a hash of the bytes its sum depends on
+ * (from the byte before its block to the end of its last record). When
+ * a file changed but kept its size and block layout, each child hashes
+ * its block first and only parses it if the hash changed, reusing the
+ * stored sum otherwise; so a small in-place edit costs a hash of the
+ * file and a parse of the blocks that were edited.
+ *
+ * Entry: RESULT_CACHE_MAGIC, the identity line (the device, inode and
+ * options), the version line (size, mtime, ctime), "sum records
+ * block_size child_count", then "sum records seek_to read_to bytes
+ * hash" per partial. The entry's name is a hash of the identity line.
+ */
+
+#define RESULT_CACHE_MAGIC "file-sums-result 2"
+// Files changed less than this long before the job started aren't
+// stored: another write within the same timestamp tick wouldn't
+// change the version.
+#define RESULT_CACHE_RACY_NS 2000000000LL
+
+/***
+* timespec_ns: A timestamp in nanoseconds.
+*/
+static int64_t timespec_ns (const struct timespec * time) {
+  return time->tv_sec * 1000000000LL + time->tv_nsec;
+}
+
+/***
+* hash_lane: Mixes an 8 byte word into one of block_hash's lanes.
+*/
+static inline u_int64_t hash_lane (u_int64_t lane, u_int64_t word) {
+  lane ^= word * 0x9E3779B97F4A7C15ULL;
+  lane = (lane << 31) | (lane >> 33);
+  return lane * 0xC2B2AE3D27D4EB4FULL;
+}
+
+/***
+* block_hash: Hashes `length` bytes of the job's file from `offset`,
+*   in four independent lanes of 8 byte words so the multiplies
+*   overlap. The block is mapped rather than read, as copying it
+*   would cost more than the hash. Returns 0 if the file couldn't be
+*   mapped (0 never comes out of a successful hash).
+*/
+static u_int64_t block_hash (struct fs_job * job, u_int64_t offset, u_int64_t length) {
+  u_int64_t lanes[4] = { 1, 2, 3, 4 };
+  u_int64_t hash = length;
+  u_int64_t page_offset = offset % sysconf(_SC_PAGESIZE);
+  u_int64_t words[4] = { 0 };
+  const unsigned char * data;
+  size_t map_length = page_offset + length;
+  size_t i;
+  void * map;
+  int fd;
+
+  if ( length == 0 )
+    return 1;
+  fd = open(job->path, O_RDONLY);
+  if ( fd == -1 )
+    return 0;
+  map = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, offset - page_offset);
+  close(fd);
+  if ( map == MAP_FAILED )
+    return 0;
+  madvise(map, map_length, MADV_SEQUENTIAL);
+  data = (const unsigned char *)map + page_offset;
+
+  for ( i = 0; i + 32 <= length; i += 32 ) {
+    memcpy(words, data + i, sizeof(words));
+    for ( int lane = 0; lane < 4; lane++ )
+      lanes[lane] = hash_lane(lanes[lane], words[lane]);
+  }
+  // The last partial stripe, padded with zeros.
+  if ( i < length ) {
+    memset(words, 0, sizeof(words));
+    memcpy(words, data + i, length - i);
+    for ( int lane = 0; lane < 4; lane++ )
+      lanes[lane] = hash_lane(lanes[lane], words[lane]);
+  }
+  munmap(map, map_length);
+
+  for ( int lane = 0; lane < 4; lane++ )
+    hash = hash_lane(hash, lanes[lane]);
+  // Final avalanche (from MurmurHash3's fmix64).
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  return hash != 0 ? hash : 1;
+}
+
+/***
+* result_key: Fills in the identity and version lines of the job's
+*   file and options, and the path of its entry.
+*/
+static void result_key (struct fs_job * job) {
+  struct stat * stat_buf = &job->stat_buf;
+  char dir[4096];
+  char * entry;
+  u_int64_t hash = 14695981039346656037ULL; // FNV-1a.
+
+  snprintf(job->cache_identity, sizeof(job->cache_identity), "%lu %lu %d %d %d %s %d %lu",
+      (u_int64_t)stat_buf->st_dev, (u_int64_t)stat_buf->st_ino,
+      job->options.delimiter, job->options.width, job->options.is_signed,
+      job->options.auto_tune ? "auto" : "fixed", job->options.child_count, job->options.block_size);
+  // Each range has its own blocks.
+  if ( job->range_start > 0 || job->range_end < (u_int64_t)stat_buf->st_size ) {
+    size_t length = strlen(job->cache_identity);
+    snprintf(job->cache_identity + length, sizeof(job->cache_identity) - length, " range %lu %lu",
+        job->range_start, job->range_end - job->range_start);
+  }
+  // And each filter its own sums (told apart by a hash of its text).
+  if ( job->options.where != NULL ) {
+    size_t length = strlen(job->cache_identity);
+    u_int64_t where_hash = 14695981039346656037ULL;
+    for ( const char * c = job->options.where; *c != '\0'; c++ )
+      where_hash = (where_hash ^ (unsigned char)*c) * 1099511628211ULL;
+    snprintf(job->cache_identity + length, sizeof(job->cache_identity) - length, " where %016lx", where_hash);
+  }
+  snprintf(job->cache_version, sizeof(job->cache_version), "%ld %ld.%09ld %ld.%09ld", (long)stat_buf->st_size,
+      stat_buf->st_mtim.tv_sec, stat_buf->st_mtim.tv_nsec, stat_buf->st_ctim.tv_sec, stat_buf->st_ctim.tv_nsec);
+  for ( const char * c = job->cache_identity; *c != '\0'; c++ )
+    hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+  cache_path(job->options.result_cache_dir, "results", dir, sizeof(dir));
+  if ( asprintf(&entry, "%s/%016lx", dir, hash) != -1 )
+    job->cache_entry = entry;
+}
+
+/***
+* read_line: Reads a line of `file` and checks it against `expected`.
+*/
+static bool read_line (FILE * file, char * line, size_t length, const char * expected) {
+  size_t expected_length = strlen(expected);
+  return fgets(line, length, file) != NULL && strncmp(line, expected, expected_length) == 0
+    && line[expected_length] == '\n';
+}
+
+/***
+* result_load: Looks the job up in the result cache. If the file is
+*   unchanged, fills in the layout of the result and the partials to
+*   replay and returns true. If only its contents changed, keeps the
+*   stored partials for the children (job->stored) and returns false.
+*/
+static bool result_load (struct fs_job * job) {
+  struct fs_result * result = job->result;
+  struct fs_partial * partials = NULL;
+  char line[512];
+  long size;
+  u_int64_t sum, records, block_size;
+  u_int64_t sum_check = 0, records_check = 0;
+  unsigned count = 0;
+  bool valid, unchanged;
+  FILE * file;
+
+  result_key(job);
+  if ( job->cache_entry == NULL || (file = fopen(job->cache_entry, "r")) == NULL )
+    return false;
+  valid = read_line(file, line, sizeof(line), RESULT_CACHE_MAGIC)
+    && read_line(file, line, sizeof(line), job->cache_identity)
+    && fgets(line, sizeof(line), file) != NULL;
+  unchanged = valid && strncmp(line, job->cache_version, strlen(job->cache_version)) == 0
+    && line[strlen(job->cache_version)] == '\n';
+  // A different size moves the blocks, so nothing can be reused.
+  valid = valid && sscanf(line, "%ld", &size) == 1 && (u_int64_t)size == (u_int64_t)job->stat_buf.st_size
+    && fscanf(file, "%lu %lu %lu %u", &sum, &records, &block_size, &count) == 4
+    && count >= 1 && count <= 65535
+    && ( partials = calloc(count, sizeof(struct fs_partial)) ) != NULL;
+  for ( unsigned i = 0; valid && i < count; i++ ) {
+    struct fs_partial * partial = &partials[i];
+    valid = fscanf(file, "%lu %lu %lu %lu %lu %lu", &partial->sum, &partial->records,
+        &partial->seek_to, &partial->read_to, &partial->bytes, &partial->hash) == 6;
+    // Nothing was measured.
+    partial->child_num = i;
+    partial->cpu = partial->node = -1;
+    partial->dtlb_misses = partial->cycles = partial->instructions = (u_int64_t)-1;
+    partial->branch_misses = partial->llc_misses = (u_int64_t)-1;
+    partial->reused = true;
+    sum_check += partial->sum;
+    records_check += partial->records;
+  }
+  fclose(file);
+
+  // A damaged entry is a miss.
+  if ( !valid || sum_check != sum || records_check != records || partials[count - 1].read_to != job->range_end ) {
+    free(partials);
+    return false;
+  }
+  job->stored = partials;
+  job->stored_count = count;
+  if ( !unchanged )
+    return false;
+  result->block_size = block_size;
+  result->child_count = count;
+  result->from_cache = true;
+  return true;
+}
+
+/***
+* result_reuse: Whether a child's block is unchanged since `stored`
+*   was stored, going by its hash. If so, fills in its stored sum.
+*/
+static bool result_reuse (struct fs_job * job, struct fs_partial * stored, u_int64_t seek_to, u_int64_t read_to,
+    struct fs_partial * result) {
+  u_int64_t open_at = block_open_at(job, seek_to);
+
+  if ( stored->seek_to != seek_to || stored->read_to != read_to || stored->hash == 0
+      || block_hash(job, open_at, stored->bytes) != stored->hash )
+    return false;
+  result->sum = stored->sum;
+  result->records = stored->records;
+  result->bytes = stored->bytes;
+  result->hash = stored->hash;
+  result->reused = true;
+  // Nothing was parsed, so the counters don't apply.
+  result->dtlb_misses = result->cycles = result->instructions = (u_int64_t)-1;
+  result->branch_misses = result->llc_misses = (u_int64_t)-1;
+  return true;
+}
+
+/***
+* result_store: Stores the job's finished result in the result cache,
+*   unless the file changed during the run or just before it.
+*/
+static void result_store (struct fs_job * job) {
+  struct fs_result * result = job->result;
+  struct stat now;
+  char temp_path[4160];
+  int64_t started = timespec_ns(&job->started_real);
+  FILE * file;
+
+  if ( stat(job->path, &now) == -1 || now.st_dev != job->stat_buf.st_dev
+      || now.st_ino != job->stat_buf.st_ino || now.st_size != job->stat_buf.st_size
+      || timespec_ns(&now.st_mtim) != timespec_ns(&job->stat_buf.st_mtim)
+      || timespec_ns(&now.st_ctim) != timespec_ns(&job->stat_buf.st_ctim) )
+    return;
+  if ( started - timespec_ns(&now.st_mtim) < RESULT_CACHE_RACY_NS
+      || started - timespec_ns(&now.st_ctim) < RESULT_CACHE_RACY_NS )
+    return;
+
+  // Write a temporary file and rename it over the entry, so
+  // concurrent runs never see a half written entry.
+  make_parent_dirs(job->cache_entry);
+  snprintf(temp_path, sizeof(temp_path), "%s.%d", job->cache_entry, getpid());
+  file = fopen(temp_path, "w");
+  if ( file == NULL ) {
+    fprintf(stderr, "Warn: could not write result cache %s.\n", job->cache_entry);
+    return;
+  }
+  fprintf(file, "%s\n%s\n%s\n%lu %lu %lu %d\n", RESULT_CACHE_MAGIC, job->cache_identity, job->cache_version,
+      result->sum, result->records, result->block_size, result->child_count);
+  for ( int i = 0; i < result->child_count; i++ ) {
+    struct fs_partial * partial = &result->partials[i];
+    fprintf(file, "%lu %lu %lu %lu %lu %lu\n", partial->sum, partial->records, partial->seek_to,
+        partial->read_to, partial->bytes, partial->hash);
+  }
+  if ( fclose(file) != 0 || rename(temp_path, job->cache_entry) != 0 ) {
+    fprintf(stderr, "Warn: could not write result cache %s.\n", job->cache_entry);
+    unlink(temp_path);
+  }
+}
+
+/***
+ *
+ * Range Section
+ *
+ * A job with fs_options.range_offset or range_length sums just those
+ * bytes of the file, as if they were the whole file: the first block
+ * starts at the range's first byte instead of looking for the start of
+ * a record, and the last block stops at the range's end. Only the
+ * range is split into blocks (range_bounds and block_open_at, with
+ * the block reader).
+ *
+ * With record_start or record_count, the range is worked out from record numbers
+ * first. Records are what the scan counts: delimited records with a
+ * digit, or every `width` digits without a delimiter, or with a key
+ * column, lines with a digit in their value field. For files of
+ * fixed length records (checked on a sample of them) that is a
+ * multiplication. Otherwise a sparse index of where every
+ * RANGE_INDEX_EVERY-th record starts is built with one pass over the
+ * file, and the records from the nearest indexed one to the wanted one
+ * are counted. With the result cache, the index is kept in an "index"
+ * directory next to the results (keyed and invalidated like them);
+ * otherwise it only lasts for the job, and nothing is written.
+ *
+ * Index entry: RANGE_INDEX_MAGIC, the identity line (device, inode,
+ * delimiter, width, key and value columns, separator), the version line (size, mtime, ctime), the
+ * number of offsets, then one offset per line.
+ */
+
+#define RANGE_INDEX_MAGIC "file-sums-index 1"
+#define RANGE_INDEX_EVERY 65536
+// Records checked before a file is taken to have fixed length records.
+#define RANGE_STRIDE_SAMPLES 64
+// Longest record a fixed stride is looked for in.
+#define RANGE_MAX_STRIDE 4096
+#define RANGE_CHUNK (256 * 1024)
+
+/***
+* record_counts: Whether a digit `c` in field `field` (from 0) counts
+*   towards a record: any digit does, but with a key column only those
+*   of the value field (as in the grouped kernels).
+*/
+static inline bool record_counts (const struct fs_options * options, int field, char c) {
+  if ( (unsigned char)( c - '0' ) >= 10 )
+    return false;
+  return options->key_column == 0 || field == options->value_column - 1;
+}
+
+/***
+* record_separator: The field separator, with a key column; -1 (which
+*   no byte is) without one.
+*/
+static inline int record_separator (const struct fs_options * options) {
+  if ( options->key_column == 0 )
+    return -1;
+  return options->separator != 0 ? options->separator : ',';
+}
+
+/***
+* record_is_plain: Whether `line` (`length` bytes, the boundary
+*   excluded) is a record that fixed stride records could have: a
+*   digit (in the value field, with a key column), or exactly `width`
+*   digits and nothing else without a delimiter, and no boundary
+*   inside.
+*/
+static bool record_is_plain (const char * line, size_t length, const struct fs_options * options) {
+  bool lines = options->delimiter != FS_NO_DELIMITER || options->key_column != 0;
+  int boundary = options->delimiter == FS_NO_DELIMITER ? '\n' : options->delimiter;
+  int separator = record_separator(options);
+  int digits = 0;
+  int field = 0;
+
+  for ( size_t i = 0; i < length; i++ ) {
+    if ( line[i] == boundary )
+      return false;
+    field += line[i] == separator;
+    digits += record_counts(options, field, line[i]);
+  }
+  return lines ? digits > 0 : digits == options->width;
+}
+
+/***
+* range_stride: The length of every record (boundary included), if the
+*   file's records all look alike on a sample of them; 0 if not.
+*/
+static u_int64_t range_stride (struct fs_job * job, int fd) {
+  int boundary = job->options.delimiter == FS_NO_DELIMITER ? '\n' : job->options.delimiter;
+  u_int64_t size = job->stat_buf.st_size;
+  char line[RANGE_MAX_STRIDE];
+  ssize_t got = pread(fd, line, sizeof(line), 0);
+  char * end;
+  u_int64_t stride, count;
+
+  if ( got <= 0 || ( end = memchr(line, boundary, got) ) == NULL )
+    return 0;
+  stride = end + 1 - line;
+  // The last record may be missing its boundary.
+  if ( size % stride != 0 && size % stride != stride - 1 )
+    return 0;
+  count = ( size + 1 ) / stride;
+  for ( int i = 0; i < RANGE_STRIDE_SAMPLES; i++ ) {
+    u_int64_t record = i == RANGE_STRIDE_SAMPLES - 1 ? count - 1 : count * i / RANGE_STRIDE_SAMPLES;
+    u_int64_t at = record * stride;
+    size_t length = at + stride <= size ? stride : size - at;
+    if ( pread(fd, line, length, at) != (ssize_t)length )
+      return 0;
+    if ( length == stride && line[stride - 1] != boundary )
+      return 0;
+    if ( !record_is_plain(line, stride - 1, &job->options) )
+      return 0;
+  }
+  return stride;
+}
+
+/***
+* record_walk: Counts records from `offset`, where record `record`
+*   starts, until record `target` starts, and returns its offset (the
+*   end of the file if there are fewer records). With `index`, also
+*   notes where every RANGE_INDEX_EVERY-th record starts in it.
+*   With a key column, records are lines (up to the delimiter) with a
+*   digit in their value field, as the grouped kernels count them.
+*/
+static u_int64_t record_walk (struct fs_job * job, int fd, u_int64_t offset, u_int64_t record, u_int64_t target,
+    u_int64_t * index, u_int64_t * index_count) {
+  struct fs_options * options = &job->options;
+  bool lines = options->delimiter != FS_NO_DELIMITER || options->key_column != 0;
+  int boundary = options->delimiter == FS_NO_DELIMITER ? '\n' : options->delimiter;
+  int separator = record_separator(options);
+  int width = options->width;
+  char * buffer = malloc(RANGE_CHUNK);
+  int digits = 0;
+  int field = 0;
+  ssize_t got;
+
+  if ( buffer == NULL )
+    return (u_int64_t)-1;
+  // Delimited records start right after the last one's boundary,
+  // so the first one starts here.
+  if ( lines ) {
+    if ( record == target ) {
+      free(buffer);
+      return offset;
+    }
+    if ( index != NULL && record % RANGE_INDEX_EVERY == 0 )
+      index[(*index_count)++] = offset;
+  }
+  while ( ( got = pread(fd, buffer, RANGE_CHUNK, offset) ) > 0 ) {
+    for ( ssize_t i = 0; i < got; i++ ) {
+      bool digit = (unsigned char)( buffer[i] - '0' ) < 10;
+      u_int64_t start = offset + i + 1;
+      if ( !lines ) {
+        // Records start at a digit, every `width` digits.
+        if ( !digit )
+          continue;
+        if ( digits == 0 ) {
+          start = offset + i;
+          if ( record == target ) {
+            free(buffer);
+            return start;
+          }
+          if ( index != NULL && record % RANGE_INDEX_EVERY == 0 )
+            index[(*index_count)++] = start;
+        }
+        if ( ++digits == width ) {
+          digits = 0;
+          record += 1;
+        }
+        continue;
+      }
+      if ( buffer[i] != boundary ) {
+        field += buffer[i] == separator;
+        digits += record_counts(options, field, buffer[i]);
+        continue;
+      }
+      field = 0;
+      if ( digits == 0 )
+        continue;
+      digits = 0;
+      record += 1;
+      if ( record == target ) {
+        free(buffer);
+        return start;
+      }
+      if ( index != NULL && record % RANGE_INDEX_EVERY == 0 )
+        index[(*index_count)++] = start;
+    }
+    offset += got;
+  }
+  free(buffer);
+  return got == -1 ? (u_int64_t)-1 : (u_int64_t)job->stat_buf.st_size;
+}
+
+/***
+* range_index: The file's sparse record index, built now or, with the
+*   result cache, from the cache (and stored there, unless the file
+*   changed too recently to trust its timestamps). Returns NULL on
+*   failure.
+*/
+static u_int64_t * range_index (struct fs_job * job, int fd, u_int64_t * count) {
+  struct stat * stat_buf = &job->stat_buf;
+  char identity[128];
+  char version[128];
+  char line[512];
+  char dir[4096];
+  char * entry = NULL;
+  u_int64_t hash = 14695981039346656037ULL; // FNV-1a.
+  u_int64_t capacity = stat_buf->st_size / RANGE_INDEX_EVERY + 2;
+  u_int64_t * index = malloc(capacity * sizeof(u_int64_t));
+  struct timespec now;
+  FILE * file;
+
+  if ( index == NULL )
+    return NULL;
+  snprintf(identity, sizeof(identity), "%lu %lu %d %d %d %d %d", (u_int64_t)stat_buf->st_dev,
+      (u_int64_t)stat_buf->st_ino, job->options.delimiter, job->options.width, job->options.key_column,
+      job->options.value_column, record_separator(&job->options));
+  snprintf(version, sizeof(version), "%ld %ld.%09ld %ld.%09ld", (long)stat_buf->st_size,
+      stat_buf->st_mtim.tv_sec, stat_buf->st_mtim.tv_nsec, stat_buf->st_ctim.tv_sec, stat_buf->st_ctim.tv_nsec);
+  for ( const char * c = identity; *c != '\0'; c++ )
+    hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+  // Beside the results in a chosen cache directory, where the names
+  // of the entries could collide.
+  if ( job->options.result_cache_dir != NULL )
+    snprintf(dir, sizeof(dir), "%s/index", job->options.result_cache_dir);
+  else
+    cache_path(NULL, "index", dir, sizeof(dir));
+  if ( !job->options.result_cache || asprintf(&entry, "%s/%016lx", dir, hash) == -1 )
+    entry = NULL;
+
+  // A stored index of the unchanged file.
+  *count = 0;
+  file = entry != NULL ? fopen(entry, "r") : NULL;
+  if ( file != NULL ) {
+    bool valid = read_line(file, line, sizeof(line), RANGE_INDEX_MAGIC)
+      && read_line(file, line, sizeof(line), identity) && read_line(file, line, sizeof(line), version)
+      && fscanf(file, "%lu", count) == 1 && *count <= capacity;
+    for ( u_int64_t i = 0; valid && i < *count; i++ )
+      valid = fscanf(file, "%lu", &index[i]) == 1;
+    fclose(file);
+    if ( valid ) {
+      free(entry);
+      return index;
+    }
+    *count = 0;
+  }
+
+  if ( record_walk(job, fd, 0, 0, (u_int64_t)-1, index, count) == (u_int64_t)-1 ) {
+    free(entry);
+    free(index);
+    return NULL;
+  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  if ( entry != NULL && timespec_ns(&now) - timespec_ns(&stat_buf->st_mtim) >= RESULT_CACHE_RACY_NS
+      && timespec_ns(&now) - timespec_ns(&stat_buf->st_ctim) >= RESULT_CACHE_RACY_NS ) {
+    char temp_path[4160];
+    make_parent_dirs(entry);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", entry, getpid());
+    file = fopen(temp_path, "w");
+    if ( file != NULL ) {
+      fprintf(file, "%s\n%s\n%s\n%lu\n", RANGE_INDEX_MAGIC, identity, version, *count);
+      for ( u_int64_t i = 0; i < *count; i++ )
+        fprintf(file, "%lu\n", index[i]);
+      if ( fclose(file) != 0 || rename(temp_path, entry) != 0 )
+        unlink(temp_path);
+    }
+  }
+  free(entry);
+  return index;
+}
+
+/***
+* record_offset: Where record `record` starts (the end of the file if
+*   there are fewer), from the sparse index.
+*/
+static u_int64_t record_offset (struct fs_job * job, int fd, u_int64_t * index, u_int64_t count, u_int64_t record) {
+  u_int64_t nearest = record / RANGE_INDEX_EVERY;
+
+  if ( nearest >= count )
+    return job->stat_buf.st_size;
+  return record_walk(job, fd, index[nearest], nearest * RANGE_INDEX_EVERY, record, NULL, NULL);
+}
+
+/***
+* range_resolve: Turns the options' record range, if there is one,
+*   into a byte range. Returns -1 if the file couldn't be read.
+*/
+static int range_resolve (struct fs_job * job) {
+  struct fs_options * options = &job->options;
+  u_int64_t size = job->stat_buf.st_size;
+  u_int64_t first = options->record_start;
+  u_int64_t last = first + options->record_count;
+  u_int64_t start, end, stride;
+  int fd;
+
+  if ( first == 0 && options->record_count == 0 )
+    return 0;
+  if ( options->record_count == 0 || last < first )
+    last = (u_int64_t)-1;
+  fd = open(job->path, O_RDONLY);
+  if ( fd == -1 )
+    return -1;
+  stride = range_stride(job, fd);
+  if ( stride > 0 ) {
+    start = first < size / stride + 1 ? first * stride : size;
+    end = last < size / stride + 1 ? last * stride : size;
+  } else {
+    u_int64_t count;
+    u_int64_t * index = range_index(job, fd, &count);
+    if ( index == NULL ) {
+      close(fd);
+      return -1;
+    }
+    start = record_offset(job, fd, index, count, first);
+    end = start == size ? size : record_offset(job, fd, index, count, last);
+    free(index);
+  }
+  close(fd);
+  if ( start == (u_int64_t)-1 || end == (u_int64_t)-1 )
+    return -1;
+  if ( start > size )
+    start = size;
+  if ( end > size )
+    end = size;
+  // (A range from the end of the file is empty.)
+  options->range_offset = start;
+  options->range_length = end - start;
+  options->record_start = options->record_count = 0;
+  return 0;
+}
+
+/***
+ *
+ * Group Section
+ *
+ */
+
+// Slots sent or merged at a time, and how far ahead of the merge
+// their table slots are prefetched.
+#define GROUP_BATCH 1024
+#define GROUP_PREFETCH 16
+// Buckets per pass of the result's radix sort (16 bit digits).
+#define GROUP_SORT_DIGITS 65536
+
+/***
+* pipe_write: Writes all of `data` to a pipe. Returns -1 if it can't.
+*/
+static int pipe_write (int fd, const void * data, size_t length) {
+  size_t done = 0;
+  while ( done < length ) {
+    ssize_t written = write(fd, (const char *)data + done, length - done);
+    if ( written == -1 && errno == EINTR )
+      continue;
+    if ( written <= 0 )
+      return -1;
+    done += written;
+  }
+  return 0;
+}
+
+/***
+* pipe_read: Reads all of `data` from a pipe. Returns -1 (with errno
+*   set to EIO at an early end) if it can't.
+*/
+static int pipe_read (int fd, void * data, size_t length) {
+  size_t done = 0;
+  while ( done < length ) {
+    ssize_t got = read(fd, (char *)data + done, length - done);
+    if ( got == -1 && errno == EINTR )
+      continue;
+    if ( got <= 0 ) {
+      if ( got == 0 )
+        errno = EIO;
+      return -1;
+    }
+    done += got;
+  }
+  return 0;
+}
+
+/***
+* groups_send: Writes a child's groups to its pipe, after its partial:
+*   the group count and key bytes (two u64s), the keys, then the
+*   slots in use.
+*/
+static int groups_send (int fd, struct fs_groups * groups) {
+  u_int64_t header[2] = { groups->count, groups->arena_used };
+  struct fs_group_slot batch[GROUP_BATCH];
+  int batched = 0;
+
+  if ( pipe_write(fd, header, sizeof(header)) == -1 || pipe_write(fd, groups->arena, groups->arena_used) == -1 )
+    return -1;
+  for ( u_int64_t i = 0; i < groups->capacity; i++ ) {
+    if ( groups->slots[i].hash == 0 )
+      continue;
+    batch[batched++] = groups->slots[i];
+    if ( batched == GROUP_BATCH ) {
+      if ( pipe_write(fd, batch, sizeof(batch)) == -1 )
+        return -1;
+      batched = 0;
+    }
+  }
+  return pipe_write(fd, batch, batched * sizeof(struct fs_group_slot));
+}
+
+/***
+* groups_receive: Reads the groups a child sent (see groups_send) and
+*   merges them into `groups`. The keys are read into one buffer; the
+*   new ones are copied into the table's arena.
+*/
+static int groups_receive (struct fs_groups * groups, int fd) {
+  u_int64_t header[2];
+  struct fs_group_slot batch[GROUP_BATCH];
+  char * keys;
+
+  if ( pipe_read(fd, header, sizeof(header)) == -1 )
+    return fail("Child exited without its groups");
+  keys = malloc(header[1] > 0 ? header[1] : 1);
+  if ( keys == NULL )
+    return fail("Error allocating groups");
+  if ( pipe_read(fd, keys, header[1]) == -1 ) {
+    free(keys);
+    return fail("Child exited without its groups");
+  }
+  // Room for all of them up front, instead of doubling on the way.
+  fs_groups_expect(groups, header[0]);
+  for ( u_int64_t left = header[0]; left > 0; ) {
+    u_int64_t count = left < GROUP_BATCH ? left : GROUP_BATCH;
+    if ( pipe_read(fd, batch, count * sizeof(struct fs_group_slot)) == -1 ) {
+      free(keys);
+      return fail("Child exited without its groups");
+    }
+    for ( u_int64_t i = 0; i < count; i++ ) {
+      struct fs_group_slot * slot = &batch[i];
+      if ( i + GROUP_PREFETCH < count )
+        fs_groups_prefetch(groups, batch[i + GROUP_PREFETCH].hash);
+      if ( slot->key > header[1] || slot->length > header[1] - slot->key ) {
+        free(keys);
+        errno = EIO;
+        return fail("Child sent bad groups");
+      }
+      fs_groups_add(groups, slot->hash, keys + slot->key, slot->length, slot->sum, slot->records);
+    }
+    left -= count;
+  }
+  free(keys);
+  if ( groups->failed ) {
+    errno = ENOMEM;
+    return fail("Error allocating groups");
+  }
+  return 0;
+}
+
+// A group being sorted: the first 16 bytes of its key (zero padded,
+// big endian), so most comparisons don't load the key, and its slot.
+// (glibc sorts larger items through pointers, which is slower.)
+struct group_order {
+  u_int64_t prefix[2];
+  const char * key;
+  u_int32_t length;
+  u_int32_t slot; // Tables have at most 2^32 slots (hashes are 32 bits).
+};
+
+static int group_compare (const void * a, const void * b) {
+  const struct group_order * left = a;
+  const struct group_order * right = b;
+  u_int32_t length = left->length < right->length ? left->length : right->length;
+
+  for ( int i = 0; i < 2; i++ )
+    if ( left->prefix[i] != right->prefix[i] )
+      return left->prefix[i] < right->prefix[i] ? -1 : 1;
+  if ( length > sizeof(left->prefix) ) {
+    int order = memcmp(left->key + sizeof(left->prefix), right->key + sizeof(right->prefix),
+        length - sizeof(left->prefix));
+    if ( order != 0 )
+      return order;
+  }
+  return ( left->length > right->length ) - ( left->length < right->length );
+}
+
+/***
+* group_sort: Sorts `count` groups by key, returning where they ended
+*   up (`orders` or `spare`, which has room for as many). A radix sort
+*   of the prefixes, 16 bits a pass from the last ones, skipping the
+*   passes where every prefix has the same digit (such as the zero
+*   padding of short keys); then qsort for runs of equal prefixes.
+*   For millions of groups, it is a few times faster than qsort.
+*
+* `counts` (u_int64_t *): Room for GROUP_SORT_DIGITS counts.
+*/
+static struct group_order * group_sort (struct group_order * orders, struct group_order * spare, u_int64_t count,
+    u_int64_t * counts) {
+  for ( int pass = 0; pass < 8 && count > 1; pass++ ) {
+    int word = 1 - pass / 4;
+    int shift = ( pass % 4 ) * 16;
+    u_int64_t offset = 0;
+    struct group_order * sorted;
+
+    memset(counts, 0, GROUP_SORT_DIGITS * sizeof(u_int64_t));
+    for ( u_int64_t i = 0; i < count; i++ )
+      counts[( orders[i].prefix[word] >> shift ) & ( GROUP_SORT_DIGITS - 1 )] += 1;
+    if ( counts[( orders[0].prefix[word] >> shift ) & ( GROUP_SORT_DIGITS - 1 )] == count )
+      continue;
+    for ( int digit = 0; digit < GROUP_SORT_DIGITS; digit++ ) {
+      u_int64_t digit_count = counts[digit];
+      counts[digit] = offset;
+      offset += digit_count;
+    }
+    for ( u_int64_t i = 0; i < count; i++ )
+      spare[counts[( orders[i].prefix[word] >> shift ) & ( GROUP_SORT_DIGITS - 1 )]++] = orders[i];
+    sorted = spare;
+    spare = orders;
+    orders = sorted;
+  }
+
+  for ( u_int64_t start = 0, end; start < count; start = end ) {
+    for ( end = start + 1; end < count && orders[end].prefix[0] == orders[start].prefix[0]
+          && orders[end].prefix[1] == orders[start].prefix[1]; end++ )
+      ;
+    if ( end - start > 1 )
+      qsort(orders + start, end - start, sizeof(struct group_order), group_compare);
+  }
+  return orders;
+}
+
+/***
+* groups_result: Fills in the groups of `result` from the table, in
+*   key order. The result takes the table's arena for its keys.
+*/
+static int groups_result (struct fs_groups * groups, struct fs_result * result) {
+  u_int64_t room = groups->count > 0 ? groups->count : 1;
+  struct group_order * orders;
+  struct group_order * spare;
+  struct group_order * sorted;
+  u_int64_t * counts;
+  u_int64_t count = 0;
+
+  if ( groups->failed ) {
+    errno = ENOMEM;
+    return fail("Error allocating groups");
+  }
+  orders = malloc(room * sizeof(struct group_order));
+  spare = malloc(room * sizeof(struct group_order));
+  counts = malloc(GROUP_SORT_DIGITS * sizeof(u_int64_t));
+  result->groups = malloc(room * sizeof(struct fs_group));
+  if ( orders == NULL || spare == NULL || counts == NULL || result->groups == NULL ) {
+    free(orders);
+    free(spare);
+    free(counts);
+    free(result->groups);
+    result->groups = NULL;
+    return fail("Error allocating groups");
+  }
+  for ( u_int64_t i = 0; i < groups->capacity; i++ ) {
+    struct fs_group_slot * slot = &groups->slots[i];
+    struct group_order * order;
+    unsigned char prefix[sizeof(order->prefix)] = { 0 };
+    if ( slot->hash == 0 )
+      continue;
+    order = &orders[count++];
+    order->key = groups->arena + slot->key;
+    order->length = slot->length;
+    order->slot = i;
+    memcpy(prefix, order->key, slot->length < sizeof(prefix) ? slot->length : sizeof(prefix));
+    order->prefix[0] = 0;
+    order->prefix[1] = 0;
+    for ( int j = 0; j < 16; j++ )
+      order->prefix[j / 8] = order->prefix[j / 8] << 8 | prefix[j];
+  }
+  sorted = group_sort(orders, spare, count, counts);
+  for ( u_int64_t i = 0; i < count; i++ ) {
+    struct fs_group_slot * slot = &groups->slots[sorted[i].slot];
+    result->groups[i] = (struct fs_group){ sorted[i].key, sorted[i].length, slot->sum, slot->records };
+  }
+  free(orders);
+  free(spare);
+  free(counts);
+  result->group_count = count;
+  result->group_keys = groups->arena;
+  groups->arena = NULL;
+  return 0;
+}
+
+/***
+ *
+ * Child Handling Section
+ *
+ */
+
+// How fs_child_main recognises a spawned child, and the
+// descriptor it writes its result to.
+#define SPAWN_CHILD_ARG "--file-sums-child"
+#define SPAWN_CHILD_FD 3
+
+// Basic arguments/variables needed by the children.
+struct child_info {
+  int fds[2]; // Target for pipe.
+  u_int64_t seek_to; // Start in file.
+  u_int64_t read_to; // Where the child should stop reading.
+  u_int16_t child_num; // For identification.
+  pid_t pid; // So the child can be reaped.
+  bool done; // Whether the child's result has arrived.
+  struct fs_partial * stored; // Its result cache partial, or NULL.
+  struct epoll_event event_structure;
+};
+
+/***
+* nanoseconds_between: The time from `start` to `end`.
+*/
+static u_int64_t nanoseconds_between (struct timespec * start, struct timespec * end) {
+  return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+/***
+* finish_stats: Fills in the statistics fields of a child's result.
+*
+* `result` (struct fs_partial *): The result to fill in.
+* `start` (struct timespec *): When the child started reading.
+*/
+static void finish_stats (struct fs_partial * result, struct timespec * start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result->nanoseconds = nanoseconds_between(start, &end);
+  result->cpu = sched_getcpu();
+  result->node = numa_node_of(result->cpu);
+}
+
+/***
+* handle_file_chunks: Sums a child's block from the chunks handed out
+*   by a block_reader. Blocks don't have to start on a record, so a
+*   child that landed in the middle of one skips to the next one; the
+*   previous child finishes that record instead. The reader starts one
+*   byte before the block, so a block that starts right after a record
+*   boundary skips just that boundary.
+*
+* `skipping` (bool): Whether to skip to the next record: for all but
+*   the block at the start of the range.
+*/
+static void handle_file_chunks (struct block_reader * reader, struct fs_kernel * kernel, struct fs_scan * scan,
+    struct fs_partial * result, bool skipping, u_int64_t read_to) {
+  // File offset of the next unparsed byte.
+  u_int64_t pos = reader->offset;
+  int boundary = scan->delimiter == FS_NO_DELIMITER ? '\n' : scan->delimiter;
+  const char * data;
+  ssize_t length;
+
+  while ( !scan->done && ( length = reader_next(reader, &data) ) > 0 ) {
+    size_t used;
+
+    // Skip the partial record the block starts in.
+    if ( skipping ) {
+      const char * newline = memchr(data, boundary, length);
+      used = newline != NULL ? (size_t)(newline + 1 - data) : (size_t)length;
+      result->bytes += used;
+      pos += used;
+      data += used;
+      length -= used;
+      if ( newline == NULL )
+        continue;
+      skipping = false;
+      // The block held no record of its own.
+      if ( pos > read_to ) {
+        scan->done = true;
+        break;
+      }
+    }
+
+    // Sum up to the end of the record that read_to is in.
+    used = kernel->bounded(scan, data, length, pos <= read_to ? read_to - pos : 0);
+    result->bytes += used;
+    pos += used;
+  }
+
+  // The file ended within the block's last record.
+  if ( !scan->done )
+    fs_scan_finish(scan);
+  result->sum = scan->sum;
+  result->records = scan->records;
+}
+
+/***
+* handle_stream_chunks: Sums a stream from the chunks handed out by a
+*   block_reader, up to its end. Returns -1 if reading failed.
+*/
+static int handle_stream_chunks (struct block_reader * reader, struct fs_kernel * kernel, struct fs_scan * scan,
+    struct fs_partial * result) {
+  const char * data;
+  ssize_t length;
+
+  while ( ( length = reader_next(reader, &data) ) > 0 ) {
+    kernel->unbounded(scan, data, length, 0);
+    result->bytes += length;
+  }
+  fs_scan_finish(scan);
+  result->sum = scan->sum;
+  result->records = scan->records;
+  return length < 0 ? -1 : 0;
+}
+
+// Hardware counters and timestamps around a child's summing.
+struct measurement {
+  struct timespec started; // When the child started.
+  struct timespec start; // When reading started.
+  int tlb_counter; // Counts dTLB misses, if the hardware allows it.
+  bool counting; // Whether --counters is on.
+  struct counter_group counters;
+};
+
+/***
+* measure_start: Starts timing (and counting dTLB misses, with stats,
+*   and the --counters group, with counters).
+*/
+static void measure_start (struct measurement * measurement, const struct fs_options * options) {
+  measurement->tlb_counter = -1;
+  measurement->counting = options->counters;
+  if ( options->stats ) {
+    measurement->tlb_counter = perf_open(PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1, 0);
+    if ( measurement->tlb_counter != -1 )
+      ioctl(measurement->tlb_counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  if ( measurement->counting )
+    counters_open(&measurement->counters);
+  clock_gettime(CLOCK_MONOTONIC, &measurement->start);
+}
+
+/***
+* measure_finish: Fills in the statistics of a result.
+*
+* `first_byte` (struct timespec *): When the first data arrived, or zero.
+*/
+static void measure_finish (struct measurement * measurement, struct fs_partial * result, struct timespec * first_byte) {
+  u_int64_t values[COUNTER_COUNT];
+
+  if ( measurement->counting ) {
+    counters_close(&measurement->counters, values);
+    result->cycles = values[0];
+    result->instructions = values[1];
+    result->branch_misses = values[2];
+    result->llc_misses = values[3];
+  } else {
+    result->cycles = result->instructions = result->branch_misses = result->llc_misses = -1;
+  }
+  if ( measurement->tlb_counter != -1 )
+    ioctl(measurement->tlb_counter, PERF_EVENT_IOC_DISABLE, 0);
+  finish_stats(result, &measurement->start);
+  result->dtlb_misses = perf_read(measurement->tlb_counter);
+  if ( measurement->tlb_counter != -1 )
+    close(measurement->tlb_counter);
+  if ( first_byte->tv_sec != 0 || first_byte->tv_nsec != 0 )
+    result->first_byte_ns = nanoseconds_between(&measurement->started, first_byte);
+}
+
+/***
+* scan_width: The digits per number of `options`, within what the
+*   kernels take.
+*/
+static int scan_width (const struct fs_options * options) {
+  if ( options->width < 1 )
+    return 1;
+  return options->width > FS_MAX_WIDTH ? FS_MAX_WIDTH : options->width;
+}
+
+/***
+* filter_compile: Compiles the filter of `options` into `where`, and
+*   points `filter` at it (or sets it to NULL, without a filter).
+*   Returns -1 with errno set to EINVAL if it isn't a filter.
+*/
+static int filter_compile (const struct fs_options * options, struct fs_where * where,
+    const struct fs_where ** filter) {
+  *filter = NULL;
+  if ( options->where == NULL )
+    return 0;
+  if ( !fs_where_compile(options->where, scan_width(options), options->is_signed, where) ) {
+    errno = EINVAL;
+    return fail("Error parsing the filter");
+  }
+  *filter = where;
+  return 0;
+}
+
+/***
+* groups_start: Starts the groups table of `options` in `table`, and
+*   points `groups` at it (or sets it to NULL, without a key column).
+*   Returns -1 with errno set to EINVAL if the columns don't make sense.
+*/
+static int groups_start (const struct fs_options * options, struct fs_groups * table, struct fs_groups ** groups) {
+  int separator = options->separator != 0 ? options->separator : ',';
+  int boundary = options->delimiter == FS_NO_DELIMITER ? '\n' : options->delimiter;
+
+  *groups = NULL;
+  if ( options->key_column == 0 )
+    return 0;
+  if ( options->key_column < 0 || options->value_column < 1 || options->key_column == options->value_column
+       || separator == boundary || separator == '-' || ( separator >= '0' && separator <= '9' ) ) {
+    errno = EINVAL;
+    return fail("Error in the key and value columns");
+  }
+  fs_groups_init(table, separator, options->key_column - 1, options->value_column - 1);
+  *groups = table;
+  return 0;
+}
+
+/***
+* scan_start: Starts a scan in the record format of `options`, with
+*   `filter` and `groups` (or NULL), returning the kernels specialised
+*   for that format.
+*/
+static struct fs_kernel scan_start (const struct fs_options * options, const struct fs_where * filter,
+    struct fs_groups * groups, struct fs_scan * scan) {
+  int width = scan_width(options);
+
+  fs_scan_init(scan, options->delimiter, width, options->is_signed);
+  scan->where = filter;
+  scan->groups = groups;
+  if ( groups != NULL )
+    return (struct fs_kernel){ "grouped", fs_scan_grouped_bounded, fs_scan_grouped };
+  return fs_kernel_for(options->delimiter, width, options->is_signed, filter != NULL);
+}
+
+/***
+* sum_block: Sums the block from `seek_to` to `read_to` of the job's
+*   file into `result`, with its statistics. Used by the children and
+*   by remote workers. Returns -1 (with errno set) if the file can't
+*   be opened.
+*
+* `started` (struct timespec *): When the work on the block started.
+* `ring` (struct trace_ring *): Where to record spans, or NULL.
+*/
+static int sum_block (struct fs_job * job, u_int64_t seek_to, u_int64_t read_to, struct fs_partial * result,
+    struct timespec * started, struct trace_ring * ring) {
+  // Will hand out chunks of the file.
+  struct block_reader reader;
+  // The kernels for the record format, and the scan state.
+  struct fs_scan scan;
+  struct fs_kernel kernel = scan_start(&job->options, job->filter, job->groups, &scan);
+  // Timestamps and counters for the statistics.
+  struct measurement measurement;
+  // Where the file is opened: one byte before the block, so
+  // the handlers can see if the block starts on a new line.
+  u_int64_t open_at = block_open_at(job, seek_to);
+  u_int64_t span_started;
+
+  measurement.started = *started;
+  span_started = TRACE_BEGIN(ring);
+  if ( reader_open(&reader, job, open_at, read_to) == -1 ) {
+    int saved_errno = errno;
+    reader_close(&reader);
+    errno = saved_errno;
+    return -1;
+  }
+  TRACE_END(ring, "open", span_started);
+
+  span_started = TRACE_BEGIN(ring);
+  measure_start(&measurement, &job->options);
+  handle_file_chunks(&reader, &kernel, &scan, result, seek_to > job->range_start, read_to);
+  measure_finish(&measurement, result, &reader.first_byte);
+  TRACE_END(ring, "parse", span_started);
+  result->page_kind = reader.page_kind;
+
+  // Done with the file; drop what was read for drop_cache.
+  reader_close(&reader);
+  return 0;
+}
+
+/***
+* sum_or_reuse: Sums a child's block, unless its result cache partial
+*   (child_info->stored, from before the file changed) can be reused:
+*   then only its hash is checked. With the result cache, a summed
+*   block is hashed afterwards, so the next run can do the same.
+*/
+static int sum_or_reuse (struct fs_job * job, struct child_info * child_info, struct fs_partial * result,
+    struct timespec * started, struct trace_ring * ring) {
+  u_int64_t open_at = block_open_at(job, child_info->seek_to);
+  u_int64_t span_started = TRACE_BEGIN(ring);
+
+  if ( child_info->stored != NULL && result_reuse(job, child_info->stored, child_info->seek_to, child_info->read_to, result) ) {
+    finish_stats(result, started);
+    TRACE_END(ring, "hash", span_started);
+    return 0;
+  }
+  if ( sum_block(job, child_info->seek_to, child_info->read_to, result, started, ring) == -1 )
+    return -1;
+  if ( job->options.result_cache ) {
+    span_started = TRACE_BEGIN(ring);
+    result->hash = block_hash(job, open_at, result->bytes);
+    TRACE_END(ring, "hash", span_started);
+  }
+  return 0;
+}
+
+// The children will end up here after forking.
+static int child_handler (struct fs_job * job, struct child_info * child_info) {
+  // Will be passed along to the parent.
+  struct fs_partial result = {0};
+  struct timespec started;
+  // This child's spans, if tracing.
+  struct trace_ring * ring = TRACE_RING(job->trace, child_info->child_num + 1);
+  u_int64_t child_started = TRACE_BEGIN(ring);
+  u_int64_t span_started;
+
+  // So the parent knows which child returned results.
+  result.child_num = child_info->child_num;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  // Move to a CPU on this child's NUMA node before reading anything.
+  if ( job->options.numa )
+    numa_place(child_info->child_num, job->result->child_count);
+
+  if ( sum_or_reuse(job, child_info, &result, &started, ring) == -1 ) {
+    perror("Error opening input file");
+    return EXIT_FAILURE;
+  }
+  if ( job->groups != NULL && job->groups->failed ) {
+    errno = ENOMEM;
+    perror("Error allocating groups");
+    return EXIT_FAILURE;
+  }
+
+  // Send the results to the parent (and then the groups).
+  span_started = TRACE_BEGIN(ring);
+  if ( write(child_info->fds[1], &result, sizeof(result)) != sizeof(result)
+       || ( job->groups != NULL && groups_send(child_info->fds[1], job->groups) == -1 ) ) {
+    perror("Error sending result");
+    return EXIT_FAILURE;
+  }
+  close(child_info->fds[1]);
+  // The trace is only written once the children are reaped, so
+  // spans can still be recorded after sending the result.
+  TRACE_END(ring, "pipe write", span_started);
+  TRACE_END(ring, "child", child_started);
+  
+  // Will cause the child to exit with a success status code.
+  return 0;
+}
+
+/***
+* spawn_child: Starts a child with posix_spawn instead of fork, for
+*   fs_options.spawn. glibc's posix_spawn shares the parent's memory
+*   until the exec (CLONE_VM | CLONE_VFORK), so no page tables are
+*   copied however large the parent is. The child is spawn_path run
+*   with SPAWN_CHILD_ARG and the block in its arguments (see
+*   fs_child_main), and writes its result to SPAWN_CHILD_FD.
+*   Returns its pid, or -1.
+*/
+static pid_t spawn_child (struct fs_job * job, struct child_info * child_info) {
+  const struct fs_options * options = &job->options;
+  struct fs_partial * stored = child_info->stored;
+  char block[160];
+  char option_text[160];
+  char stored_text[96] = "-";
+  char * where = options->where != NULL ? (char *)options->where : "-";
+  char * argv[] = { "file-sums-child", SPAWN_CHILD_ARG, block, option_text, stored_text, where, job->path, NULL };
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int status;
+
+  snprintf(block, sizeof(block), "%d %d %lu %lu %lu %lu", child_info->child_num, job->result->child_count,
+      child_info->seek_to, child_info->read_to, job->range_start, job->range_end - job->range_start);
+  snprintf(option_text, sizeof(option_text), "%d %d %d %d %lu %d %d %d %d %d %d %d %d %d %d", options->reader,
+      options->huge_pages, options->direct, options->drop_cache, options->prefetch, options->delimiter,
+      options->width, options->is_signed, options->stats, options->counters, options->numa, options->result_cache,
+      options->key_column, options->value_column, options->separator);
+  if ( stored != NULL )
+    snprintf(stored_text, sizeof(stored_text), "%lu %lu %lu %lu", stored->sum, stored->records, stored->bytes, stored->hash);
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, child_info->fds[1], SPAWN_CHILD_FD);
+  status = posix_spawn(&pid, options->spawn_path != NULL ? options->spawn_path : "/proc/self/exe",
+      &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if ( status != 0 ) {
+    errno = status;
+    return -1;
+  }
+  return pid;
+}
+
+// Creates a child process for a block of the job's file.
+static int add_child (struct fs_job * job, u_int16_t child_num, u_int64_t seek_to, u_int64_t read_to) {
+  struct child_info * child_info = &job->children[child_num];
+  // Will hold the result from "fork" system call.
+  pid_t fork_result;
+  // The parent's spans, if tracing.
+  struct trace_ring * ring = TRACE_RING(job->trace, 0);
+  u_int64_t span_started;
+
+  // Create child pipes.
+  // pipe returns -1 to indicate an error.
+  if ( pipe(child_info->fds) == -1 )
+    return fail("Error creating pipes for child");
+  
+  // Set child properties.
+  child_info->child_num = child_num;
+
+  // Set child block boundaries.
+  child_info->seek_to = seek_to;
+  child_info->read_to = read_to;
+  if ( child_num < job->stored_count )
+    child_info->stored = &job->stored[child_num];
+
+  // Fork child process.
+  span_started = TRACE_BEGIN(ring);
+  fork_result = job->options.spawn ? spawn_child(job, child_info) : fork();
+
+  if ( fork_result == -1 ) { // An error occured.
+    close(child_info->fds[0]);
+    close(child_info->fds[1]);
+    return fail(job->options.spawn ? "Error spawning child" : "Error forking child");
+  } else if ( fork_result == 0 ) { // Child:
+    close(child_info->fds[0]);
+    // Call child_handler, exiting with the return value of that
+    // function. _exit, so the child doesn't run the caller's
+    // atexit handlers or flush the stdio buffers it inherited.
+    _exit(child_handler(job, child_info));
+  }
+  child_info->pid = fork_result;
+  TRACE_END(ring, "fork", span_started);
+  // The parent only reads. Closing the write end also means
+  // a child that dies without a result shows up as EOF.
+  close(child_info->fds[1]);
+  child_info->fds[1] = -1;
+
+  // Register pipes with epoll so the parent process knows when
+  // the child writes to the pipe.
+  child_info->event_structure.events = EPOLLIN;
+  child_info->event_structure.data.ptr = child_info;
+
+  if ( epoll_ctl(job->epoll_fd, EPOLL_CTL_ADD, child_info->fds[0], &child_info->event_structure) == -1 )
+    return fail("Error watching child pipe");
+
+  job->waiting_for += 1;
+  return 0;
+}
+
+/***
+* collect_partial: Adds a block's result to the job's result, and
+*   hands it to the caller of fs_job_next.
+*/
+static void collect_partial (struct fs_job * job, struct fs_partial * result, struct fs_partial * partial) {
+  struct child_info * child_info = &job->children[result->child_num];
+  struct timespec now;
+
+  result->seek_to = child_info->seek_to;
+  result->read_to = child_info->read_to;
+  // Add the child's result to the final sum.
+  job->result->sum += result->sum;
+  job->result->records += result->records;
+  job->result->partials[result->child_num] = *result;
+  job->result->partial_count += 1;
+  *partial = *result;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  job->result->collect_ns = nanoseconds_between(&job->collecting, &now);
+}
+
+/***
+ *
+ * Remote Worker Section
+ *
+ * With fs_options.workers, the blocks go to `sums --worker` processes
+ * (fs_worker_serve) over TCP instead of to children, one block per
+ * worker at a time. The workers open the file by the same path, so
+ * it has to be on a filesystem they share.
+ *
+ * Protocol: the coordinator sends a request per block and the worker
+ * answers with the block's fs_partial, both little endian:
+ *   Request: "FSRQ", child_num (2), width (1), flags (1), delimiter (4),
+ *     file size (8), seek_to (8), read_to (8), path length (2),
+ *     unused (2), then the path.
+ *   Reply: "FSRP", status (4, 0 or an errno), child_num (2), cpu (2),
+ *     node (2), page_kind (2), then sum, records, seek_to, read_to,
+ *     bytes, nanoseconds, first_byte_ns, dtlb_misses, cycles,
+ *     instructions, branch_misses and llc_misses (8 each).
+ *
+ * A worker that disconnects (or whose connection times out) is dropped
+ * and its block goes to another worker; the job only fails once no
+ * workers are left, or if a worker couldn't sum a block.
+ */
+
+#define WIRE_REQUEST_SIZE 40
+#define WIRE_REPLY_SIZE 112
+#define WIRE_REQUEST_MAGIC "FSRQ"
+#define WIRE_REPLY_MAGIC "FSRP"
+// Request flags.
+#define WIRE_SIGNED 1
+#define WIRE_STATS 2
+#define WIRE_COUNTERS 4
+// TCP keepalive for worker connections, so a worker whose host went
+// away is noticed after about IDLE + INTERVAL * COUNT seconds.
+#define KEEPALIVE_IDLE 10
+#define KEEPALIVE_INTERVAL 5
+#define KEEPALIVE_COUNT 3
+// Pending connections a worker accepts.
+#define WORKER_BACKLOG 16
+
+// A worker, as seen by the coordinator.
+struct remote_worker {
+  int fd; // -1 once the worker is lost.
+  int task; // The child_num of the block it is summing, or -1.
+  unsigned char reply[WIRE_REPLY_SIZE];
+  size_t have; // Bytes of the reply received so far.
+  struct epoll_event event_structure;
+};
+
+/***
+* wire_put: Writes `value` as `bytes` little endian bytes, returning
+*   where the next field goes.
+*/
+static unsigned char * wire_put (unsigned char * at, u_int64_t value, int bytes) {
+  for ( int i = 0; i < bytes; i++ )
+    at[i] = value >> ( 8 * i );
+  return at + bytes;
+}
+
+/***
+* wire_get: Reads a `bytes` byte little endian field, moving `at` past it.
+*/
+static u_int64_t wire_get (const unsigned char ** at, int bytes) {
+  u_int64_t value = 0;
+  for ( int i = 0; i < bytes; i++ )
+    value |= (u_int64_t)(*at)[i] << ( 8 * i );
+  *at += bytes;
+  return value;
+}
+
+/***
+* write_all/read_all: Write or read exactly `length` bytes of a socket.
+*   read_all returns 0 on a clean EOF before the first byte.
+*/
+static ssize_t write_all (int fd, const void * data, size_t length) {
+  size_t done = 0;
+  while ( done < length ) {
+    ssize_t written = send(fd, (const char *)data + done, length - done, MSG_NOSIGNAL);
+    if ( written == -1 && errno == EINTR )
+      continue;
+    if ( written <= 0 )
+      return -1;
+    done += written;
+  }
+  return done;
+}
+
+static ssize_t read_all (int fd, void * data, size_t length) {
+  size_t done = 0;
+  while ( done < length ) {
+    ssize_t got = read(fd, (char *)data + done, length - done);
+    if ( got == -1 && errno == EINTR )
+      continue;
+    if ( got == 0 && done == 0 )
+      return 0;
+    if ( got <= 0 ) {
+      if ( got == 0 )
+        errno = ECONNRESET;
+      return -1;
+    }
+    done += got;
+  }
+  return done;
+}
+
+/***
+* split_address: Splits "HOST:PORT" (or "[V6HOST]:PORT", or just
+*   "PORT") into `host` (empty if there is none) and the port.
+*   Returns NULL if there is no port.
+*/
+static const char * split_address (const char * address, char * host, size_t length) {
+  const char * colon = strrchr(address, ':');
+  const char * start = address;
+  size_t host_length;
+
+  host[0] = '\0';
+  if ( colon == NULL )
+    return *address != '\0' ? address : NULL;
+  host_length = colon - address;
+  if ( *start == '[' && host_length >= 2 && colon[-1] == ']' ) {
+    start += 1;
+    host_length -= 2;
+  }
+  if ( host_length >= length || colon[1] == '\0' )
+    return NULL;
+  memcpy(host, start, host_length);
+  host[host_length] = '\0';
+  return colon + 1;
+}
+
+/***
+* socket_options: Turns off Nagle (requests and replies are small and
+*   waited for) and turns on keepalive, for a connected socket.
+*/
+static void socket_options (int fd) {
+  int on = 1;
+  int idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL, count = KEEPALIVE_COUNT;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+/***
+* remote_connect: Connects to a worker at "HOST:PORT", returning the
+*   socket or -1.
+*/
+static int remote_connect (const char * address) {
+  char host[256];
+  const char * port = split_address(address, host, sizeof(host));
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+  struct addrinfo * found;
+  int fd = -1;
+
+  if ( port == NULL ) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ( getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &found) != 0 ) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  for ( struct addrinfo * at = found; at != NULL && fd == -1; at = at->ai_next ) {
+    fd = socket(at->ai_family, at->ai_socktype | SOCK_CLOEXEC, at->ai_protocol);
+    if ( fd != -1 && connect(fd, at->ai_addr, at->ai_addrlen) == -1 ) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  if ( fd != -1 )
+    socket_options(fd);
+  return fd;
+}
+
+/***
+* remote_lose: Drops a worker that disconnected, putting its block
+*   back to be handed to another worker.
+*/
+static void remote_lose (struct fs_job * job, struct remote_worker * worker) {
+  epoll_ctl(job->epoll_fd, EPOLL_CTL_DEL, worker->fd, NULL);
+  close(worker->fd);
+  worker->fd = -1;
+  if ( worker->task >= 0 ) {
+    job->pending[job->pending_count++] = worker->task;
+    job->result->reassigned_blocks += 1;
+  }
+  worker->task = -1;
+  job->workers_alive -= 1;
+}
+
+/***
+* remote_dispatch: Hands pending blocks to the idle workers.
+*/
+static void remote_dispatch (struct fs_job * job) {
+  size_t path_length = strlen(job->wire_path);
+
+  for ( int i = 0; i < job->worker_count && job->pending_count > 0; i++ ) {
+    struct remote_worker * worker = &job->workers[i];
+    unsigned char request[WIRE_REQUEST_SIZE];
+    unsigned char * at = request;
+    struct child_info * block;
+    int flags = 0;
+
+    if ( worker->fd == -1 || worker->task >= 0 )
+      continue;
+    worker->task = job->pending[--job->pending_count];
+    worker->have = 0;
+    block = &job->children[worker->task];
+    if ( job->options.is_signed )
+      flags |= WIRE_SIGNED;
+    if ( job->options.stats )
+      flags |= WIRE_STATS;
+    if ( job->options.counters )
+      flags |= WIRE_COUNTERS;
+    memcpy(at, WIRE_REQUEST_MAGIC, 4);
+    at = wire_put(at + 4, worker->task, 2);
+    at = wire_put(at, job->options.width, 1);
+    at = wire_put(at, flags, 1);
+    at = wire_put(at, (u_int32_t)job->options.delimiter, 4);
+    at = wire_put(at, job->stat_buf.st_size, 8);
+    at = wire_put(at, block->seek_to, 8);
+    at = wire_put(at, block->read_to, 8);
+    at = wire_put(at, path_length, 2);
+    wire_put(at, 0, 2);
+    if ( write_all(worker->fd, request, sizeof(request)) == -1
+        || write_all(worker->fd, job->wire_path, path_length) == -1 )
+      remote_lose(job, worker);
+  }
+}
+
+/***
+* remote_start: Connects to the workers in options.workers and hands
+*   out the first blocks. Workers that can't be reached are skipped.
+*/
+static int remote_start (struct fs_job * job) {
+  char * list = strdup(job->options.workers);
+  char * saveptr = NULL;
+  char resolved[PATH_MAX];
+  int count = 1;
+  struct trace_ring * ring = TRACE_RING(job->trace, 0);
+  u_int64_t span_started;
+
+  if ( list == NULL )
+    return fail("Error allocating job");
+  for ( const char * c = list; *c != '\0'; c++ )
+    count += *c == ',';
+  job->workers = calloc(count, sizeof(struct remote_worker));
+  job->pending = calloc(job->result->child_count, sizeof(u_int16_t));
+  // The workers open the file by the same path, so make it absolute.
+  job->wire_path = strdup(realpath(job->path, resolved) != NULL ? resolved : job->path);
+  if ( job->workers == NULL || job->pending == NULL || job->wire_path == NULL ) {
+    free(list);
+    return fail("Error allocating job");
+  }
+  if ( strlen(job->wire_path) > 0xffff ) {
+    free(list);
+    errno = ENAMETOOLONG;
+    return fail("Error checking input file");
+  }
+
+  span_started = TRACE_BEGIN(ring);
+  for ( char * address = strtok_r(list, ",", &saveptr); address != NULL; address = strtok_r(NULL, ",", &saveptr) ) {
+    struct remote_worker * worker = &job->workers[job->worker_count++];
+    worker->task = -1;
+    worker->fd = remote_connect(address);
+    if ( worker->fd == -1 )
+      continue;
+    worker->event_structure.events = EPOLLIN;
+    worker->event_structure.data.ptr = worker;
+    if ( epoll_ctl(job->epoll_fd, EPOLL_CTL_ADD, worker->fd, &worker->event_structure) == -1 ) {
+      close(worker->fd);
+      worker->fd = -1;
+      continue;
+    }
+    job->workers_alive += 1;
+  }
+  TRACE_END(ring, "connect", span_started);
+  free(list);
+  if ( job->workers_alive == 0 ) {
+    errno = ECONNREFUSED;
+    return fail("Error connecting to workers");
+  }
+
+  // Blocks are taken from the end of the list, so put them in backwards.
+  for ( int i = job->result->child_count - 1; i >= 0; i-- )
+    job->pending[job->pending_count++] = i;
+  job->waiting_for = job->result->child_count;
+  remote_dispatch(job);
+  return 0;
+}
+
+/***
+* remote_next: fs_job_next for remote workers: waits for a reply,
+*   reassigning the blocks of workers that were lost.
+*/
+static int remote_next (struct fs_job * job, struct fs_partial * partial) {
+  while ( job->waiting_for > 0 ) {
+    struct epoll_event ev;
+    struct remote_worker * worker;
+    struct trace_ring * ring = TRACE_RING(job->trace, 0);
+    u_int64_t span_started = TRACE_BEGIN(ring);
+    const unsigned char * at;
+    struct fs_partial result;
+    u_int32_t status;
+    int ready;
+    ssize_t got;
+
+    if ( job->workers_alive == 0 ) {
+      job->failed = true;
+      job->failed_errno = errno = ECONNRESET;
+      job->failed_step = "Lost every worker";
+      return fail(job->failed_step);
+    }
+    ready = epoll_wait(job->epoll_fd, &ev, 1, -1);
+    if ( ready == -1 && errno == EINTR )
+      continue;
+    if ( ready == -1 )
+      return fail("Error waiting for workers");
+
+    worker = ev.data.ptr;
+    got = read(worker->fd, worker->reply + worker->have, WIRE_REPLY_SIZE - worker->have);
+    if ( got == -1 && errno == EINTR )
+      continue;
+    // Disconnected (or talking out of turn): give its block to another worker.
+    if ( got <= 0 || worker->task < 0 ) {
+      remote_lose(job, worker);
+      remote_dispatch(job);
+      continue;
+    }
+    worker->have += got;
+    if ( worker->have < WIRE_REPLY_SIZE )
+      continue;
+    TRACE_END(ring, "collect", span_started);
+
+    at = worker->reply + 4;
+    status = wire_get(&at, 4);
+    memset(&result, 0, sizeof(result));
+    result.child_num = wire_get(&at, 2);
+    result.cpu = wire_get(&at, 2);
+    result.node = wire_get(&at, 2);
+    result.page_kind = wire_get(&at, 2);
+    result.sum = wire_get(&at, 8);
+    result.records = wire_get(&at, 8);
+    result.seek_to = wire_get(&at, 8);
+    result.read_to = wire_get(&at, 8);
+    result.bytes = wire_get(&at, 8);
+    result.nanoseconds = wire_get(&at, 8);
+    result.first_byte_ns = wire_get(&at, 8);
+    result.dtlb_misses = wire_get(&at, 8);
+    result.cycles = wire_get(&at, 8);
+    result.instructions = wire_get(&at, 8);
+    result.branch_misses = wire_get(&at, 8);
+    result.llc_misses = wire_get(&at, 8);
+    if ( memcmp(worker->reply, WIRE_REPLY_MAGIC, 4) != 0 || result.child_num != worker->task ) {
+      remote_lose(job, worker);
+      remote_dispatch(job);
+      continue;
+    }
+    // The worker could reach the file but not sum it: it won't
+    // do any better on another worker.
+    if ( status != 0 ) {
+      job->failed = true;
+      job->failed_errno = errno = status;
+      job->failed_step = "Worker couldn't sum its block";
+      return fail(job->failed_step);
+    }
+    worker->task = -1;
+    worker->have = 0;
+    job->children[result.child_num].done = true;
+    job->waiting_for -= 1;
+    remote_dispatch(job);
+    collect_partial(job, &result, partial);
+    return 1;
+  }
+  return 0;
+}
+
+/***
+* worker_connection: Serves one coordinator, until it disconnects.
+*/
+static int worker_connection (int fd, const struct fs_options * options) {
+  unsigned char request[WIRE_REQUEST_SIZE];
+  ssize_t got;
+
+  while ( ( got = read_all(fd, request, sizeof(request)) ) > 0 ) {
+    const unsigned char * at = request + 4;
+    unsigned char reply[WIRE_REPLY_SIZE];
+    unsigned char * out = reply;
+    struct fs_job job;
+    struct fs_partial result = {0};
+    struct timespec started;
+    char path[PATH_MAX];
+    u_int64_t size, seek_to, read_to;
+    size_t path_length;
+    int flags;
+    int status = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if ( memcmp(request, WIRE_REQUEST_MAGIC, 4) != 0 ) {
+      errno = EPROTO;
+      return -1;
+    }
+    memset(&job, 0, sizeof(job));
+    job.options = *options;
+    result.child_num = wire_get(&at, 2);
+    job.options.width = wire_get(&at, 1);
+    flags = wire_get(&at, 1);
+    job.options.delimiter = (int32_t)wire_get(&at, 4);
+    size = wire_get(&at, 8);
+    seek_to = wire_get(&at, 8);
+    read_to = wire_get(&at, 8);
+    path_length = wire_get(&at, 2);
+    job.options.is_signed = flags & WIRE_SIGNED;
+    job.options.stats = flags & WIRE_STATS;
+    job.options.counters = flags & WIRE_COUNTERS;
+    // Blocks always come from the whole file.
+    job.options.range_offset = job.options.range_length = 0;
+    if ( path_length >= sizeof(path) ) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    if ( read_all(fd, path, path_length) != (ssize_t)path_length ) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    path[path_length] = '\0';
+    job.path = path;
+
+    // The file has to be the one the coordinator split.
+    if ( stat(path, &job.stat_buf) == -1 )
+      status = errno;
+    else if ( (u_int64_t)job.stat_buf.st_size != size )
+      status = ESTALE;
+    else {
+      range_bounds(&job);
+      if ( sum_block(&job, seek_to, read_to, &result, &started, NULL) == -1 )
+        status = errno;
+    }
+
+    memcpy(out, WIRE_REPLY_MAGIC, 4);
+    out = wire_put(out + 4, status, 4);
+    out = wire_put(out, result.child_num, 2);
+    out = wire_put(out, (u_int16_t)result.cpu, 2);
+    out = wire_put(out, (u_int16_t)result.node, 2);
+    out = wire_put(out, (u_int16_t)result.page_kind, 2);
+    out = wire_put(out, result.sum, 8);
+    out = wire_put(out, result.records, 8);
+    out = wire_put(out, seek_to, 8);
+    out = wire_put(out, read_to, 8);
+    out = wire_put(out, result.bytes, 8);
+    out = wire_put(out, result.nanoseconds, 8);
+    out = wire_put(out, result.first_byte_ns, 8);
+    out = wire_put(out, result.dtlb_misses, 8);
+    out = wire_put(out, result.cycles, 8);
+    out = wire_put(out, result.instructions, 8);
+    out = wire_put(out, result.branch_misses, 8);
+    wire_put(out, result.llc_misses, 8);
+    if ( write_all(fd, reply, sizeof(reply)) == -1 )
+      return -1;
+  }
+  return got == 0 ? 0 : -1;
+}
+
+/***
+ *
+ * Worker Pool Section
+ *
+ * A pool (fs_pool_create) keeps worker processes that are forked once,
+ * for programs that sum many files: a job with fs_options.pool queues
+ * its blocks in the pool's shared memory instead of forking children,
+ * and the workers put the partials back there. One job uses a pool at
+ * a time.
+ *
+ * Both live in a MAP_SHARED mapping. The blocks go through a lock free
+ * queue (fs_queue.h), with a process shared semaphore counting them so
+ * idle workers can sleep; the results go back through a ring under a
+ * process shared (robust) mutex, which the job waits on with a
+ * condition variable. A worker exits after max_tasks blocks, or once
+ * its resident memory grew by more than max_growth bytes, and the job
+ * forks a fresh one in its place; the block of a worker that died is
+ * queued again. A worker that died in the middle of taking a block may
+ * have lost it, so that fails the job, and the pool starts over with a
+ * fresh queue and workers.
+ */
+
+// Blocks queued or being summed, plus results not yet collected.
+#define POOL_QUEUE_SIZE 256
+#define POOL_DEFAULT_MAX_TASKS 10000
+#define POOL_DEFAULT_MAX_GROWTH (64 * 1024 * 1024)
+// How often a job waiting for results looks for dead workers.
+#define POOL_CHECK_NS 50000000
+
+// A block, as queued for the workers.
+struct pool_task {
+  u_int32_t generation; // The job's, so blocks of an old job are dropped.
+  u_int16_t child_num;
+  u_int64_t seek_to;
+  u_int64_t read_to;
+  bool has_stored;
+  struct fs_partial stored; // Its result cache partial, if has_stored.
+};
+
+// A block's result, as queued for the job.
+struct pool_result {
+  u_int32_t generation;
+  int status; // 0, or an errno if the block couldn't be summed.
+  struct fs_partial partial;
+};
+
+struct pool_worker {
+  pid_t pid;
+  // Whether it is taking or summing a block. While it is taking one,
+  // task.generation is 0.
+  atomic_bool busy;
+  struct pool_task task;
+};
+
+// The part of a pool the workers see.
+struct pool_shared {
+  sem_t queued; // Posted for each block queued, and on shutdown.
+  atomic_bool shutdown;
+  atomic_uint generation; // Of the job using the pool.
+  // The job's file and options, set before its blocks are queued.
+  char path[PATH_MAX];
+  struct stat stat_buf;
+  struct fs_options options; // (Its pointers are only good in the job's process.)
+  struct fs_where where; // The compiled filter, if `filtered`.
+  bool filtered;
+  pthread_mutex_t lock; // For the results.
+  pthread_cond_t done; // Signalled when results are queued.
+  struct pool_result results[POOL_QUEUE_SIZE];
+  unsigned result_head, result_count;
+  struct pool_worker workers[]; // worker_count of them.
+};
+
+struct fs_pool {
+  struct pool_shared * shared;
+  struct fs_queue * queue; // Of pool_tasks, in the same mapping.
+  size_t map_length;
+  int worker_count;
+  u_int64_t max_tasks;
+  u_int64_t max_growth;
+  bool busy; // Whether a job is using it.
+  bool lost; // Whether a worker died taking a block.
+  u_int64_t requeued; // The job's blocks queued again after their worker died.
+  int in_flight; // The job's blocks that are queued, being summed or unread.
+};
+
+/***
+* pool_lock: Locks the pool's results, taking over from a worker that
+*   died holding the lock.
+*/
+static void pool_lock (struct pool_shared * shared) {
+  if ( pthread_mutex_lock(&shared->lock) == EOWNERDEAD )
+    pthread_mutex_consistent(&shared->lock);
+}
+
+/***
+* pool_wait: Waits on `condition`, for at most `timeout_ns` (0 for no
+*   limit). Returns false on a timeout.
+*/
+static bool pool_wait (struct pool_shared * shared, pthread_cond_t * condition, u_int64_t timeout_ns) {
+  struct timespec until;
+  int status;
+
+  if ( timeout_ns == 0 ) {
+    status = pthread_cond_wait(condition, &shared->lock);
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_nsec += timeout_ns;
+    until.tv_sec += until.tv_nsec / 1000000000;
+    until.tv_nsec %= 1000000000;
+    status = pthread_cond_timedwait(condition, &shared->lock, &until);
+  }
+  if ( status == EOWNERDEAD )
+    pthread_mutex_consistent(&shared->lock);
+  return status != ETIMEDOUT;
+}
+
+/***
+* pool_queue: Queues a block for the workers. Returns false if the
+*   queue is full.
+*/
+static bool pool_queue (struct fs_pool * pool, struct pool_task * task) {
+  if ( !fs_queue_push(pool->queue, task) )
+    return false;
+  sem_post(&pool->shared->queued);
+  return true;
+}
+
+/***
+* pool_drain: Drops the blocks still queued (of a job that ended).
+*/
+static void pool_drain (struct fs_pool * pool) {
+  struct pool_task task;
+  while ( fs_queue_pop(pool->queue, &task) )
+    sem_trywait(&pool->shared->queued);
+}
+
+/***
+* resident_bytes: This process's resident memory.
+*/
+static u_int64_t resident_bytes (void) {
+  unsigned long pages = 0;
+  FILE * file = fopen("/proc/self/statm", "r");
+
+  if ( file != NULL ) {
+    if ( fscanf(file, "%*u %lu", &pages) != 1 )
+      pages = 0;
+    fclose(file);
+  }
+  return (u_int64_t)pages * sysconf(_SC_PAGESIZE);
+}
+
+/***
+* pool_worker_main: A worker's loop: sums queued blocks until the pool
+*   shuts down, or it is time to recycle the worker.
+*/
+static void pool_worker_main (struct fs_pool * pool, int index) {
+  struct pool_shared * shared = pool->shared;
+  struct pool_worker * self = &shared->workers[index];
+  u_int64_t start_rss = resident_bytes();
+  u_int64_t tasks = 0;
+  char path[PATH_MAX];
+
+  for ( ;; ) {
+    struct fs_job job;
+    struct fs_result result;
+    struct child_info child_info;
+    struct pool_task task;
+    struct pool_result out;
+    struct timespec started;
+
+    while ( sem_wait(&shared->queued) == -1 && errno == EINTR )
+      ;
+    if ( atomic_load(&shared->shutdown) )
+      _exit(0);
+    // Take the block straight into `self`, so the job can queue it
+    // again if this worker dies.
+    self->task.generation = 0;
+    atomic_store(&self->busy, true);
+    if ( !fs_queue_pop(pool->queue, &self->task) ) {
+      // Drained by the job, or taken by a worker that woke earlier.
+      atomic_store(&self->busy, false);
+      continue;
+    }
+    task = self->task;
+    if ( task.generation != atomic_load(&shared->generation) ) {
+      atomic_store(&self->busy, false);
+      continue;
+    }
+    // The job set these before queueing the block, and keeps them
+    // until it has the block's result.
+    memset(&job, 0, sizeof(job));
+    memset(&result, 0, sizeof(result));
+    job.options = shared->options;
+    job.stat_buf = shared->stat_buf;
+    strcpy(path, shared->path);
+
+    job.path = path;
+    job.result = &result;
+    job.epoll_fd = -1;
+    job.where = shared->where;
+    job.filter = shared->filtered ? &job.where : NULL;
+    range_bounds(&job);
+    result.size = job.range_end - job.range_start;
+    memset(&child_info, 0, sizeof(child_info));
+    child_info.child_num = task.child_num;
+    child_info.seek_to = task.seek_to;
+    child_info.read_to = task.read_to;
+    child_info.stored = task.has_stored ? &task.stored : NULL;
+    memset(&out, 0, sizeof(out));
+    out.generation = task.generation;
+    out.partial.child_num = task.child_num;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if ( sum_or_reuse(&job, &child_info, &out.partial, &started, NULL) == -1 )
+      out.status = errno ? errno : EIO;
+
+    // There is always room: the job queues no more blocks than that.
+    pool_lock(shared);
+    shared->results[(shared->result_head + shared->result_count) % POOL_QUEUE_SIZE] = out;
+    shared->result_count += 1;
+    atomic_store(&self->busy, false);
+    pthread_cond_signal(&shared->done);
+    pthread_mutex_unlock(&shared->lock);
+
+    tasks += 1;
+    if ( tasks >= pool->max_tasks || resident_bytes() > start_rss + pool->max_growth )
+      _exit(0);
+  }
+}
+
+/***
+* pool_fork: Starts worker `index`. Returns -1 if it couldn't be forked.
+*/
+static int pool_fork (struct fs_pool * pool, int index) {
+  pid_t pid = fork();
+
+  if ( pid == -1 )
+    return -1;
+  if ( pid == 0 ) {
+    // Don't outlive a program that exits without fs_pool_destroy.
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if ( getppid() == 1 )
+      _exit(0);
+    pool_worker_main(pool, index);
+  }
+  pool->shared->workers[index].pid = pid;
+  return 0;
+}
+
+/***
+* pool_replace: Replaces workers that exited (recycled or died),
+*   queueing the block a dead worker was summing again.
+*/
+static void pool_replace (struct fs_pool * pool) {
+  struct pool_shared * shared = pool->shared;
+
+  for ( int i = 0; i < pool->worker_count; i++ ) {
+    struct pool_worker * worker = &shared->workers[i];
+    if ( worker->pid > 0 && waitpid(worker->pid, NULL, WNOHANG) == 0 )
+      continue;
+    worker->pid = 0;
+    if ( atomic_load(&worker->busy) ) {
+      if ( worker->task.generation == 0 )
+        pool->lost = true;
+      else if ( worker->task.generation == atomic_load(&shared->generation) && !pool_queue(pool, &worker->task) )
+        pool->lost = true;
+      else if ( worker->task.generation == atomic_load(&shared->generation) )
+        pool->requeued += 1;
+    }
+    atomic_store(&worker->busy, false);
+    // It may have died having taken the semaphore but not the block.
+    sem_post(&shared->queued);
+    if ( pool_fork(pool, i) == -1 )
+      fprintf(stderr, "Warn: could not replace pool worker: %s.\n", strerror(errno));
+  }
+}
+
+/***
+* pool_reset: Stops all the workers and empties the queue, for when a
+*   worker died taking a block and may have left the queue stuck. The
+*   workers are forked again by the next pool_replace.
+*/
+static void pool_reset (struct fs_pool * pool) {
+  struct pool_shared * shared = pool->shared;
+
+  for ( int i = 0; i < pool->worker_count; i++ ) {
+    if ( shared->workers[i].pid > 0 ) {
+      kill(shared->workers[i].pid, SIGKILL);
+      waitpid(shared->workers[i].pid, NULL, 0);
+    }
+    shared->workers[i].pid = 0;
+    atomic_store(&shared->workers[i].busy, false);
+  }
+  fs_queue_init(pool->queue, POOL_QUEUE_SIZE, sizeof(struct pool_task));
+  sem_destroy(&shared->queued);
+  sem_init(&shared->queued, 1, 0);
+  pool->lost = false;
+}
+
+/***
+* pool_dispatch: Queues the job's pending blocks, as far as there is
+*   room.
+*/
+static void pool_dispatch (struct fs_job * job) {
+  struct fs_pool * pool = job->options.pool;
+  struct pool_task task;
+
+  while ( job->pending_count > 0 && pool->in_flight < POOL_QUEUE_SIZE ) {
+    u_int16_t child_num = job->pending[job->pending_count - 1];
+    struct child_info * child_info = &job->children[child_num];
+    memset(&task, 0, sizeof(task));
+    task.generation = atomic_load(&pool->shared->generation);
+    task.child_num = child_num;
+    task.seek_to = child_info->seek_to;
+    task.read_to = child_info->read_to;
+    if ( child_info->stored != NULL ) {
+      task.has_stored = true;
+      task.stored = *child_info->stored;
+    }
+    if ( !pool_queue(pool, &task) )
+      break;
+    job->pending_count -= 1;
+    pool->in_flight += 1;
+  }
+}
+
+/***
+* pool_start: Hands the job's file to the pool and queues its blocks.
+*/
+static int pool_start (struct fs_job * job) {
+  struct fs_pool * pool = job->options.pool;
+  struct pool_shared * shared = pool->shared;
+
+  if ( pool->busy ) {
+    errno = EBUSY;
+    return fail("Pool is in use by another job");
+  }
+  if ( strlen(job->path) >= sizeof(shared->path) ) {
+    errno = ENAMETOOLONG;
+    return fail("Error checking input file");
+  }
+  job->pending = calloc(job->result->child_count, sizeof(u_int16_t));
+  if ( job->pending == NULL )
+    return fail("Error allocating job");
+  // The last block is taken first, so queue them in reverse.
+  for ( int i = job->result->child_count - 1; i >= 0; i-- )
+    job->pending[job->pending_count++] = i;
+
+  pool_replace(pool);
+  if ( pool->lost ) {
+    pool_reset(pool);
+    pool_replace(pool);
+  }
+  // Workers only read these once they took one of the job's blocks.
+  strcpy(shared->path, job->path);
+  shared->stat_buf = job->stat_buf;
+  shared->options = job->options;
+  shared->where = job->where;
+  shared->filtered = job->filter != NULL;
+  atomic_fetch_add(&shared->generation, 1);
+  pool_lock(shared);
+  shared->result_count = 0;
+  pthread_mutex_unlock(&shared->lock);
+  pool->busy = true;
+  pool->in_flight = 0;
+  pool->requeued = 0;
+  job->pool_claimed = true;
+  job->waiting_for = job->result->child_count;
+  pool_dispatch(job);
+  return 0;
+}
+
+/***
+* pool_next: fs_job_next for jobs with a pool.
+*/
+static int pool_next (struct fs_job * job, struct fs_partial * partial) {
+  struct fs_pool * pool = job->options.pool;
+  struct pool_shared * shared = pool->shared;
+  struct pool_result out;
+  struct trace_ring * ring = TRACE_RING(job->trace, 0);
+  u_int64_t span_started = TRACE_BEGIN(ring);
+
+  if ( job->waiting_for == 0 )
+    return 0;
+  pool_lock(shared);
+  for ( ;; ) {
+    while ( shared->result_count == 0 ) {
+      if ( pool_wait(shared, &shared->done, POOL_CHECK_NS) )
+        continue;
+      // Nothing for a while: make sure the workers are still there.
+      pthread_mutex_unlock(&shared->lock);
+      pool_replace(pool);
+      job->result->reassigned_blocks = pool->requeued;
+      if ( pool->lost ) {
+        job->failed = true;
+        job->failed_errno = errno = EIO;
+        job->failed_step = "Pool worker died taking a block";
+        return fail(job->failed_step);
+      }
+      pool_lock(shared);
+    }
+    out = shared->results[shared->result_head];
+    shared->result_head = (shared->result_head + 1) % POOL_QUEUE_SIZE;
+    shared->result_count -= 1;
+    if ( out.generation == atomic_load(&shared->generation) )
+      break;
+  }
+  pthread_mutex_unlock(&shared->lock);
+  pool->in_flight -= 1;
+  job->waiting_for -= 1;
+  pool_dispatch(job);
+  TRACE_END(ring, "collect", span_started);
+
+  if ( out.status != 0 ) {
+    job->failed = true;
+    job->failed_errno = errno = out.status;
+    job->failed_step = "Error summing block in pool";
+    return fail(job->failed_step);
+  }
+  collect_partial(job, &out.partial, partial);
+  return 1;
+}
+
+/***
+* pool_release: Frees the pool for the next job. Workers still on one
+*   of this job's blocks (after a failure) are stopped and replaced.
+*/
+static void pool_release (struct fs_job * job) {
+  struct fs_pool * pool = job->options.pool;
+  struct pool_shared * shared = pool->shared;
+
+  atomic_fetch_add(&shared->generation, 1);
+  pool_drain(pool);
+  for ( int i = 0; i < pool->worker_count; i++ ) {
+    struct pool_worker * worker = &shared->workers[i];
+    if ( worker->pid <= 0 || !atomic_load(&worker->busy) )
+      continue;
+    kill(worker->pid, SIGKILL);
+    waitpid(worker->pid, NULL, 0);
+    worker->pid = 0;
+    if ( worker->task.generation == 0 )
+      pool->lost = true;
+    atomic_store(&worker->busy, false);
+  }
+  if ( pool->lost )
+    pool_reset(pool);
+  pool_lock(shared);
+  shared->result_count = 0;
+  pthread_mutex_unlock(&shared->lock);
+  pool->busy = false;
+  pool->in_flight = 0;
+}
+
+/***
+* job_release: Stops any children still running, reaps them,
+*   and frees the job.
+*/
+static void job_release (struct fs_job * job) {
+  for ( int i = 0; job->children != NULL && i < job->result->child_count; i++ ) {
+    struct child_info * child_info = &job->children[i];
+    if ( child_info->pid <= 0 )
+      continue;
+    if ( !child_info->done )
+      kill(child_info->pid, SIGKILL);
+    waitpid(child_info->pid, NULL, 0);
+    close(child_info->fds[0]);
+  }
+  for ( int i = 0; i < job->worker_count; i++ )
+    if ( job->workers[i].fd != -1 )
+      close(job->workers[i].fd);
+  if ( job->epoll_fd != -1 )
+    close(job->epoll_fd);
+  trace_close(job->trace, false);
+  if ( job->pool_claimed )
+    pool_release(job);
+  if ( job->groups != NULL )
+    fs_groups_free(job->groups);
+  free(job->workers);
+  free(job->pending);
+  free(job->wire_path);
+  free(job->cache_entry);
+  free(job->replay);
+  free(job->stored);
+  free(job->children);
+  free(job->tune);
+  free(job->path);
+  free(job);
+}
+
+/***
+ *
+ * Async Engine Section
+ *
+ * fs_sum_files sums many small files without a process per file or
+ * block. Each thread keeps async_depth files in flight, each a little
+ * state machine in a slot: its open, then its reads, are submitted to
+ * the thread's io_uring, and each completion moves its file on a step
+ * (parsing the chunk that was read) and submits the file's next
+ * operation. So a thread waits on hundreds of opens and reads at once
+ * instead of on one, and parses whichever completes first.
+ *
+ * The ring is set up with the raw system calls (no liburing). Where
+ * io_uring isn't available (an old kernel, or a seccomp filter), the
+ * threads run the same steps with plain blocking calls, a file at a
+ * time.
+ */
+
+#define ASYNC_DEFAULT_DEPTH 64
+// Bytes read at a time per file.
+#define ASYNC_CHUNK (64 * 1024)
+
+// A thread's io_uring, mapped.
+struct uring {
+  int fd;
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned sq_mask;
+  unsigned * sq_array;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned cq_mask;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+  void * ring_map;
+  size_t ring_length;
+  size_t sqes_length;
+  unsigned queued; // Entries filled in since the last submit.
+};
+
+// A file in flight.
+struct async_file {
+  int index; // Of its path, or -1 while the slot is free.
+  int fd;
+  u_int64_t offset; // Of the next read.
+  struct fs_scan scan;
+  struct timespec started;
+  char * buffer; // ASYNC_CHUNK bytes.
+};
+
+// What the threads of an fs_sum_files call share.
+struct async_run {
+  const char * const * paths;
+  int count;
+  const struct fs_options * options;
+  // The compiled options.where (see filter_compile).
+  struct fs_where where;
+  const struct fs_where * filter;
+  struct fs_result * results;
+  int * errors;
+  atomic_int next; // The next path to start.
+};
+
+/***
+* uring_open: Sets up an io_uring with room for `entries` operations.
+*   Returns -1 if io_uring isn't available.
+*/
+static int uring_open (struct uring * ring, unsigned entries) {
+  struct io_uring_params params;
+  char * map;
+
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+  if ( ring->fd == -1 )
+    return -1;
+  // Kernels without a single mapping for both rings predate
+  // IORING_OP_OPENAT and IORING_OP_READ anyway.
+  if ( !(params.features & IORING_FEAT_SINGLE_MMAP) ) {
+    close(ring->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  ring->ring_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  if ( params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->ring_length )
+    ring->ring_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->ring_map = mmap(NULL, ring->ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQES);
+  if ( ring->ring_map == MAP_FAILED || ring->sqes == MAP_FAILED ) {
+    if ( ring->ring_map != MAP_FAILED )
+      munmap(ring->ring_map, ring->ring_length);
+    if ( ring->sqes != MAP_FAILED )
+      munmap(ring->sqes, ring->sqes_length);
+    close(ring->fd);
+    return -1;
+  }
+  map = ring->ring_map;
+  ring->sq_head = (unsigned *)(map + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(map + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(map + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(map + params.sq_off.array);
+  ring->cq_head = (unsigned *)(map + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(map + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(map + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+  ring->queued = 0;
+  return 0;
+}
+
+static void uring_close (struct uring * ring) {
+  munmap(ring->sqes, ring->sqes_length);
+  munmap(ring->ring_map, ring->ring_length);
+  close(ring->fd);
+}
+
+/***
+* uring_entry: The next submission entry, zeroed. There is always one:
+*   each slot has at most one operation in flight.
+*/
+static struct io_uring_sqe * uring_entry (struct uring * ring) {
+  unsigned tail = *ring->sq_tail + ring->queued;
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe * sqe = &ring->sqes[index];
+
+  ring->sq_array[index] = index;
+  ring->queued += 1;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/***
+* uring_submit: Submits the entries filled in, and waits for at least
+*   one completion.
+*/
+static int uring_submit (struct uring * ring) {
+  unsigned submit = ring->queued;
+
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+  ring->queued = 0;
+  while ( syscall(SYS_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 ) {
+    if ( errno != EINTR )
+      return -1;
+    // The entries were taken before the wait was interrupted.
+    submit = 0;
+  }
+  return 0;
+}
+
+/***
+* async_finish: Fills in the result of the file in `slot` (or its
+*   error), and frees the slot.
+*/
+static void async_finish (struct async_run * run, struct async_file * slot, int error) {
+  struct fs_result * result = &run->results[slot->index];
+  struct fs_partial * partial;
+
+  if ( slot->fd >= 0 )
+    close(slot->fd);
+  memset(result, 0, sizeof(*result));
+  if ( error == 0 && ( result->partials = calloc(1, sizeof(struct fs_partial)) ) == NULL )
+    error = ENOMEM;
+  run->errors[slot->index] = error;
+  slot->index = -1;
+  slot->fd = -1;
+  if ( error != 0 )
+    return;
+  fs_scan_finish(&slot->scan);
+  partial = &result->partials[0];
+  partial->bytes = slot->offset;
+  partial->read_to = slot->offset ? slot->offset - 1 : 0;
+  partial->sum = result->sum = slot->scan.sum;
+  partial->records = result->records = slot->scan.records;
+  result->size = result->block_size = slot->offset;
+  result->child_count = 1;
+  result->partial_count = 1;
+  if ( run->options->stats ) {
+    finish_stats(partial, &slot->started);
+    result->collect_ns = partial->nanoseconds;
+  }
+}
+
+/***
+* async_start: Puts file `index` in `slot`, from its start.
+*/
+static void async_start (struct async_run * run, struct async_file * slot, int index) {
+  slot->index = index;
+  slot->fd = -1;
+  slot->offset = 0;
+  scan_start(run->options, run->filter, NULL, &slot->scan);
+  clock_gettime(CLOCK_MONOTONIC, &slot->started);
+}
+
+/***
+* async_take: Puts the next file in `slot`. Returns false once all
+*   files have been taken.
+*/
+static bool async_take (struct async_run * run, struct async_file * slot) {
+  int index = atomic_fetch_add(&run->next, 1);
+
+  if ( index >= run->count )
+    return false;
+  async_start(run, slot, index);
+  return true;
+}
+
+/***
+* async_read: Queues the next read of the file in `slot`.
+*/
+static void async_read (struct uring * ring, struct async_file * slot) {
+  struct io_uring_sqe * sqe = uring_entry(ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = slot->fd;
+  sqe->off = slot->offset;
+  sqe->addr = (u_int64_t)(uintptr_t)slot->buffer;
+  sqe->len = ASYNC_CHUNK;
+  sqe->user_data = (u_int64_t)(uintptr_t)slot;
+}
+
+/***
+* async_open: Queues the open of the file in `slot`.
+*/
+static void async_open (struct async_run * run, struct uring * ring, struct async_file * slot) {
+  struct io_uring_sqe * sqe = uring_entry(ring);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (u_int64_t)(uintptr_t)run->paths[slot->index];
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+  sqe->user_data = (u_int64_t)(uintptr_t)slot;
+}
+
+/***
+* async_step: Moves the file in `slot` on, now that its open or read
+*   completed with `status` (a descriptor or byte count, or -errno).
+*   Returns whether the file is still in flight.
+*/
+static bool async_step (struct async_run * run, struct uring * ring, struct fs_kernel * kernel,
+    struct async_file * slot, int status) {
+  if ( status < 0 ) {
+    async_finish(run, slot, -status);
+    return false;
+  }
+  if ( slot->fd == -1 ) {
+    slot->fd = status;
+  } else if ( status == 0 ) {
+    async_finish(run, slot, 0);
+    return false;
+  } else {
+    kernel->unbounded(&slot->scan, slot->buffer, status, 0);
+    slot->offset += status;
+  }
+  async_read(ring, slot);
+  return true;
+}
+
+/***
+* async_sum: Sums the file in `slot` with blocking calls.
+*/
+static void async_sum (struct async_run * run, struct fs_kernel * kernel, struct async_file * slot) {
+  ssize_t length;
+
+  slot->fd = open(run->paths[slot->index], O_RDONLY | O_CLOEXEC);
+  if ( slot->fd == -1 ) {
+    async_finish(run, slot, errno);
+    return;
+  }
+  while ( ( length = pread(slot->fd, slot->buffer, ASYNC_CHUNK, slot->offset) ) > 0 ) {
+    kernel->unbounded(&slot->scan, slot->buffer, length, 0);
+    slot->offset += length;
+  }
+  async_finish(run, slot, length == -1 ? errno : 0);
+}
+
+/***
+* async_blocking: The engine without io_uring: the same steps, with
+*   blocking calls, one file at a time.
+*/
+static void async_blocking (struct async_run * run, struct fs_kernel * kernel, struct async_file * slot) {
+  while ( async_take(run, slot) )
+    async_sum(run, kernel, slot);
+}
+
+/***
+* async_drain: After a failed submit, makes sure the kernel is done with
+*   the operations of the `in_flight` files: takes back the entries it
+*   didn't take, and waits for the rest to complete. Opens that
+*   completed leave their descriptor in the slot, to be closed. Returns
+*   -1 if it can't wait, when reads may still land in the buffers.
+*/
+static int async_drain (struct uring * ring, int in_flight) {
+  // Without SQPOLL, the kernel only takes entries in io_uring_enter.
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  in_flight -= *ring->sq_tail - head;
+  __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+  while ( in_flight > 0 ) {
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for ( head = *ring->cq_head; head != tail; head++ ) {
+      struct io_uring_cqe * cqe = &ring->cqes[head & ring->cq_mask];
+      struct async_file * slot = (struct async_file *)(uintptr_t)cqe->user_data;
+      if ( slot->fd == -1 && cqe->res >= 0 )
+        slot->fd = cqe->res;
+      in_flight -= 1;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    if ( in_flight > 0 && syscall(SYS_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1
+         && errno != EINTR )
+      return -1;
+  }
+  return 0;
+}
+
+/***
+* async_redo: Sums the file in flight in `slot` again from its start,
+*   with blocking calls in `spare` (which has no buffer if there was
+*   no memory for one).
+*/
+static void async_redo (struct async_run * run, struct fs_kernel * kernel, struct async_file * slot,
+    struct async_file * spare) {
+  int index = slot->index;
+
+  // A read still in flight holds its own reference to the file.
+  if ( slot->fd >= 0 )
+    close(slot->fd);
+  slot->index = -1;
+  slot->fd = -1;
+  async_start(run, spare, index);
+  if ( spare->buffer == NULL )
+    async_finish(run, spare, ENOMEM);
+  else
+    async_sum(run, kernel, spare);
+}
+
+/***
+* async_thread: A thread of fs_sum_files: takes files until there are
+*   none left, keeping up to async_depth of them in flight.
+*/
+static void * async_thread (void * argument) {
+  struct async_run * run = argument;
+  int depth = run->options->async_depth > 0 ? run->options->async_depth : ASYNC_DEFAULT_DEPTH;
+  struct async_file * slots = calloc(depth, sizeof(struct async_file));
+  char * buffers = malloc((size_t)depth * ASYNC_CHUNK);
+  struct fs_scan scan;
+  struct fs_kernel kernel = scan_start(run->options, run->filter, NULL, &scan);
+  struct uring ring;
+  int in_flight = 0;
+  bool more = true;
+
+  if ( slots == NULL || buffers == NULL ) {
+    // Leave the files to the other threads, if there are any.
+    free(slots);
+    free(buffers);
+    return NULL;
+  }
+  for ( int i = 0; i < depth; i++ ) {
+    slots[i].index = -1;
+    slots[i].fd = -1;
+    slots[i].buffer = buffers + (size_t)i * ASYNC_CHUNK;
+  }
+
+  if ( uring_open(&ring, depth) == -1 ) {
+    async_blocking(run, &kernel, &slots[0]);
+    free(slots);
+    free(buffers);
+    return NULL;
+  }
+  for ( ;; ) {
+    // Start files in the free slots.
+    for ( int i = 0; more && i < depth; i++ ) {
+      if ( slots[i].index != -1 )
+        continue;
+      if ( !( more = async_take(run, &slots[i]) ) )
+        break;
+      async_open(run, &ring, &slots[i]);
+      in_flight += 1;
+    }
+    if ( in_flight == 0 )
+      break;
+    if ( uring_submit(&ring) == -1 ) {
+      // The files are fine (the error may well be a passing EAGAIN):
+      // redo those in flight and the rest without the ring, once the
+      // kernel is done with the buffers. If it can't be waited for,
+      // its reads may still land, so the buffers are left to it.
+      bool drained = async_drain(&ring, in_flight) == 0;
+      struct async_file spare = { .index = -1, .fd = -1 };
+
+      spare.buffer = drained ? buffers : malloc(ASYNC_CHUNK);
+      uring_close(&ring);
+      for ( int i = 0; i < depth; i++ )
+        if ( slots[i].index != -1 )
+          async_redo(run, &kernel, &slots[i], &spare);
+      if ( spare.buffer != NULL )
+        async_blocking(run, &kernel, &spare);
+      free(slots);
+      free(spare.buffer);
+      return NULL;
+    }
+    // Handle the completions, each resuming its file.
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; head++ ) {
+      struct io_uring_cqe * cqe = &ring.cqes[head & ring.cq_mask];
+      struct async_file * slot = (struct async_file *)(uintptr_t)cqe->user_data;
+      if ( !async_step(run, &ring, &kernel, slot, cqe->res) )
+        in_flight -= 1;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  uring_close(&ring);
+  free(slots);
+  free(buffers);
+  return NULL;
+}
+
+/***
+ *
+ * Public API Section
+ *
+ */
+
+void fs_options_init (struct fs_options * options) {
+  memset(options, 0, sizeof(*options));
+  options->child_count = 1;
+  options->reader = FS_READER_STDIO;
+  options->delimiter = FS_NO_DELIMITER;
+  options->width = 3;
+}
+
+struct fs_job * fs_job_start (const char * path, const struct fs_options * options, struct fs_result * result) {
+  struct fs_job * job = calloc(1, sizeof(struct fs_job));
+  struct timespec started;
+  u_int64_t size;
+  u_int64_t stat_started;
+  u_int64_t stat_finished;
+  struct timespec job_started_real;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  clock_gettime(CLOCK_REALTIME, &job_started_real);
+  memset(result, 0, sizeof(*result));
+  if ( job == NULL ) {
+    fail("Error allocating job");
+    return NULL;
+  }
+  job->options = *options;
+  job->result = result;
+  job->epoll_fd = -1;
+  job->started_real = job_started_real;
+  // O_DIRECT needs aligned buffers, which only the read reader has.
+  if ( job->options.direct )
+    job->options.reader = FS_READER_READ;
+  if ( job->options.child_count == 0 )
+    job->options.child_count = 1;
+  // auto_tune measures this host, not the workers; and the
+  // workers take the place of a pool too.
+  if ( job->options.workers != NULL ) {
+    job->options.auto_tune = false;
+    job->options.pool = NULL;
+  }
+
+  // Get file information/stats.
+  job->path = strdup(path);
+  stat_started = trace_now();
+  if ( job->path == NULL || stat(path, &job->stat_buf) == -1 ) {
+    fail("Error checking input file");
+    job_release(job);
+    return NULL;
+  }
+  stat_finished = trace_now();
+
+  // Only the range is summed (and split). Workers would have to find
+  // the records in their own copy of the file.
+  if ( ( job->options.range_offset > 0 || job->options.range_length > 0 || job->options.record_start > 0
+         || job->options.record_count > 0 ) && job->options.workers != NULL ) {
+    errno = EINVAL;
+    fail("Ranges can't be summed by workers");
+    job_release(job);
+    return NULL;
+  }
+  // The wire format has no room for a filter either.
+  if ( job->options.where != NULL && job->options.workers != NULL ) {
+    errno = EINVAL;
+    fail("Filters can't be used with workers");
+    job_release(job);
+    return NULL;
+  }
+  if ( filter_compile(&job->options, &job->where, &job->filter) == -1 ) {
+    job_release(job);
+    return NULL;
+  }
+  // Groups only come back over the children's pipes, and the result
+  // cache has no room for them.
+  if ( job->options.key_column != 0 && ( job->options.workers != NULL || job->options.pool != NULL ) ) {
+    errno = EINVAL;
+    fail("Groups can't be summed by workers or a pool");
+    job_release(job);
+    return NULL;
+  }
+  if ( groups_start(&job->options, &job->group_table, &job->groups) == -1 ) {
+    job_release(job);
+    return NULL;
+  }
+  if ( job->groups != NULL )
+    job->options.result_cache = false;
+  if ( range_resolve(job) == -1 ) {
+    fail("Error finding the records");
+    job_release(job);
+    return NULL;
+  }
+  range_bounds(job);
+  size = job->range_end - job->range_start;
+  result->size = size;
+  result->offset = job->range_start;
+
+  // On a result cache hit, fs_job_next replays the stored
+  // partials and no children are started.
+  if ( job->options.result_cache && result_load(job) ) {
+    job->replay = job->stored;
+    job->stored = NULL;
+    result->partials = calloc(result->child_count, sizeof(struct fs_partial));
+    job->children = calloc(result->child_count, sizeof(struct child_info));
+    if ( result->partials == NULL || job->children == NULL ) {
+      fail("Error allocating job");
+      job_release(job);
+      return NULL;
+    }
+    for ( int i = 0; i < result->child_count; i++ ) {
+      job->children[i].child_num = i;
+      job->children[i].seek_to = job->replay[i].seek_to;
+      job->children[i].read_to = job->replay[i].read_to;
+    }
+    if ( job->options.trace_file != NULL ) {
+      job->trace = trace_open(job->options.trace_file, result->child_count);
+      if ( job->trace == NULL ) {
+        fail("Error allocating trace");
+        job_release(job);
+        return NULL;
+      }
+      trace_record(job->trace->rings[0], "stat", stat_started, stat_finished);
+      trace_record(job->trace->rings[0], "result cache", stat_finished, trace_now());
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->collecting);
+    result->start_ns = nanoseconds_between(&started, &job->collecting);
+    return job;
+  }
+
+  // Let auto_tune pick the child count; the block size follows from it.
+  if ( job->options.auto_tune ) {
+    job->tune = malloc(sizeof(struct tune_info));
+    if ( job->tune == NULL ) {
+      fail("Error allocating job");
+      job_release(job);
+      return NULL;
+    }
+    job->options.child_count = tune_pick(job->tune, path, size, job->options.tune_cache);
+    job->options.block_size = 0;
+    result->cpus = job->tune->cpus;
+    result->quota = job->tune->quota;
+    result->cached = job->tune->cached;
+  }
+
+  // Handles the case where block_size or child_count are used.
+  if ( job->options.block_size > 0 ) {
+    // Set how many children should be spawned given a block size.
+    // (At least one, for blocks larger than the file.)
+    u_int64_t count = size / job->options.block_size;
+    result->child_count = count > 0 ? ( count < 65535 ? count : 65535 ) : 1;
+    result->block_size = job->options.block_size;
+    if ( count > 65535 )
+      result->block_size = size / result->child_count;
+  } else {
+    // Divide the files into blocks for the children.
+    // (At most one per byte, which small ranges can come to.)
+    result->child_count = job->options.child_count;
+    if ( result->child_count > size )
+      result->child_count = size > 0 ? size : 1;
+    result->block_size = size / result->child_count;
+  }
+
+  result->partials = calloc(result->child_count, sizeof(struct fs_partial));
+  job->children = calloc(result->child_count, sizeof(struct child_info));
+  // Use epoll to watch file descriptors.
+  // Note that the argument "1" is discarded and it doesn't
+  // matter what it is set to.
+  job->epoll_fd = epoll_create(1);
+  if ( result->partials == NULL || job->children == NULL ) {
+    fail("Error allocating job");
+    job_release(job);
+    return NULL;
+  }
+  if ( job->epoll_fd == -1 ) { // epoll_create returns -1 on error.
+    fail("epoll create");
+    job_release(job);
+    return NULL;
+  }
+
+  // The rings the parent and children record their spans in.
+  if ( job->options.trace_file != NULL ) {
+    job->trace = trace_open(job->options.trace_file, result->child_count);
+    if ( job->trace == NULL ) {
+      fail("Error allocating trace");
+      job_release(job);
+      return NULL;
+    }
+    trace_record(job->trace->rings[0], "stat", stat_started, stat_finished);
+  }
+
+  // Find the NUMA nodes, for numa placement and for the statistics.
+  numa_discover();
+
+  // How much of the file was cached before the run, so the
+  // statistics can show what the run did to the page cache.
+  if ( job->options.stats && job->options.workers == NULL )
+    result->cached_before = cached_fraction(path, job->stat_buf.st_size);
+
+  // Time the children, so auto_tune can tell which settings are fastest.
+  if ( job->tune != NULL )
+    clock_gettime(CLOCK_MONOTONIC, &job->tune->start);
+
+  // Create the children (or hand the blocks to the workers).
+  for ( int i = 0; i < result->child_count; i++ ) {
+    // Set the block the child will be responsible for.
+    u_int64_t seek_to = job->range_start + i * result->block_size;
+    u_int64_t read_to;
+    // The last child will read to the end of the file (or range).
+    if ( (i + 1) == result->child_count )
+      read_to = job->range_end;
+    else // Otherwise, the child should read to just before the start of the next block.
+      read_to = job->range_start + (i+1)*result->block_size - 1;
+    if ( job->options.workers != NULL || job->options.pool != NULL ) {
+      job->children[i].child_num = i;
+      job->children[i].seek_to = seek_to;
+      job->children[i].read_to = read_to;
+      if ( i < job->stored_count )
+        job->children[i].stored = &job->stored[i];
+      continue;
+    }
+    // Add the child with the given block boundaries.
+    if ( add_child(job, i, seek_to, read_to) == -1 ) {
+      int saved_errno = errno;
+      job_release(job);
+      errno = saved_errno;
+      return NULL;
+    }
+  }
+
+  if ( job->options.workers != NULL && remote_start(job) == -1 ) {
+    int saved_errno = errno;
+    job_release(job);
+    errno = saved_errno;
+    return NULL;
+  }
+  if ( job->options.pool != NULL && pool_start(job) == -1 ) {
+    int saved_errno = errno;
+    job_release(job);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &job->collecting);
+  result->start_ns = nanoseconds_between(&started, &job->collecting);
+  return job;
+}
+
+int fs_job_next (struct fs_job * job, struct fs_partial * partial) {
+  if ( job->replay != NULL ) {
+    if ( job->replayed == job->result->child_count )
+      return 0;
+    struct fs_partial result = job->replay[job->replayed++];
+    collect_partial(job, &result, partial);
+    return 1;
+  }
+  if ( job->workers != NULL )
+    return remote_next(job, partial);
+  if ( job->pool_claimed )
+    return pool_next(job, partial);
+  // Keep polling for pipe output until all the children
+  // have returned some results.
+  while ( job->waiting_for > 0 ) {
+    // If an event occurs, it'll be put into
+    // this structure:
+    struct epoll_event ev;
+    struct trace_ring * ring = TRACE_RING(job->trace, 0);
+    u_int64_t span_started = TRACE_BEGIN(ring);
+    // This call will block until a pipe is readable
+    // (or closed by a child that died).
+    int ready = epoll_wait(job->epoll_fd, &ev, 1, -1);
+    if ( ready == -1 && errno == EINTR )
+      continue;
+    if ( ready == -1 )
+      return fail("Error waiting for children");
+
+    struct child_info * child_info = ev.data.ptr;
+    // Read the output sent by the child into "result"
+    struct fs_partial result;
+    ssize_t bytes = read(child_info->fds[0], &result, sizeof(struct fs_partial));
+
+    TRACE_END(ring, "collect", span_started);
+
+    // Stop polling for events on this child.
+    epoll_ctl(job->epoll_fd, EPOLL_CTL_DEL, child_info->fds[0], NULL);
+    child_info->done = true;
+    job->waiting_for -= 1;
+
+    // Pipe writes this small are atomic, so anything but a
+    // whole result means the child failed.
+    if ( bytes != sizeof(struct fs_partial) ) {
+      job->failed = true;
+      job->failed_errno = errno = EIO;
+      job->failed_step = "Child exited without a result";
+      return fail(job->failed_step);
+    }
+    // Its groups follow, as large as they are.
+    if ( job->groups != NULL && groups_receive(job->groups, child_info->fds[0]) == -1 ) {
+      job->failed = true;
+      job->failed_errno = errno;
+      job->failed_step = fs_last_error();
+      return -1;
+    }
+
+    collect_partial(job, &result, partial);
+    return 1;
+  }
+  return 0;
+}
+
+bool fs_job_ready (struct fs_job * job) {
+  struct epoll_event ev;
+  if ( job->replay != NULL )
+    return job->replayed < job->result->child_count;
+  if ( job->pool_claimed ) {
+    struct pool_shared * shared = job->options.pool->shared;
+    bool ready;
+    pool_lock(shared);
+    ready = job->waiting_for > 0 && shared->result_count > 0;
+    pthread_mutex_unlock(&shared->lock);
+    return ready;
+  }
+  // The pipes are level triggered, so peeking
+  // leaves the event for fs_job_next.
+  return job->waiting_for > 0 && epoll_wait(job->epoll_fd, &ev, 1, 0) > 0;
+}
+
+int fs_job_finish (struct fs_job * job) {
+  struct fs_partial partial;
+  struct fs_result * result = job->result;
+  struct timespec started;
+  struct timespec finished;
+  struct trace * trace;
+  int status = 0;
+  int failed_errno;
+  const char * failed_step;
+
+  // Collect whatever hasn't been collected yet, unless
+  // a child has already failed.
+  while ( !job->failed && fs_job_next(job, &partial) == 1 )
+    ;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  if ( job->failed ) {
+    status = -1;
+  } else if ( job->groups != NULL && groups_result(job->groups, result) == -1 ) {
+    status = -1;
+    job->failed_errno = errno;
+    job->failed_step = fs_last_error();
+  } else {
+    // The page cache after the run, for the statistics.
+    if ( job->options.stats && job->options.workers == NULL && job->replay == NULL )
+      result->cached_after = cached_fraction(job->path, job->stat_buf.st_size);
+    // Remember how fast this run was for the next auto_tune run.
+    if ( job->tune != NULL )
+      tune_record(job->tune, result->child_count, result->size, job->options.tune_cache);
+    // And its result, for the next run on the same file.
+    if ( job->options.result_cache && job->replay == NULL && job->cache_entry != NULL )
+      result_store(job);
+  }
+
+  // Keep the trace until the children are reaped, so
+  // their last spans are in.
+  failed_errno = job->failed_errno;
+  failed_step = job->failed_step;
+  trace = job->trace;
+  job->trace = NULL;
+  job_release(job);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  result->finish_ns = nanoseconds_between(&started, &finished);
+  if ( trace != NULL )
+    trace_record(trace->rings[0], "finish", started.tv_sec * 1000000000ULL + started.tv_nsec, trace_now());
+  if ( trace_close(trace, true) == -1 && status == 0 )
+    return fail("Error writing trace");
+  if ( status == -1 ) {
+    errno = failed_errno;
+    fail(failed_step);
+  }
+  return status;
+}
+
+int fs_sum_file (const char * path, const struct fs_options * options, struct fs_result * result) {
+  struct fs_job * job = fs_job_start(path, options, result);
+  if ( job == NULL )
+    return -1;
+  return fs_job_finish(job);
+}
+
+int fs_sum_fd (int fd, const struct fs_options * options, struct fs_result * result) {
+  struct measurement measurement;
+  struct block_reader reader;
+  struct fs_scan scan;
+  struct fs_kernel kernel;
+  struct fs_where where;
+  const struct fs_where * filter;
+  struct fs_groups table;
+  struct fs_groups * groups;
+  struct fs_partial * partial;
+  struct timespec finished;
+  struct trace * trace = NULL;
+  u_int64_t span_started;
+  int duplicate;
+  int status;
+
+  memset(result, 0, sizeof(*result));
+  if ( filter_compile(options, &where, &filter) == -1 || groups_start(options, &table, &groups) == -1 )
+    return -1;
+  kernel = scan_start(options, filter, groups, &scan);
+  duplicate = dup(fd);
+  if ( duplicate == -1 )
+    return fail("Error opening input stream");
+  result->partials = calloc(1, sizeof(struct fs_partial));
+  if ( result->partials == NULL || reader_open_stream(&reader, duplicate, options->huge_pages) == -1 ) {
+    close(duplicate);
+    fs_result_free(result);
+    return fail("Error allocating result");
+  }
+  result->child_count = 1;
+  partial = &result->partials[0];
+  if ( options->trace_file != NULL && ( trace = trace_open(options->trace_file, 0) ) == NULL ) {
+    reader_close(&reader);
+    fs_result_free(result);
+    return fail("Error allocating trace");
+  }
+  clock_gettime(CLOCK_MONOTONIC, &measurement.started);
+
+  if ( options->stats )
+    numa_discover();
+  span_started = TRACE_BEGIN(TRACE_RING(trace, 0));
+  measure_start(&measurement, options);
+  status = handle_stream_chunks(&reader, &kernel, &scan, partial);
+  measure_finish(&measurement, partial, &reader.first_byte);
+  TRACE_END(TRACE_RING(trace, 0), "parse", span_started);
+  // Everything happens in the collect phase for streams.
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  result->collect_ns = nanoseconds_between(&measurement.started, &finished);
+  partial->page_kind = reader.page_kind;
+  partial->read_to = partial->bytes ? partial->bytes - 1 : 0;
+
+  reader_close(&reader);
+  if ( trace_close(trace, true) == -1 && status == 0 ) {
+    fs_result_free(result);
+    return fail("Error writing trace");
+  }
+  if ( status == -1 ) {
+    if ( groups != NULL )
+      fs_groups_free(groups);
+    fs_result_free(result);
+    return fail("Error reading input stream");
+  }
+  if ( groups != NULL ) {
+    status = groups_result(groups, result);
+    fs_groups_free(groups);
+    if ( status == -1 ) {
+      fs_result_free(result);
+      return -1;
+    }
+  }
+
+  result->sum = partial->sum;
+  result->records = partial->records;
+  result->partial_count = 1;
+  return 0;
+}
+
+int fs_sum_buffer (const void * data, size_t length, const struct fs_options * options, struct fs_result * result) {
+  struct fs_options defaults;
+  struct fs_scan scan;
+  struct fs_kernel kernel;
+  struct fs_where where;
+  const struct fs_where * filter;
+  struct fs_groups table;
+  struct fs_groups * groups;
+
+  if ( options == NULL ) {
+    fs_options_init(&defaults);
+    options = &defaults;
+  }
+  memset(result, 0, sizeof(*result));
+  if ( filter_compile(options, &where, &filter) == -1 || groups_start(options, &table, &groups) == -1 )
+    return -1;
+  kernel = scan_start(options, filter, groups, &scan);
+  result->partials = calloc(1, sizeof(struct fs_partial));
+  if ( result->partials == NULL ) {
+    if ( groups != NULL )
+      fs_groups_free(groups);
+    return fail("Error allocating result");
+  }
+  result->child_count = 1;
+  result->partial_count = 1;
+  result->size = length;
+  result->block_size = length;
+  kernel.unbounded(&scan, data, length, 0);
+  fs_scan_finish(&scan);
+  result->partials[0].read_to = length ? length - 1 : 0;
+  result->partials[0].bytes = length;
+  result->partials[0].sum = result->sum = scan.sum;
+  result->partials[0].records = result->records = scan.records;
+  if ( groups != NULL ) {
+    int status = groups_result(groups, result);
+    fs_groups_free(groups);
+    if ( status == -1 ) {
+      fs_result_free(result);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int fs_sum_files (const char * const * paths, int count, const struct fs_options * options,
+    struct fs_result * results, int * errors) {
+  struct async_run run;
+  int thread_count = options->async_threads > 0 ? options->async_threads : available_cpus();
+  pthread_t * threads;
+  int started = 0;
+  int failed = 0;
+
+  // Groups aren't summed in this process.
+  if ( options->key_column != 0 ) {
+    errno = EINVAL;
+    fail("Groups can't be summed by fs_sum_files");
+  }
+  if ( options->key_column != 0 || filter_compile(options, &run.where, &run.filter) == -1 ) {
+    for ( int i = 0; i < count; i++ ) {
+      memset(&results[i], 0, sizeof(results[i]));
+      errors[i] = EINVAL;
+    }
+    return -1;
+  }
+  if ( thread_count > count )
+    thread_count = count > 0 ? count : 1;
+  threads = calloc(thread_count, sizeof(pthread_t));
+  if ( threads == NULL )
+    return fail("Error allocating threads");
+  run.paths = paths;
+  run.count = count;
+  run.options = options;
+  run.results = results;
+  run.errors = errors;
+  atomic_init(&run.next, 0);
+  if ( options->stats )
+    numa_discover();
+  for ( int i = 0; i < thread_count; i++ )
+    if ( pthread_create(&threads[i], NULL, async_thread, &run) == 0 )
+      started += 1;
+  // Without any threads, this one does the work.
+  if ( started == 0 )
+    async_thread(&run);
+  for ( int i = 0; i < started; i++ )
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  // Files no thread could take (they couldn't allocate their slots).
+  for ( int i = atomic_load(&run.next); i < count; i++ ) {
+    memset(&results[i], 0, sizeof(results[i]));
+    errors[i] = ENOMEM;
+  }
+  for ( int i = 0; i < count; i++ )
+    failed += errors[i] != 0;
+  if ( failed > 0 ) {
+    errno = EIO;
+    return fail("Error summing some of the files");
+  }
+  return 0;
+}
+
+void fs_child_main (int argc, char ** argv) {
+  struct fs_job job;
+  struct fs_result result;
+  struct child_info child_info;
+  struct fs_partial stored;
+  int settings[14];
+
+  if ( argc != 7 || strcmp(argv[1], SPAWN_CHILD_ARG) != 0 )
+    return;
+  memset(&job, 0, sizeof(job));
+  memset(&result, 0, sizeof(result));
+  memset(&child_info, 0, sizeof(child_info));
+  memset(&stored, 0, sizeof(stored));
+  fs_options_init(&job.options);
+  if ( sscanf(argv[2], "%hu %hu %lu %lu %lu %lu", &child_info.child_num, &result.child_count,
+          &child_info.seek_to, &child_info.read_to, &job.options.range_offset, &job.options.range_length) != 6
+      || sscanf(argv[3], "%d %d %d %d %lu %d %d %d %d %d %d %d %d %d %d", &settings[0], &settings[1], &settings[2],
+          &settings[3], &job.options.prefetch, &settings[4], &settings[5], &settings[6], &settings[7],
+          &settings[8], &settings[9], &settings[10], &settings[11], &settings[12], &settings[13]) != 15 ) {
+    fprintf(stderr, "Error: bad arguments for a spawned child.\n");
+    _exit(EXIT_FAILURE);
+  }
+  job.options.reader = settings[0];
+  job.options.huge_pages = settings[1];
+  job.options.direct = settings[2];
+  job.options.drop_cache = settings[3];
+  job.options.delimiter = settings[4];
+  job.options.width = settings[5];
+  job.options.is_signed = settings[6];
+  job.options.stats = settings[7];
+  job.options.counters = settings[8];
+  job.options.numa = settings[9];
+  job.options.result_cache = settings[10];
+  job.options.key_column = settings[11];
+  job.options.value_column = settings[12];
+  job.options.separator = settings[13];
+  if ( sscanf(argv[4], "%lu %lu %lu %lu", &stored.sum, &stored.records, &stored.bytes, &stored.hash) == 4 ) {
+    stored.seek_to = child_info.seek_to;
+    stored.read_to = child_info.read_to;
+    child_info.stored = &stored;
+  }
+  // ("-" is no filter, and isn't one.)
+  if ( strcmp(argv[5], "-") != 0 )
+    job.options.where = argv[5];
+  job.path = argv[6];
+  job.result = &result;
+  job.epoll_fd = -1;
+  child_info.fds[0] = -1;
+  child_info.fds[1] = SPAWN_CHILD_FD;
+  if ( stat(job.path, &job.stat_buf) == -1 ) {
+    perror("Error checking input file");
+    _exit(EXIT_FAILURE);
+  }
+  if ( filter_compile(&job.options, &job.where, &job.filter) == -1
+       || groups_start(&job.options, &job.group_table, &job.groups) == -1 ) {
+    perror(fs_last_error());
+    _exit(EXIT_FAILURE);
+  }
+  range_bounds(&job);
+  result.size = job.range_end - job.range_start;
+  if ( job.options.numa )
+    numa_discover();
+  _exit(child_handler(&job, &child_info));
+}
+
+struct fs_pool * fs_pool_create (int workers, u_int64_t max_tasks, u_int64_t max_growth) {
+  struct fs_pool * pool;
+  pthread_mutexattr_t mutex_attributes;
+  pthread_condattr_t condition_attributes;
+  size_t queue_offset;
+
+  if ( workers < 1 ) {
+    errno = EINVAL;
+    fail("Error creating pool");
+    return NULL;
+  }
+  pool = calloc(1, sizeof(struct fs_pool));
+  if ( pool == NULL ) {
+    fail("Error allocating pool");
+    return NULL;
+  }
+  pool->worker_count = workers;
+  pool->max_tasks = max_tasks > 0 ? max_tasks : POOL_DEFAULT_MAX_TASKS;
+  pool->max_growth = max_growth > 0 ? max_growth : POOL_DEFAULT_MAX_GROWTH;
+  // The queue goes after the workers, on a cache line of its own.
+  queue_offset = sizeof(struct pool_shared) + workers * sizeof(struct pool_worker);
+  queue_offset = (queue_offset + FS_CACHE_LINE - 1) / FS_CACHE_LINE * FS_CACHE_LINE;
+  pool->map_length = queue_offset + fs_queue_bytes(POOL_QUEUE_SIZE, sizeof(struct pool_task));
+  pool->shared = mmap(NULL, pool->map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if ( pool->shared == MAP_FAILED ) {
+    free(pool);
+    fail("Error mapping pool");
+    return NULL;
+  }
+  pool->queue = (struct fs_queue *)((char *)pool->shared + queue_offset);
+  fs_queue_init(pool->queue, POOL_QUEUE_SIZE, sizeof(struct pool_task));
+  sem_init(&pool->shared->queued, 1, 0);
+
+  // Shared with the workers, and robust so a worker that dies
+  // holding the lock doesn't take the pool with it.
+  pthread_mutexattr_init(&mutex_attributes);
+  pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attributes, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&pool->shared->lock, &mutex_attributes);
+  pthread_mutexattr_destroy(&mutex_attributes);
+  pthread_condattr_init(&condition_attributes);
+  pthread_condattr_setpshared(&condition_attributes, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&condition_attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&pool->shared->done, &condition_attributes);
+  pthread_condattr_destroy(&condition_attributes);
+
+  for ( int i = 0; i < workers; i++ ) {
+    if ( pool_fork(pool, i) == -1 ) {
+      int saved_errno = errno;
+      fs_pool_destroy(pool);
+      errno = saved_errno;
+      fail("Error forking pool worker");
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void fs_pool_destroy (struct fs_pool * pool) {
+  struct pool_shared * shared;
+
+  if ( pool == NULL )
+    return;
+  shared = pool->shared;
+  atomic_store(&shared->shutdown, true);
+  for ( int i = 0; i < pool->worker_count; i++ )
+    sem_post(&shared->queued);
+  for ( int i = 0; i < pool->worker_count; i++ )
+    if ( shared->workers[i].pid > 0 )
+      waitpid(shared->workers[i].pid, NULL, 0);
+  sem_destroy(&shared->queued);
+  pthread_cond_destroy(&shared->done);
+  pthread_mutex_destroy(&shared->lock);
+  munmap(shared, pool->map_length);
+  free(pool);
+}
+
+void fs_result_free (struct fs_result * result) {
+  free(result->partials);
+  free(result->groups);
+  free(result->group_keys);
+  result->partials = NULL;
+  result->groups = NULL;
+  result->group_keys = NULL;
+  result->group_count = 0;
+}
+
+int fs_worker_listen (const char * address) {
+  char host[256];
+  const char * port = split_address(address, host, sizeof(host));
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+  struct addrinfo * found;
+  int fd = -1;
+  int on = 1;
+
+  if ( port == NULL ) {
+    errno = EINVAL;
+    return fail("Error parsing worker address");
+  }
+  // Workers sum any file a coordinator names, unauthenticated: only
+  // other hosts when asked ("0.0.0.0:PORT" for every interface).
+  if ( host[0] == '\0' )
+    strcpy(host, "127.0.0.1");
+  if ( getaddrinfo(host, port, &hints, &found) != 0 ) {
+    errno = EADDRNOTAVAIL;
+    return fail("Error resolving worker address");
+  }
+  for ( struct addrinfo * at = found; at != NULL && fd == -1; at = at->ai_next ) {
+    fd = socket(at->ai_family, at->ai_socktype | SOCK_CLOEXEC, at->ai_protocol);
+    if ( fd == -1 )
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ( bind(fd, at->ai_addr, at->ai_addrlen) == -1 || listen(fd, WORKER_BACKLOG) == -1 ) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  if ( fd == -1 )
+    return fail("Error listening for coordinators");
+  return fd;
+}
+
+int fs_worker_serve (int listen_fd, const struct fs_options * options) {
+  struct fs_options worker_options = *options;
+
+  // As in fs_job_start: O_DIRECT needs the read reader's buffers.
+  if ( worker_options.direct )
+    worker_options.reader = FS_READER_READ;
+  numa_discover();
+  while ( 1 ) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    pid_t pid;
+
+    if ( fd == -1 && ( errno == EINTR || errno == ECONNABORTED ) )
+      continue;
+    if ( fd == -1 )
+      return fail("Error accepting coordinator");
+    // Reap the processes of coordinators that have gone.
+    while ( waitpid(-1, NULL, WNOHANG) > 0 )
+      ;
+    // A process per coordinator, as with the children.
+    pid = fork();
+    if ( pid == 0 ) {
+      close(listen_fd);
+      socket_options(fd);
+      _exit(worker_connection(fd, &worker_options) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fd);
+    if ( pid == -1 )
+      return fail("Error forking worker");
+  }
+}
@@ -0,0 +1,368 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#ifndef FILESUMS_H
+#define FILESUMS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/***
+ * libfilesums: Sums the numbers in a file. By default those are three
+ * digit numbers; fs_options' delimiter, width and is_signed describe
+ * other record formats.
+ *
+ * The file is split into blocks, and each block is summed by a forked
+ * child process. The parent collects the children's results over pipes
+ * (watched with epoll) and adds them up.
+ *
+ * Usage:
+ *   struct fs_options options;
+ *   struct fs_result result;
+ *   fs_options_init(&options);
+ *   options.child_count = 4;
+ *   if ( fs_sum_file("file1.dat", &options, &result) == -1 )
+ *     perror(fs_last_error());
+ *   ...result.sum...
+ *   fs_result_free(&result);
+ *
+ * To see each block's result as it arrives, use fs_job_start,
+ * fs_job_next and fs_job_finish instead of fs_sum_file.
+ *
+ * With fs_options.result_cache, results are kept on disk, keyed by the
+ * file's device, inode, size and timestamps, and a job on an unchanged
+ * file replays them without starting any children. After an in-place
+ * edit, only the blocks whose hash changed are parsed again.
+ *
+ * With fs_options.where, only the numbers that pass a filter are summed
+ * (see fs_where.h).
+ *
+ * With fs_options.key_column, records such as "KEY,VALUE" lines are
+ * summed per key: each child fills a hash table of its block's keys
+ * (fs_group.h) and sends it to the parent after its result, and the
+ * parent merges them into result.groups.
+ *
+ * To sum many files without forking for each one, create a pool of
+ * workers once with fs_pool_create and set fs_options.pool.
+ *
+ * For thousands of small files, fs_sum_files sums them all in this
+ * process, with many opens and reads in flight at once.
+ *
+ * To spread the blocks over several hosts, run fs_worker_listen and
+ * fs_worker_serve on each (`sums --worker`) and list them in
+ * fs_options.workers; the job then hands the blocks to the workers
+ * over TCP instead of to children.
+ *
+ * Functions return 0 on success, and -1 with errno set on failure;
+ * fs_last_error then says which step failed.
+ ***/
+
+// How children read the file.
+enum fs_reader {
+  FS_READER_STDIO, // fopen/fgetc.
+  FS_READER_READ, // pread into a large buffer.
+  FS_READER_MMAP // mmap of the file.
+};
+
+// The delimiter of formats where numbers are just runs of digits.
+#define FS_NO_DELIMITER (-1)
+
+// How a child's read buffer or mapping was backed.
+enum fs_page_kind {
+  FS_PAGES_SMALL = 0, // Regular (4 KB) pages.
+  FS_PAGES_THP = 1, // Transparent huge pages were requested with madvise.
+  FS_PAGES_HUGETLB = 2 // Explicit huge pages (MAP_HUGETLB).
+};
+
+// How a file should be summed. Set the defaults with fs_options_init.
+struct fs_options {
+  u_int16_t child_count; // The number of children, with n >= 1.
+  u_int64_t block_size; // Or: bytes per child, 0 to use child_count.
+  // Pick child_count from the hardware instead (see --auto).
+  bool auto_tune;
+  const char * tune_cache; // NULL for "$XDG_CACHE_HOME/file-sums/auto-tune".
+  // Replay results of unchanged files from the result cache, and
+  // store new ones in it (see --cache).
+  bool result_cache;
+  const char * result_cache_dir; // NULL for "$XDG_CACHE_HOME/file-sums/results".
+  bool numa; // Pin children per NUMA node.
+  bool stats; // Fill in the statistics of results.
+  // Count cycles, instructions, branch and LLC misses while summing.
+  bool counters;
+  enum fs_reader reader;
+  bool huge_pages; // Back buffers/mappings with huge pages.
+  bool direct; // Read with O_DIRECT (implies FS_READER_READ).
+  bool drop_cache; // Drop what was read from the page cache.
+  u_int64_t prefetch; // Bytes to prefetch ahead of each child, or 0.
+  // The record format.
+  int delimiter; // Record delimiter, or FS_NO_DELIMITER (the default).
+  int width; // Digits per number (1 to 19, 3 by default).
+  bool is_signed; // A '-' before a record's digits negates it.
+  // Sum only range_length bytes from range_offset (0 for up to the
+  // end), or only record_count records from record number
+  // record_start (0 for all the rest; see --offset and --records).
+  // Records are found with the file's line stride if every line has
+  // the same length, or else with an offset index (kept in the cache
+  // with result_cache).
+  // The range is summed as if it were the whole file, split into
+  // blocks the same way.
+  u_int64_t range_offset;
+  u_int64_t range_length;
+  u_int64_t record_start;
+  u_int64_t record_count;
+  // Only sum the records whose values pass this filter, such as
+  // ">500,%2=0" (see --where and fs_where.h), or NULL for all. The
+  // records count is then of the records that passed.
+  const char * where;
+  // Sum each key separately: records are split into fields at
+  // `separator` (',' for 0), field number key_column (from 1) is a
+  // record's key and field value_column its value (whose first
+  // `width` digits count). 0 for plain records. The result's groups
+  // then hold each key's sum (see --key-column). Groups can't be
+  // summed by a pool, by workers or by fs_sum_files, and aren't kept
+  // in the result cache.
+  int key_column;
+  int value_column;
+  int separator;
+  // Start the children with posix_spawn of spawn_path instead of fork,
+  // so starting them doesn't copy this process's page tables. The
+  // program has to call fs_child_main first thing (see --spawn).
+  bool spawn;
+  const char * spawn_path; // NULL for "/proc/self/exe".
+  // Hand the blocks to this pool's workers instead of starting
+  // children, or NULL (see fs_pool_create).
+  struct fs_pool * pool;
+  // For fs_sum_files: files in flight per thread (0 for 64), and
+  // threads (0 for one per CPU this process may run on).
+  int async_depth;
+  int async_threads;
+  // Write a Chrome trace of the run here (see --trace), or NULL.
+  const char * trace_file;
+  // "HOST:PORT,..." of workers to hand the blocks to, or NULL for
+  // children. The workers read the file by its absolute path, with
+  // their own reader options.
+  const char * workers;
+};
+
+// The result of one block (one child).
+struct fs_partial {
+  u_int16_t child_num;
+  u_int64_t sum; // Two's complement for signed formats.
+  u_int64_t records; // Numbers that were summed.
+  u_int64_t seek_to; // Start of the block in the file.
+  u_int64_t read_to; // Last byte of the block.
+  // With fs_options.result_cache: a hash of the bytes the sum depends
+  // on (0 if it wasn't hashed), and whether the sum came from the cache.
+  u_int64_t hash;
+  bool reused;
+  // Statistics, filled in if fs_options.stats is set.
+  u_int64_t bytes; // Bytes read by the child.
+  u_int64_t nanoseconds; // Time spent reading/summing.
+  u_int64_t first_byte_ns; // From starting the child to its first data.
+  int16_t cpu; // The CPU the child finished on.
+  int16_t node; // The NUMA node of that CPU.
+  int16_t page_kind; // enum fs_page_kind.
+  u_int64_t dtlb_misses; // -1 if the counter wasn't available.
+  // Filled in if fs_options.counters is set; -1 if not available.
+  u_int64_t cycles;
+  u_int64_t instructions;
+  u_int64_t branch_misses;
+  u_int64_t llc_misses; // Last level cache misses.
+};
+
+// A key's sum, with fs_options.key_column.
+struct fs_group {
+  const char * key; // Not NUL terminated.
+  size_t key_length;
+  u_int64_t sum; // Two's complement for signed formats.
+  u_int64_t records;
+};
+
+// The result of summing a file.
+struct fs_result {
+  u_int64_t sum; // Two's complement for signed formats.
+  u_int64_t records;
+  u_int64_t size; // Size of the file or of the range (0 for streams).
+  u_int64_t offset; // Where the range starts (0 for the whole file).
+  u_int64_t block_size;
+  u_int16_t child_count;
+  u_int16_t partial_count; // How many partials have arrived.
+  struct fs_partial * partials; // Indexed by child_num.
+  // What fs_options.auto_tune found out.
+  int cpus; // CPUs the affinity mask allows.
+  double quota; // CPUs the cgroup allows, 0 if unlimited.
+  double cached; // Fraction of the file in the page cache.
+  // Page cache residency around the run, if fs_options.stats is set.
+  double cached_before;
+  double cached_after;
+  // How long each phase of the run took: starting (stat, auto_tune,
+  // forking), collecting the results, and finishing (reaping).
+  u_int64_t start_ns;
+  u_int64_t collect_ns; // Up to the latest result, while collecting.
+  u_int64_t finish_ns;
+  bool from_cache; // Whether the result came from the result cache.
+  // Blocks handed out again because the worker summing them was lost
+  // (fs_options.workers) or died (fs_options.pool).
+  u_int64_t reassigned_blocks;
+  // With fs_options.key_column: each key's sum, in key order (by
+  // memcmp), once the job is finished. The keys point into group_keys.
+  struct fs_group * groups;
+  u_int64_t group_count;
+  char * group_keys;
+};
+
+// A file being summed by children.
+struct fs_job;
+
+// Worker processes kept for many jobs (see fs_pool_create).
+struct fs_pool;
+
+/***
+* fs_options_init: Sets the default options (one child, stdio reader).
+*/
+void fs_options_init (struct fs_options * options);
+
+/***
+* fs_sum_file: Sums a file, splitting it over child processes.
+*   The result must be released with fs_result_free.
+*/
+int fs_sum_file (const char * path, const struct fs_options * options, struct fs_result * result);
+
+/***
+* fs_sum_fd: Sums a stream that can't be split, such as a pipe, in
+*   the calling process. It is read with large read() calls straight
+*   into the parser's buffer. Only the stats, huge_pages, record
+*   format and group options apply.
+*/
+int fs_sum_fd (int fd, const struct fs_options * options, struct fs_result * result);
+
+/***
+* fs_sum_buffer: Sums numbers that are already in memory. Only the
+*   record format and group options apply; `options` may be NULL for
+*   the defaults.
+*/
+int fs_sum_buffer (const void * data, size_t length, const struct fs_options * options, struct fs_result * result);
+
+/***
+* fs_sum_files: Sums many (typically small) files in this process,
+*   without a process per file: threads that each keep
+*   options.async_depth files in flight with io_uring, parsing each
+*   chunk as its read completes (see --async). Without io_uring, the
+*   threads read a file at a time. Only the stats and record format
+*   options apply. results[i] gets the result of paths[i], with one
+*   partial, to be released with fs_result_free, and errors[i] 0 or
+*   the errno it failed with. Returns -1 if any file failed.
+*/
+int fs_sum_files (const char * const * paths, int count, const struct fs_options * options,
+    struct fs_result * results, int * errors);
+
+/***
+* fs_job_start: Starts the children for a file, filling in the size,
+*   block size and child count of `result`. Returns NULL on failure.
+*/
+struct fs_job * fs_job_start (const char * path, const struct fs_options * options, struct fs_result * result);
+
+/***
+* fs_job_next: Waits for the next child's result, copying it into
+*   `partial` (and into the job's result). Returns 1 if a partial
+*   arrived, 0 once every child has been heard from, or -1 if a
+*   child failed.
+*/
+int fs_job_next (struct fs_job * job, struct fs_partial * partial);
+
+/***
+* fs_job_ready: Whether fs_job_next would return a result without
+*   waiting. Useful for flushing output only once the results that
+*   have arrived are written.
+*/
+bool fs_job_ready (struct fs_job * job);
+
+/***
+* fs_job_finish: Collects any remaining results, completes the job's
+*   result and releases the job. After a failure, the remaining
+*   children are stopped instead. Returns -1 if any child failed
+*   (or the trace couldn't be written).
+*/
+int fs_job_finish (struct fs_job * job);
+
+/***
+* fs_worker_listen: Listens for coordinators on "[HOST:]PORT" (port 0
+*   picks a free port; see getsockname), on loopback without a HOST.
+*   Workers trust every coordinator that reaches them: they sum any
+*   file it names. Returns the socket, or -1.
+*/
+int fs_worker_listen (const char * address);
+
+/***
+* fs_worker_serve: Sums the blocks that coordinators (jobs with
+*   fs_options.workers) send to `listen_fd`, in a process per
+*   coordinator. The reader options of `options` apply; the record
+*   format comes with each block. Only returns on failure.
+*/
+int fs_worker_serve (int listen_fd, const struct fs_options * options);
+
+/***
+* fs_pool_create: Forks `workers` processes that sum the blocks of
+*   jobs with fs_options.pool, so those jobs start no processes. A
+*   worker is replaced after `max_tasks` blocks, or once its resident
+*   memory grew by `max_growth` bytes (0 for the defaults, 10000
+*   blocks and 64 MB). One job can use a pool at a time. Returns NULL
+*   on failure.
+*/
+struct fs_pool * fs_pool_create (int workers, u_int64_t max_tasks, u_int64_t max_growth);
+
+/***
+* fs_pool_destroy: Stops the pool's workers (once their current
+*   blocks are done) and frees it.
+*/
+void fs_pool_destroy (struct fs_pool * pool);
+
+/***
+* fs_child_main: Sums a child's block and exits, if this process is a
+*   child started by a job with fs_options.spawn; returns otherwise.
+*   Programs that use fs_options.spawn call it first thing in main,
+*   with main's arguments.
+*/
+void fs_child_main (int argc, char ** argv);
+
+/***
+* fs_result_free: Releases the partials (and groups) of a result.
+*/
+void fs_result_free (struct fs_result * result);
+
+/***
+* fs_last_error: Which step failed, for the last call (on this thread)
+*   that returned an error. Meant to be passed to perror.
+*/
+const char * fs_last_error (void);
+
+/***
+* fs_page_kind_name: A short name for an fs_page_kind ("small", "thp", "hugetlb").
+*/
+const char * fs_page_kind_name (int page_kind);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
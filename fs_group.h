@@ -0,0 +1,306 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#ifndef FS_GROUP_H
+#define FS_GROUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+/***
+ * Groups: a sum per key, for records with fields (see --key-column).
+ *
+ * A record is split into fields at the separator; one field is its
+ * key, and another its value. The grouped kernel (fs_kernel.h) adds
+ * each value to its key's group in a struct fs_groups.
+ *
+ * That is an open addressing hash table (linear probing, a power of
+ * two capacity, at most FS_GROUP_LOAD_PERCENT full) of slots holding a
+ * key's sum and record count. The keys themselves are kept back to
+ * back in one arena, and slots refer to theirs by offset, so growing
+ * the arena or the slots moves no keys and a new key costs no
+ * allocation: millions of keys take two allocations, grown by
+ * doubling. A key being read is appended to the end of the arena as
+ * it arrives (it can span chunks), and only kept there if it turns
+ * out to be new.
+ *
+ * Allocation failures don't stop a scan: the table sets `failed` and
+ * ignores the rest, for the caller to check once the scan is done.
+ *
+ * Usage:
+ *   struct fs_groups groups;
+ *   fs_groups_init(&groups, ',', 0, 1); // "KEY,VALUE" lines.
+ *   ...scan with it, or:
+ *   fs_groups_add(&groups, fs_groups_hash("abc", 3), "abc", 3, 42, 1);
+ *   ...groups.failed, groups.slots[0 to groups.capacity - 1]...
+ *   fs_groups_free(&groups);
+ ***/
+
+// Slots of a new table, and arena bytes.
+#define FS_GROUP_MIN_CAPACITY 1024
+#define FS_GROUP_MIN_ARENA (64 * 1024)
+// How full the slots get before they are doubled.
+#define FS_GROUP_LOAD_PERCENT 70
+// Longer keys are cut to this many bytes.
+#define FS_GROUP_MAX_KEY 4096
+
+// Records the grouped kernel hashes (prefetching their slots) before
+// adding them to their groups.
+#define FS_GROUP_BATCH 16
+// Slot arrays this large ask for transparent huge pages, since every
+// lookup lands on a random page.
+#define FS_GROUP_HUGE_SLOTS ( 2 * 1024 * 1024 )
+
+// A key's group. Empty slots have a hash of 0.
+struct fs_group_slot {
+  u_int64_t key; // Offset of the key in the arena.
+  u_int32_t length; // Of the key.
+  u_int32_t hash;
+  u_int64_t sum; // Two's complement for signed formats.
+  u_int64_t records;
+};
+
+// A record waiting in a batch, with its key still in the chunk.
+struct fs_group_record {
+  const char * key;
+  u_int32_t length;
+  u_int32_t hash;
+  u_int64_t value;
+};
+
+struct fs_groups {
+  // Which fields are the key and the value (from 0), and what
+  // separates the fields.
+  int separator;
+  int key_field;
+  int value_field;
+  // capacity slots (0 before the first key), count of them in use.
+  struct fs_group_slot * slots;
+  u_int64_t capacity;
+  u_int64_t count;
+  // The keys, then `pending` bytes of the key being read.
+  char * arena;
+  u_int64_t arena_used;
+  u_int64_t arena_size;
+  u_int32_t pending;
+  bool failed; // An allocation failed; some records were left out.
+};
+
+/***
+* fs_groups_init: Starts an empty table for records whose fields are
+*   separated by `separator`.
+*/
+static inline void fs_groups_init (struct fs_groups * groups, int separator, int key_field, int value_field) {
+  memset(groups, 0, sizeof(*groups));
+  groups->separator = separator;
+  groups->key_field = key_field;
+  groups->value_field = value_field;
+}
+
+/***
+* fs_groups_free: Frees the slots and the arena (unless taken, with
+*   the arena set to NULL).
+*/
+static inline void fs_groups_free (struct fs_groups * groups) {
+  free(groups->slots);
+  free(groups->arena);
+  groups->slots = NULL;
+  groups->arena = NULL;
+  groups->capacity = 0;
+  groups->count = 0;
+}
+
+/***
+* fs_groups_hash: FNV-1a of a key, never 0 (which marks empty slots).
+*/
+static inline u_int32_t fs_groups_hash (const char * key, u_int32_t length) {
+  u_int32_t hash = 2166136261u;
+  for ( u_int32_t i = 0; i < length; i++ )
+    hash = ( hash ^ (unsigned char)key[i] ) * 16777619u;
+  return hash != 0 ? hash : 1;
+}
+
+/***
+* fs_groups_prefetch: Starts loading the slot a key's search starts at.
+*/
+static inline void fs_groups_prefetch (const struct fs_groups * groups, u_int32_t hash) {
+  if ( groups->capacity > 0 )
+    __builtin_prefetch(&groups->slots[hash & ( groups->capacity - 1 )]);
+}
+
+/***
+* fs_groups_reserve: Makes room in the arena for `more` bytes after
+*   the pending ones. Returns false if it can't.
+*/
+static inline bool fs_groups_reserve (struct fs_groups * groups, u_int64_t more) {
+  u_int64_t needed = groups->arena_used + groups->pending + more;
+  u_int64_t size = groups->arena_size > 0 ? groups->arena_size : FS_GROUP_MIN_ARENA;
+  char * arena;
+
+  if ( needed <= groups->arena_size )
+    return true;
+  while ( size < needed )
+    size *= 2;
+  arena = realloc(groups->arena, size);
+  if ( arena == NULL ) {
+    groups->failed = true;
+    return false;
+  }
+  groups->arena = arena;
+  groups->arena_size = size;
+  return true;
+}
+
+/***
+* fs_groups_append: Adds bytes to the pending key (up to FS_GROUP_MAX_KEY).
+*/
+static inline void fs_groups_append (struct fs_groups * groups, const char * bytes, size_t length) {
+  if ( length > FS_GROUP_MAX_KEY - groups->pending )
+    length = FS_GROUP_MAX_KEY - groups->pending;
+  if ( length == 0 || !fs_groups_reserve(groups, length) )
+    return;
+  memcpy(groups->arena + groups->arena_used + groups->pending, bytes, length);
+  groups->pending += length;
+}
+
+/***
+* fs_groups_resize: Moves the groups to `capacity` slots (a power of
+*   two), placing each again by its stored hash. Returns false if it can't.
+*/
+static inline bool fs_groups_resize (struct fs_groups * groups, u_int64_t capacity) {
+  size_t bytes = capacity * sizeof(struct fs_group_slot);
+  struct fs_group_slot * slots;
+
+  if ( bytes >= FS_GROUP_HUGE_SLOTS ) {
+    slots = aligned_alloc(FS_GROUP_HUGE_SLOTS, bytes);
+    if ( slots != NULL ) {
+      madvise(slots, bytes, MADV_HUGEPAGE);
+      memset(slots, 0, bytes);
+    }
+  } else {
+    slots = calloc(capacity, sizeof(struct fs_group_slot));
+  }
+  if ( slots == NULL ) {
+    groups->failed = true;
+    return false;
+  }
+  for ( u_int64_t i = 0; i < groups->capacity; i++ ) {
+    u_int64_t at;
+    if ( groups->slots[i].hash == 0 )
+      continue;
+    at = groups->slots[i].hash & ( capacity - 1 );
+    while ( slots[at].hash != 0 )
+      at = ( at + 1 ) & ( capacity - 1 );
+    slots[at] = groups->slots[i];
+  }
+  free(groups->slots);
+  groups->slots = slots;
+  groups->capacity = capacity;
+  return true;
+}
+
+/***
+* fs_groups_grow: Doubles the slots. Returns false if it can't.
+*/
+static inline bool fs_groups_grow (struct fs_groups * groups) {
+  return fs_groups_resize(groups, groups->capacity > 0 ? groups->capacity * 2 : FS_GROUP_MIN_CAPACITY);
+}
+
+/***
+* fs_groups_expect: Makes room for up to `more` new keys at once, for
+*   merging a table of that many.
+*/
+static inline void fs_groups_expect (struct fs_groups * groups, u_int64_t more) {
+  u_int64_t capacity = groups->capacity > 0 ? groups->capacity : FS_GROUP_MIN_CAPACITY;
+
+  while ( ( groups->count + more ) * 100 > capacity * FS_GROUP_LOAD_PERCENT )
+    capacity *= 2;
+  if ( capacity != groups->capacity )
+    fs_groups_resize(groups, capacity);
+}
+
+/***
+* fs_groups_add: Adds `sum` and `records` to the group of a key,
+*   starting the group (with a copy of the key in the arena) if it is
+*   new. The key may be the pending one, which is then kept or dropped;
+*   other keys take the place of the pending one, which is dropped.
+*/
+static inline void fs_groups_add (struct fs_groups * groups, u_int32_t hash, const char * key, u_int32_t length,
+    u_int64_t sum, u_int64_t records) {
+  bool pending = groups->arena != NULL && key == groups->arena + groups->arena_used;
+  struct fs_group_slot * slot;
+  u_int64_t mask;
+  u_int64_t at;
+
+  if ( groups->failed )
+    return;
+  if ( ( groups->count + 1 ) * 100 > groups->capacity * FS_GROUP_LOAD_PERCENT && !fs_groups_grow(groups) )
+    return;
+  mask = groups->capacity - 1;
+  for ( at = hash & mask; groups->slots[at].hash != 0; at = ( at + 1 ) & mask ) {
+    slot = &groups->slots[at];
+    if ( slot->hash == hash && slot->length == length && memcmp(groups->arena + slot->key, key, length) == 0 ) {
+      slot->sum += sum;
+      slot->records += records;
+      if ( pending )
+        groups->pending = 0;
+      return;
+    }
+  }
+
+  // A new key: keep the pending one where it is, or copy it in.
+  if ( !pending ) {
+    groups->pending = 0;
+    if ( !fs_groups_reserve(groups, length) )
+      return;
+    memcpy(groups->arena + groups->arena_used, key, length);
+  }
+  slot = &groups->slots[at];
+  slot->key = groups->arena_used;
+  slot->length = length;
+  slot->hash = hash;
+  slot->sum = sum;
+  slot->records = records;
+  groups->arena_used += length;
+  groups->pending = 0;
+  groups->count += 1;
+}
+
+/***
+* fs_groups_add_pending: Adds a value to the group of the pending key,
+*   without the '\r' of "\r\n" line ends.
+*/
+static inline void fs_groups_add_pending (struct fs_groups * groups, u_int64_t value) {
+  const char * key;
+  u_int32_t length = groups->pending;
+
+  // An empty key may not have an arena yet.
+  if ( groups->arena == NULL && !fs_groups_reserve(groups, 1) )
+    return;
+  key = groups->arena + groups->arena_used;
+  if ( length > 0 && key[length - 1] == '\r' )
+    length -= 1;
+  groups->pending = length;
+  fs_groups_add(groups, fs_groups_hash(key, length), key, length, value, 1);
+}
+
+#endif
@@ -0,0 +1,574 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#ifndef FS_KERNEL_H
+#define FS_KERNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "fs_group.h"
+#include "fs_where.h"
+
+/***
+ * Scan kernels: the loops that turn bytes into sums.
+ *
+ * A kernel is generated by FS_DEFINE_KERNEL for one record format, with
+ * the delimiter, width, signedness, accumulator type and bounds check
+ * fixed at compile time, so the compiler can specialise the loop for
+ * that format. FS_KERNEL_FORMATS lists the formats that get their own
+ * kernels; fs_kernel_for picks one at runtime, falling back to a
+ * kernel that reads the format from the scan state.
+ *
+ * To add a feed format, add a line to FS_KERNEL_FORMATS.
+ *
+ * The listed formats also get a SWAR fast path: once a few records in
+ * a row have the same length, fs_swar_run takes the records that follow
+ * 8 bytes at a time, while they keep that layout. It is plain C on
+ * u64s, so it works on any target, with or without SIMD.
+ * `fs_scan_<format>_scalar` is the same kernel without it, for comparisons.
+ *
+ * `fs_scan_<format>_where` only sums the records that pass the scan's
+ * filter (fs_where.h). It masks each value with the filter's answer
+ * instead of branching on it. Its SWAR runs still check the layout
+ * 8 bytes at a time, but then read each record's digits from their
+ * known places, to filter it on its own.
+ *
+ * `fs_scan_grouped` is for records with fields (fs_group.h): it adds
+ * each record's value to its key's group in the scan's table, as well
+ * as to the sum. It is a plain byte loop; the hashing and the table
+ * cost more than the parsing there.
+ *
+ * Record formats:
+ *  * Without a delimiter (FS_NO_DELIMITER), every WIDTH digits make a
+ *    number and everything else is ignored. This is the original
+ *    "three digit numbers" format.
+ *  * With a delimiter, each record runs up to the delimiter, and its
+ *    value is its first WIDTH digits. Signed formats negate records
+ *    with a '-' before the first digit.
+ ***/
+
+// The delimiter of formats where numbers are just runs of digits
+// (also defined by filesums.h).
+#ifndef FS_NO_DELIMITER
+#define FS_NO_DELIMITER (-1)
+#endif
+// More digits than this would overflow a 64 bit value.
+#define FS_MAX_WIDTH 19
+
+// A scan in progress. The partly read record is carried over
+// from one chunk to the next.
+struct fs_scan {
+  // The record format (only read by the generic kernel).
+  int delimiter;
+  int width;
+  bool is_signed;
+  // Which records count, for the filtered kernels (and fs_scan_finish).
+  const struct fs_where * where;
+  // For the grouped kernels: the table, and the field being read.
+  struct fs_groups * groups;
+  int field;
+  // The record being read.
+  u_int64_t value;
+  int digits;
+  bool negative;
+  // Set by bounded kernels once the end of the block is reached.
+  bool done;
+  // The sum (two's complement for signed formats) and record count.
+  u_int64_t sum;
+  u_int64_t records;
+};
+
+/***
+* A kernel: scans `length` bytes of `data`, adding each record to the
+*   scan's sum, and returns how many bytes were used.
+*   Bounded kernels stop after the first record boundary at or past
+*   `limit` (setting `done`); unbounded kernels ignore `limit`.
+*/
+typedef size_t (* fs_kernel_fn) (struct fs_scan * scan, const char * data, size_t length, size_t limit);
+
+// SWAR constants: a byte repeated over a u64, and the top bit of every byte.
+#define FS_SWAR_ONES 0x0101010101010101ULL
+#define FS_SWAR_HIGHS 0x8080808080808080ULL
+// The even bytes of a u64, as 16 bit lanes.
+#define FS_SWAR_LANES 0x00ff00ff00ff00ffULL
+// The longest record (digits and terminator) a SWAR run takes.
+#define FS_SWAR_MAX_STRIDE 24
+// Records of one length in a row before a SWAR run is tried.
+#define FS_SWAR_REPEATS 4
+// Periods between flushes of the lanes, so they can't overflow
+// (each gets at most 9 per period).
+#define FS_SWAR_FLUSH 4096
+
+/***
+* fs_swar_load: Loads 8 bytes, the first byte in the lowest bits.
+*/
+static inline u_int64_t fs_swar_load (const char * data) {
+  u_int64_t word;
+  memcpy(&word, data, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+/***
+* fs_swar_run: Sums a run of fixed length records, such as "123\r\n",
+*   8 bytes at a time. The first record (at `data`) sets the layout:
+*   `stride` bytes, of which the first min_count to max_count are digits,
+*   and the rest are the same non-digits every time, ending with the
+*   only `boundary`.
+*
+*   The run is taken in periods of lcm(8, stride) bytes, so every word
+*   of a period lines up with the records the same way each time: each
+*   word is checked against its layout, and its digits are added up in
+*   16 bit lanes. Flushing the lanes weights them by their decimal place.
+*   The run stops at the first period that doesn't match, or that doesn't
+*   fit in `length`.
+*
+*   With `where`, the lanes aren't used: each record of a period that
+*   matched is read from its digits' places and added if it passes.
+*
+*   Returns the bytes taken (0 if the first record doesn't fit the
+*   layout) and adds to `sum` and `records`.
+*/
+static inline size_t fs_swar_run (const char * data, size_t length, int stride, int boundary,
+    int min_count, int max_count, u_int64_t * sum, u_int64_t * records, const struct fs_where * where) {
+  // Per word of the period: the terminator bytes expected, which bytes
+  // are digits (0xff), and the running lanes of even and odd bytes.
+  u_int64_t expect[FS_SWAR_MAX_STRIDE];
+  u_int64_t digit_bytes[FS_SWAR_MAX_STRIDE];
+  u_int64_t even[FS_SWAR_MAX_STRIDE];
+  u_int64_t odd[FS_SWAR_MAX_STRIDE];
+  u_int64_t place[FS_MAX_WIDTH];
+  int words;
+  int common = stride;
+  int count = 0;
+  size_t period;
+  size_t taken = 0;
+  size_t pending = 0;
+
+  if ( stride < 2 || stride > FS_SWAR_MAX_STRIDE )
+    return 0;
+  // lcm(8, stride) / 8 words per period.
+  for ( int b = 8; b != 0; ) {
+    int r = common % b;
+    common = b;
+    b = r;
+  }
+  words = stride / common;
+  period = (size_t)words * 8;
+  if ( length < period )
+    return 0;
+  // The layout, from the first record.
+  while ( count < stride && (unsigned char)( data[count] - '0' ) < 10 )
+    count += 1;
+  if ( count < min_count || count > max_count || data[stride - 1] != boundary )
+    return 0;
+  for ( int i = count; i < stride - 1; i++ ) {
+    if ( data[i] == boundary || (unsigned char)( data[i] - '0' ) < 10 )
+      return 0;
+  }
+  for ( int w = 0; w < words; w++ ) {
+    expect[w] = 0;
+    digit_bytes[w] = 0;
+    even[w] = 0;
+    odd[w] = 0;
+    for ( int j = 0; j < 8; j++ ) {
+      int at = ( w * 8 + j ) % stride;
+      if ( at < count )
+        digit_bytes[w] |= 0xffULL << ( 8 * j );
+      else
+        expect[w] |= (u_int64_t)(unsigned char)data[at] << ( 8 * j );
+    }
+  }
+  place[count - 1] = 1;
+  for ( int i = count - 2; i >= 0; i-- )
+    place[i] = place[i + 1] * 10;
+
+  while ( 1 ) {
+    bool more = length - taken >= period && pending < FS_SWAR_FLUSH;
+    if ( more ) {
+      // Check the whole period before adding any of it.
+      u_int64_t bad = 0;
+      for ( int w = 0; w < words; w++ ) {
+        u_int64_t word = fs_swar_load(data + taken + w * 8);
+        // '0' to '9' become 0 to 9, which stay below 0x80 after adding 0x76.
+        u_int64_t t = word ^ ( FS_SWAR_ONES * '0' );
+        bad |= ( ( t + FS_SWAR_ONES * 0x76 ) | t ) & FS_SWAR_HIGHS & digit_bytes[w];
+        bad |= ( word ^ expect[w] ) & ~digit_bytes[w];
+      }
+      if ( bad == 0 && where != NULL ) {
+        // (In locals: `sum` and `records` could alias the data.)
+        u_int64_t kept_sum = 0;
+        u_int64_t kept = 0;
+        for ( const char * record = data + taken; record < data + taken + period; record += stride ) {
+          u_int64_t value = 0;
+          for ( int i = 0; i < count; i++ )
+            value = value * 10 + ( record[i] - '0' );
+          u_int64_t keep = fs_where_select(where, value);
+          kept_sum += value & ( 0 - keep );
+          kept += keep;
+        }
+        *sum += kept_sum;
+        *records += kept;
+        taken += period;
+        continue;
+      }
+      if ( bad == 0 ) {
+        for ( int w = 0; w < words; w++ ) {
+          u_int64_t t = ( fs_swar_load(data + taken + w * 8) ^ ( FS_SWAR_ONES * '0' ) ) & digit_bytes[w];
+          even[w] += t & FS_SWAR_LANES;
+          odd[w] += ( t >> 8 ) & FS_SWAR_LANES;
+        }
+        taken += period;
+        pending += 1;
+        continue;
+      }
+    }
+    // Flush the lanes: each byte's digits, times its decimal place.
+    for ( int w = 0; w < words; w++ ) {
+      for ( int j = 0; j < 8; j++ ) {
+        int at = ( w * 8 + j ) % stride;
+        u_int64_t lanes = j % 2 ? odd[w] : even[w];
+        if ( at < count )
+          *sum += ( ( lanes >> ( 16 * ( j / 2 ) ) ) & 0xffff ) * place[at];
+      }
+      even[w] = 0;
+      odd[w] = 0;
+    }
+    *records += pending * ( period / stride );
+    if ( pending < FS_SWAR_FLUSH )
+      return taken;
+    pending = 0;
+  }
+}
+
+/***
+* FS_DEFINE_KERNEL: Defines a kernel called NAME.
+*
+* `DELIM`: The record delimiter, or FS_NO_DELIMITER.
+* `WIDTH`: The digits per number (at most FS_MAX_WIDTH).
+* `SIGNED`: Whether a leading '-' negates a record.
+* `BOUNDED`: Whether the kernel stops at `limit`.
+* `SWAR`: Whether to take runs of fixed length records with fs_swar_run.
+* `FILTER`: Whether to only sum records that pass the scan's filter.
+*
+* Record boundaries are the delimiter, or newlines without one. The sum
+* is accumulated in a u_int64_t, so negative records wrap as the two's
+* complement fs_partial.sum is (signed overflow would be undefined).
+*/
+#define FS_DEFINE_KERNEL(NAME, DELIM, WIDTH, SIGNED, BOUNDED, SWAR, FILTER) \
+static inline size_t NAME (struct fs_scan * scan, const char * data, size_t length, size_t limit) { \
+  const int boundary = (DELIM) == FS_NO_DELIMITER ? '\n' : (DELIM); \
+  u_int64_t sum = 0; \
+  u_int64_t records = 0; \
+  u_int64_t value = scan->value; \
+  int digits = scan->digits; \
+  bool negative = scan->negative; \
+  const struct fs_where * where = scan->where; \
+  size_t i = 0; \
+  /* Where the current record started, the last one's length, and how */ \
+  /* many before it had the same length. */ \
+  size_t record_start = 0; \
+  size_t stride = 0; \
+  int repeats = 0; \
+  (void)limit; \
+  (void)where; \
+  while ( i < length ) { \
+    unsigned char c = data[i]; \
+    unsigned int digit = c - '0'; \
+    i += 1; \
+    if ( digit < 10 ) { \
+      if ( digits < (WIDTH) ) { \
+        value = value * 10 + digit; \
+        digits += 1; \
+      } \
+      /* Without a delimiter, a number ends after WIDTH digits. */ \
+      if ( (DELIM) == FS_NO_DELIMITER && digits == (WIDTH) ) { \
+        /* Filtered out values are added as 0, not skipped. */ \
+        u_int64_t keep = (FILTER) ? fs_where_select(where, value) : 1; \
+        sum += value & ( 0 - keep ); \
+        records += keep; \
+        value = 0; \
+        digits = 0; \
+      } \
+    } else if ( c == boundary ) { \
+      if ( (DELIM) != FS_NO_DELIMITER && digits > 0 ) { \
+        u_int64_t record = negative ? 0 - value : value; \
+        u_int64_t keep = (FILTER) ? fs_where_select(where, record) : 1; \
+        sum += record & ( 0 - keep ); \
+        records += keep; \
+        value = 0; \
+        digits = 0; \
+      } \
+      negative = false; \
+      if ( (BOUNDED) && i > limit ) { \
+        scan->done = true; \
+        break; \
+      } \
+      if ( (SWAR) ) { \
+        repeats = i - record_start == stride ? repeats + 1 : 0; \
+        stride = i - record_start; \
+        record_start = i; \
+        /* Records of one length in a row: try taking those that */ \
+        /* follow 8 bytes at a time (only whole ones, before `limit`). */ \
+        if ( repeats >= FS_SWAR_REPEATS && digits == 0 ) { \
+          size_t end = (BOUNDED) && limit < length ? limit : length; \
+          u_int64_t run_sum = 0; \
+          if ( end > i ) { \
+            i += fs_swar_run(data + i, end - i, (int)stride, boundary, \
+                (DELIM) == FS_NO_DELIMITER ? (WIDTH) : 1, (WIDTH), &run_sum, &records, \
+                (FILTER) ? where : NULL); \
+            sum += run_sum; \
+            record_start = i; \
+          } \
+          repeats = 0; \
+        } \
+      } \
+    } else if ( (SIGNED) && c == '-' && digits == 0 ) { \
+      negative = true; \
+    } \
+  } \
+  scan->value = value; \
+  scan->digits = digits; \
+  scan->negative = negative; \
+  scan->sum += sum; \
+  scan->records += records; \
+  return i; \
+}
+
+/***
+* FS_KERNEL_FORMATS: The formats with their own kernels, as
+*   X(NAME, DELIM, WIDTH, SIGNED).
+*/
+#define FS_KERNEL_FORMATS(X) \
+  X(digits3, FS_NO_DELIMITER, 3, false) \
+  X(lines3, '\n', 3, false) \
+  X(lines6, '\n', 6, false) \
+  X(lines10, '\n', 10, false) \
+  X(lines19, '\n', 19, false) \
+  X(signed_lines3, '\n', 3, true) \
+  X(signed_lines10, '\n', 10, true) \
+  X(signed_lines19, '\n', 19, true) \
+  X(commas10, ',', 10, false) \
+  X(signed_commas19, ',', 19, true)
+
+// Bounded and unbounded kernels for each listed format (with the SWAR
+// fast path), an unbounded one without it, and filtered ones.
+#define FS_KERNEL_DEFINE_PAIR(NAME, DELIM, WIDTH, SIGNED) \
+  FS_DEFINE_KERNEL(fs_scan_##NAME##_bounded, DELIM, WIDTH, SIGNED, true, true, false) \
+  FS_DEFINE_KERNEL(fs_scan_##NAME, DELIM, WIDTH, SIGNED, false, true, false) \
+  FS_DEFINE_KERNEL(fs_scan_##NAME##_scalar, DELIM, WIDTH, SIGNED, false, false, false) \
+  FS_DEFINE_KERNEL(fs_scan_##NAME##_where_bounded, DELIM, WIDTH, SIGNED, true, true, true) \
+  FS_DEFINE_KERNEL(fs_scan_##NAME##_where, DELIM, WIDTH, SIGNED, false, true, true)
+FS_KERNEL_FORMATS(FS_KERNEL_DEFINE_PAIR)
+
+// The fallback, for formats that aren't listed.
+FS_DEFINE_KERNEL(fs_scan_generic_bounded, scan->delimiter, scan->width, scan->is_signed, true, false, false)
+FS_DEFINE_KERNEL(fs_scan_generic, scan->delimiter, scan->width, scan->is_signed, false, false, false)
+FS_DEFINE_KERNEL(fs_scan_generic_where_bounded, scan->delimiter, scan->width, scan->is_signed, true, false, true)
+FS_DEFINE_KERNEL(fs_scan_generic_where, scan->delimiter, scan->width, scan->is_signed, false, false, true)
+
+/***
+* fs_scan_group_end: Ends the grouped record that was just read, adding
+*   its value to the sum if it has one that passes the filter (into
+*   `value`; returns false if not), and starts the next one.
+*/
+static inline bool fs_scan_group_end (struct fs_scan * scan, u_int64_t * value) {
+  bool counts = scan->digits > 0;
+
+  *value = scan->negative ? 0 - scan->value : scan->value;
+  if ( counts && scan->where != NULL )
+    counts = fs_where_select(scan->where, *value);
+  if ( counts ) {
+    scan->sum += *value;
+    scan->records += 1;
+  }
+  scan->value = 0;
+  scan->digits = 0;
+  scan->negative = false;
+  scan->field = 0;
+  return counts;
+}
+
+/***
+* fs_scan_group_record: Ends a grouped record whose key is the pending
+*   one, adding it to its group.
+*/
+static inline void fs_scan_group_record (struct fs_scan * scan) {
+  u_int64_t value;
+
+  if ( fs_scan_group_end(scan, &value) )
+    fs_groups_add_pending(scan->groups, value);
+  scan->groups->pending = 0;
+}
+
+/***
+* fs_scan_group_flush: Adds the batched records to their groups.
+*/
+static inline void fs_scan_group_flush (struct fs_groups * groups, struct fs_group_record * batch, int * batched) {
+  for ( int i = 0; i < *batched; i++ )
+    fs_groups_add(groups, batch[i].hash, batch[i].key, batch[i].length, batch[i].value, 1);
+  *batched = 0;
+}
+
+/***
+* fs_scan_groups: The grouped kernels' loop. Records end at the
+*   delimiter (or newlines without one), and the value is the first
+*   `width` digits of the value field.
+*
+*   Looking a key up is a cache miss (or two) in a large table, so
+*   records whose key is in the chunk are hashed and batched, their
+*   slots prefetched, and only added FS_GROUP_BATCH at a time; the
+*   misses then overlap. Their keys aren't copied unless they are new.
+*   A key that spans chunks is collected as the table's pending key
+*   instead (with the batch added first, since new keys take its place).
+*/
+static inline size_t fs_scan_groups (struct fs_scan * scan, const char * data, size_t length, size_t limit,
+    bool bounded) {
+  struct fs_groups * groups = scan->groups;
+  const int boundary = scan->delimiter == FS_NO_DELIMITER ? '\n' : scan->delimiter;
+  const int separator = groups->separator;
+  struct fs_group_record batch[FS_GROUP_BATCH];
+  int batched = 0;
+  // The record's key, if it is whole in this chunk (or else the pending key).
+  const char * key = NULL;
+  u_int32_t key_length = 0;
+  size_t i = 0;
+
+  while ( i < length ) {
+    unsigned char c = data[i];
+    i += 1;
+    if ( c == boundary ) {
+      u_int64_t value;
+      if ( key == NULL ) {
+        fs_scan_group_record(scan);
+      } else if ( fs_scan_group_end(scan, &value) ) {
+        u_int32_t hash;
+        // Without the '\r' of "\r\n" line ends.
+        key_length -= key_length > 0 && key[key_length - 1] == '\r';
+        hash = fs_groups_hash(key, key_length);
+        fs_groups_prefetch(groups, hash);
+        batch[batched++] = (struct fs_group_record){ key, key_length, hash, value };
+        if ( batched == FS_GROUP_BATCH )
+          fs_scan_group_flush(groups, batch, &batched);
+      }
+      key = NULL;
+      if ( bounded && i > limit ) {
+        scan->done = true;
+        break;
+      }
+    } else if ( c == separator ) {
+      scan->field += 1;
+    } else if ( scan->field == groups->key_field ) {
+      // The rest of the key in this chunk, in one go.
+      size_t start = i - 1;
+      size_t end = i;
+      while ( end < length && data[end] != separator && data[end] != boundary )
+        end += 1;
+      if ( groups->pending > 0 || end == length ) {
+        fs_scan_group_flush(groups, batch, &batched);
+        fs_groups_append(groups, data + start, end - start);
+      } else {
+        key = data + start;
+        key_length = end - start < FS_GROUP_MAX_KEY ? end - start : FS_GROUP_MAX_KEY;
+      }
+      i = end;
+    } else if ( scan->field == groups->value_field ) {
+      unsigned int digit = c - '0';
+      if ( digit < 10 ) {
+        if ( scan->digits < scan->width ) {
+          scan->value = scan->value * 10 + digit;
+          scan->digits += 1;
+        }
+      } else if ( scan->is_signed && c == '-' && scan->digits == 0 ) {
+        scan->negative = true;
+      }
+    }
+  }
+  fs_scan_group_flush(groups, batch, &batched);
+  // The record goes on in the next chunk: keep its key.
+  if ( key != NULL )
+    fs_groups_append(groups, key, key_length);
+  return i;
+}
+
+static inline size_t fs_scan_grouped_bounded (struct fs_scan * scan, const char * data, size_t length, size_t limit) {
+  return fs_scan_groups(scan, data, length, limit, true);
+}
+
+static inline size_t fs_scan_grouped (struct fs_scan * scan, const char * data, size_t length, size_t limit) {
+  return fs_scan_groups(scan, data, length, limit, false);
+}
+
+// A format's bounded and unbounded kernels.
+struct fs_kernel {
+  const char * name;
+  fs_kernel_fn bounded;
+  fs_kernel_fn unbounded;
+};
+
+/***
+* fs_kernel_for: Picks the kernels for a record format, the filtered
+*   ones if `filtered`.
+*/
+static inline struct fs_kernel fs_kernel_for (int delimiter, int width, bool is_signed, bool filtered) {
+#define FS_KERNEL_MATCH(NAME, DELIM, WIDTH, SIGNED) \
+  if ( delimiter == (DELIM) && width == (WIDTH) && is_signed == (SIGNED) ) \
+    return filtered ? (struct fs_kernel){ #NAME "_where", fs_scan_##NAME##_where_bounded, fs_scan_##NAME##_where } \
+      : (struct fs_kernel){ #NAME, fs_scan_##NAME##_bounded, fs_scan_##NAME };
+  FS_KERNEL_FORMATS(FS_KERNEL_MATCH)
+#undef FS_KERNEL_MATCH
+  if ( filtered )
+    return (struct fs_kernel){ "generic_where", fs_scan_generic_where_bounded, fs_scan_generic_where };
+  return (struct fs_kernel){ "generic", fs_scan_generic_bounded, fs_scan_generic };
+}
+
+/***
+* fs_scan_init: Starts a scan of the given record format.
+*/
+static inline void fs_scan_init (struct fs_scan * scan, int delimiter, int width, bool is_signed) {
+  *scan = (struct fs_scan){ .delimiter = delimiter, .width = width, .is_signed = is_signed };
+}
+
+/***
+* fs_scan_finish: Adds the last record, at the end of the data (if it
+*   passes the filter). Records without a delimiter only count once
+*   complete, except grouped ones, which are lines.
+*/
+static inline void fs_scan_finish (struct fs_scan * scan) {
+  if ( scan->groups != NULL ) {
+    fs_scan_group_record(scan);
+    return;
+  }
+  if ( scan->delimiter != FS_NO_DELIMITER && scan->digits > 0 ) {
+    u_int64_t record = scan->negative ? 0 - scan->value : scan->value;
+    if ( scan->where == NULL || fs_where_select(scan->where, record) ) {
+      scan->sum += record;
+      scan->records += 1;
+    }
+  }
+  scan->value = 0;
+  scan->digits = 0;
+  scan->negative = false;
+}
+
+#endif
@@ -0,0 +1,178 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#ifndef FS_QUEUE_H
+#define FS_QUEUE_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/***
+ * A bounded queue of fixed size items for any number of producers and
+ * consumers, without locks (Dmitry Vyukov's bounded MPMC queue).
+ *
+ * Every cell has a sequence number that says whose turn it is. The
+ * cell for position `pos` is free for the producer of `pos` while its
+ * sequence is `pos`, and holds that producer's item for the consumer
+ * of `pos` once it is `pos + 1`; the consumer then sets it to
+ * `pos + capacity`, freeing it for the next lap. Producers and
+ * consumers claim a position with a CAS on their own counter and then
+ * only touch their cell, so they meet on one cache line each instead
+ * of on a lock. The two counters and the cells are cache line aligned,
+ * so neighbouring cells don't false share.
+ *
+ * The queue lives in memory the caller provides (fs_queue_bytes of it,
+ * cache line aligned) and holds no pointers, so it works the same
+ * between threads and between forked processes in a MAP_SHARED mapping.
+ *
+ * It is not robust: a process that dies between claiming a position
+ * and setting its cell's sequence leaves the cell stuck, and the item
+ * in it lost. Users that have to survive that (like the worker pool)
+ * notice the death and start over with a fresh queue.
+ *
+ * Usage:
+ *   struct fs_queue * queue = aligned_alloc(FS_CACHE_LINE, fs_queue_bytes(256, sizeof(item)));
+ *   fs_queue_init(queue, 256, sizeof(item));
+ *   if ( !fs_queue_push(queue, &item) ) ...full...
+ *   if ( !fs_queue_pop(queue, &item) ) ...empty...
+ ***/
+
+#define FS_CACHE_LINE 64
+
+// Processes sharing a queue can only rely on lock free atomics.
+_Static_assert(ATOMIC_LONG_LOCK_FREE == 2, "fs_queue needs lock free atomic longs");
+
+struct fs_queue {
+  // Set by fs_queue_init, then only read.
+  size_t mask; // The capacity (a power of two) minus one.
+  size_t item_size;
+  size_t cell_size; // The sequence and an item, in whole cache lines.
+  alignas(FS_CACHE_LINE) atomic_size_t enqueue_pos;
+  alignas(FS_CACHE_LINE) atomic_size_t dequeue_pos;
+  // capacity cells of cell_size bytes: the sequence, then the item.
+  alignas(FS_CACHE_LINE) unsigned char cells[];
+};
+
+// Where a cell's item starts.
+#define FS_QUEUE_ITEM_OFFSET sizeof(atomic_size_t)
+
+/***
+* fs_queue_cell_size: The bytes per cell for items of `item_size`.
+*/
+static inline size_t fs_queue_cell_size (size_t item_size) {
+  return (FS_QUEUE_ITEM_OFFSET + item_size + FS_CACHE_LINE - 1) / FS_CACHE_LINE * FS_CACHE_LINE;
+}
+
+/***
+* fs_queue_bytes: The memory a queue of `capacity` (a power of two)
+*   items of `item_size` takes.
+*/
+static inline size_t fs_queue_bytes (size_t capacity, size_t item_size) {
+  return sizeof(struct fs_queue) + capacity * fs_queue_cell_size(item_size);
+}
+
+static inline atomic_size_t * fs_queue_sequence (struct fs_queue * queue, size_t pos) {
+  return (atomic_size_t *)(queue->cells + (pos & queue->mask) * queue->cell_size);
+}
+
+/***
+* fs_queue_init: Makes `queue` an empty queue of `capacity` (a power
+*   of two) items of `item_size`. Nothing may be using it meanwhile.
+*/
+static inline void fs_queue_init (struct fs_queue * queue, size_t capacity, size_t item_size) {
+  queue->mask = capacity - 1;
+  queue->item_size = item_size;
+  queue->cell_size = fs_queue_cell_size(item_size);
+  for ( size_t pos = 0; pos < capacity; pos++ )
+    atomic_init(fs_queue_sequence(queue, pos), pos);
+  atomic_init(&queue->enqueue_pos, 0);
+  atomic_init(&queue->dequeue_pos, 0);
+  atomic_thread_fence(memory_order_release);
+}
+
+/***
+* fs_queue_push: Copies `item` to the back of the queue. Returns false
+*   if the queue is full.
+*/
+static inline bool fs_queue_push (struct fs_queue * queue, const void * item) {
+  size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+  atomic_size_t * sequence;
+
+  for ( ;; ) {
+    sequence = fs_queue_sequence(queue, pos);
+    intptr_t difference = (intptr_t)atomic_load_explicit(sequence, memory_order_acquire) - (intptr_t)pos;
+    if ( difference == 0 ) {
+      // Free for this lap: claim it (or retry with the newer position).
+      if ( atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                 memory_order_relaxed, memory_order_relaxed) )
+        break;
+    } else if ( difference < 0 ) {
+      // Still holds the item of the previous lap.
+      return false;
+    } else {
+      // Another producer took it.
+      pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    }
+  }
+  memcpy((unsigned char *)sequence + FS_QUEUE_ITEM_OFFSET, item, queue->item_size);
+  atomic_store_explicit(sequence, pos + 1, memory_order_release);
+  return true;
+}
+
+/***
+* fs_queue_pop: Moves the item at the front of the queue to `item`.
+*   Returns false if the queue is empty.
+*/
+static inline bool fs_queue_pop (struct fs_queue * queue, void * item) {
+  size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+  atomic_size_t * sequence;
+
+  for ( ;; ) {
+    sequence = fs_queue_sequence(queue, pos);
+    intptr_t difference = (intptr_t)atomic_load_explicit(sequence, memory_order_acquire) - (intptr_t)(pos + 1);
+    if ( difference == 0 ) {
+      if ( atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                 memory_order_relaxed, memory_order_relaxed) )
+        break;
+    } else if ( difference < 0 ) {
+      // Not filled in yet.
+      return false;
+    } else {
+      pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    }
+  }
+  memcpy(item, (unsigned char *)sequence + FS_QUEUE_ITEM_OFFSET, queue->item_size);
+  atomic_store_explicit(sequence, pos + queue->mask + 1, memory_order_release);
+  return true;
+}
+
+/***
+* fs_queue_count: How many items are queued. Only a snapshot while
+*   others push or pop.
+*/
+static inline size_t fs_queue_count (struct fs_queue * queue) {
+  size_t dequeued = atomic_load_explicit(&queue->dequeue_pos, memory_order_acquire);
+  size_t enqueued = atomic_load_explicit(&queue->enqueue_pos, memory_order_acquire);
+  return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+#endif
@@ -0,0 +1,279 @@
+/***
+The APACHE License (APACHE)
+
+Copyright (c) 2023 Reynaldo Bontje. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+***/
+
+#ifndef FS_WHERE_H
+#define FS_WHERE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/***
+ * Filters: which records' values a scan sums (see --where).
+ *
+ * A filter is a list of clauses separated by ',', all of which a value
+ * has to pass:
+ *   >N  >=N  <N  <=N   compared with N,
+ *   A..B               from A to B (both included),
+ *   =A|B|...           one of the values (up to FS_WHERE_MAX_SET),
+ *   !=A|B|...          none of them,
+ *   %M=R               R is the remainder of dividing by M (0 to M-1,
+ *                      also for negative values; M below 2^63).
+ * e.g. ">500,%2=0" or "=7|11|13". Negative numbers are only allowed in
+ * signed formats.
+ *
+ * fs_where_compile turns the text into a struct fs_where once, and the
+ * kernels call fs_where_select for every record. That never branches on
+ * the value: the comparisons become a range check on the value (as a
+ * key that orders signed values as unsigned ones), the sets are
+ * compared against in full, and the kernel adds the value masked by
+ * the answer. Unselected values cost the same as selected ones, and
+ * no more mispredictions. For formats of up to FS_WHERE_TABLE_WIDTH
+ * digits, the answer for every possible value is worked out up front
+ * into a bit table, so each record is one load.
+ *
+ * Usage:
+ *   struct fs_where where;
+ *   if ( !fs_where_compile(">500,%2=0", 3, false, &where) ) ...bad filter...
+ *   keep = fs_where_select(&where, value); // 0 or 1
+ ***/
+
+// Values per set clause.
+#define FS_WHERE_MAX_SET 16
+// Formats of up to this many digits get a table of every value.
+#define FS_WHERE_TABLE_WIDTH 4
+// The table holds -9999 to 9999 (0 to 9999 for unsigned formats).
+#define FS_WHERE_TABLE_LIMIT 9999
+#define FS_WHERE_TABLE_WORDS ((2 * FS_WHERE_TABLE_LIMIT + 1 + 63) / 64)
+// Flipping the top bit orders two's complement values as unsigned ones.
+#define FS_WHERE_SIGN (1ULL << 63)
+
+struct fs_where {
+  bool is_signed;
+  // The range of keys that pass (empty if low > high).
+  u_int64_t low;
+  u_int64_t high;
+  // Values with another remainder fail; modulus 0 for no check.
+  u_int64_t modulus;
+  u_int64_t remainder;
+  // Keys that pass (any, if in_count is 0) and that fail.
+  int in_count;
+  int out_count;
+  u_int64_t in[FS_WHERE_MAX_SET];
+  u_int64_t out[FS_WHERE_MAX_SET];
+  // For narrow formats: bit `key - table_base` is the answer.
+  bool tabled;
+  u_int64_t table_base;
+  u_int64_t table[FS_WHERE_TABLE_WORDS];
+};
+
+/***
+* fs_where_key: A value (two's complement for signed formats) as a
+*   key that orders the same way as unsigned numbers.
+*/
+static inline u_int64_t fs_where_key (const struct fs_where * where, u_int64_t value) {
+  return where->is_signed ? value ^ FS_WHERE_SIGN : value;
+}
+
+/***
+* fs_where_test: Whether `value` passes every clause, 1 or 0. The only
+*   branches are on the filter, which stays the same for a scan.
+*/
+static inline u_int64_t fs_where_test (const struct fs_where * where, u_int64_t value) {
+  u_int64_t key = fs_where_key(where, value);
+  u_int64_t keep = ( key >= where->low ) & ( key <= where->high );
+  u_int64_t in = where->in_count == 0;
+  u_int64_t out = 0;
+
+  for ( int i = 0; i < where->in_count; i++ )
+    in |= key == where->in[i];
+  for ( int i = 0; i < where->out_count; i++ )
+    out |= key == where->out[i];
+  if ( where->modulus != 0 ) {
+    u_int64_t remainder;
+    if ( where->is_signed ) {
+      int64_t signed_remainder = (int64_t)value % (int64_t)where->modulus;
+      // C rounds towards 0; make negative remainders positive without a branch.
+      signed_remainder += (int64_t)where->modulus & -(int64_t)( signed_remainder < 0 );
+      remainder = signed_remainder;
+    } else {
+      remainder = value % where->modulus;
+    }
+    keep &= remainder == where->remainder;
+  }
+  return keep & in & ( out ^ 1 );
+}
+
+/***
+* fs_where_select: Whether `value` passes, 1 or 0: a table lookup for
+*   narrow formats, or else fs_where_test.
+*/
+static inline u_int64_t fs_where_select (const struct fs_where * where, u_int64_t value) {
+  if ( where->tabled ) {
+    u_int64_t bit = fs_where_key(where, value) - where->table_base;
+    return ( where->table[bit / 64] >> ( bit % 64 ) ) & 1;
+  }
+  return fs_where_test(where, value);
+}
+
+/***
+* fs_where_number: Parses a number at `*text` as a key, moving past it.
+*   Returns false if there is none, or it doesn't fit the format.
+*/
+static inline bool fs_where_number (const char ** text, bool is_signed, u_int64_t * key) {
+  const char * at = *text;
+  bool negative = *at == '-';
+  u_int64_t value = 0;
+  int digits = 0;
+
+  if ( negative && !is_signed )
+    return false;
+  at += negative;
+  while ( (unsigned char)( *at - '0' ) < 10 ) {
+    u_int64_t digit = *at - '0';
+    if ( value > ( UINT64_MAX - digit ) / 10 )
+      return false;
+    value = value * 10 + digit;
+    digits += 1;
+    at += 1;
+  }
+  if ( digits == 0 || ( is_signed && value > ( negative ? FS_WHERE_SIGN : FS_WHERE_SIGN - 1 ) ) )
+    return false;
+  *text = at;
+  *key = is_signed ? ( negative ? 0 - value : value ) ^ FS_WHERE_SIGN : value;
+  return true;
+}
+
+/***
+* fs_where_none: Makes the range empty, so no value passes.
+*/
+static inline void fs_where_none (struct fs_where * where) {
+  where->low = UINT64_MAX;
+  where->high = 0;
+}
+
+/***
+* fs_where_compile: Compiles filter `text` for records of `width`
+*   digits. Returns false if the text isn't a filter.
+*/
+static inline bool fs_where_compile (const char * text, int width, bool is_signed, struct fs_where * where) {
+  const char * at = text;
+  bool has_in = false;
+
+  memset(where, 0, sizeof(*where));
+  where->is_signed = is_signed;
+  where->high = UINT64_MAX;
+  for ( ;; ) {
+    u_int64_t key, last;
+    u_int64_t set[FS_WHERE_MAX_SET];
+    int count = 0;
+    bool excluded = false;
+
+    while ( *at == ' ' )
+      at += 1;
+    if ( at[0] == '>' || at[0] == '<' ) {
+      bool greater = at[0] == '>';
+      bool equal = at[1] == '=';
+      at += 1 + equal;
+      if ( !fs_where_number(&at, is_signed, &key) )
+        return false;
+      // Nothing is above the largest key or below the smallest.
+      if ( greater && !equal && key == UINT64_MAX )
+        fs_where_none(where);
+      else if ( greater && key + !equal > where->low )
+        where->low = key + !equal;
+      else if ( !greater && !equal && key == 0 )
+        fs_where_none(where);
+      else if ( !greater && key - !equal < where->high )
+        where->high = key - !equal;
+    } else if ( at[0] == '=' || ( at[0] == '!' && at[1] == '=' ) ) {
+      excluded = at[0] == '!';
+      at += 1 + excluded;
+      for ( ;; ) {
+        if ( count == FS_WHERE_MAX_SET || !fs_where_number(&at, is_signed, &set[count]) )
+          return false;
+        count += 1;
+        if ( *at != '|' )
+          break;
+        at += 1;
+      }
+      if ( excluded ) {
+        // Every set excludes its values.
+        for ( int i = 0; i < count; i++ ) {
+          if ( where->out_count == FS_WHERE_MAX_SET )
+            return false;
+          where->out[where->out_count++] = set[i];
+        }
+      } else if ( !has_in ) {
+        memcpy(where->in, set, count * sizeof(u_int64_t));
+        where->in_count = count;
+        has_in = true;
+      } else {
+        // Values have to be in every set.
+        int kept = 0;
+        for ( int i = 0; i < where->in_count; i++ )
+          for ( int j = 0; j < count; j++ )
+            if ( where->in[i] == set[j] ) {
+              where->in[kept++] = where->in[i];
+              break;
+            }
+        where->in_count = kept;
+        if ( kept == 0 )
+          fs_where_none(where);
+      }
+    } else if ( at[0] == '%' ) {
+      at += 1;
+      // Both are plain numbers, even in signed formats.
+      if ( where->modulus != 0 || !fs_where_number(&at, false, &where->modulus) || where->modulus == 0
+           || where->modulus > FS_WHERE_SIGN - 1 || *at++ != '='
+           || !fs_where_number(&at, false, &where->remainder) || where->remainder >= where->modulus )
+        return false;
+    } else if ( fs_where_number(&at, is_signed, &key) && at[0] == '.' && at[1] == '.' ) {
+      at += 2;
+      if ( !fs_where_number(&at, is_signed, &last) )
+        return false;
+      if ( key > where->low )
+        where->low = key;
+      if ( last < where->high )
+        where->high = last;
+    } else {
+      return false;
+    }
+    while ( *at == ' ' )
+      at += 1;
+    if ( *at == '\0' )
+      break;
+    if ( *at++ != ',' )
+      return false;
+  }
+
+  // Narrow formats: every value's answer, up front.
+  if ( width <= FS_WHERE_TABLE_WIDTH ) {
+    u_int64_t first = is_signed ? (u_int64_t)-FS_WHERE_TABLE_LIMIT : 0;
+    u_int64_t values = is_signed ? 2 * FS_WHERE_TABLE_LIMIT + 1 : FS_WHERE_TABLE_LIMIT + 1;
+    where->table_base = fs_where_key(where, first);
+    for ( u_int64_t i = 0; i < values; i++ )
+      where->table[i / 64] |= fs_where_test(where, first + i) << ( i % 64 );
+    where->tabled = true;
+  }
+  return true;
+}
+
+#endif
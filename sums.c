@@ -24,10 +24,14 @@ limitations under the License.
 #include <argp.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <error.h>
 #include <string.h>
-#include <sys/epoll.h>
-#include <sys/stat.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "filesums.h"
 
 
 /***
@@ -38,13 +42,52 @@ limitations under the License.
  *      * --child-count or -c 
  *      * --input-file or -i 
  *      * --output-file or -o 
- *  * Child process structures.
- *    * Structures/functions used for creating children.
- *  * "epoll" polling
- *    * Watches the pipes and notifies of writes by children.
+ *      * --auto
+ *      * --tune-cache
+ *      * --cache
+ *      * --cache-dir
+ *      * --numa
+ *      * --stats
+ *      * --reader
+ *      * --huge-pages
+ *      * --direct
+ *      * --drop-cache
+ *      * --prefetch
+ *      * --delimiter
+ *      * --width
+ *      * --signed
+ *      * --format
+ *      * --stream
+ *      * --metrics-file
+ *      * --trace
+ *      * --counters
+ *      * --spawn
+ *      * --pool
+ *      * --async
+ *      * --offset
+ *      * --length
+ *      * --records
+ *      * --where
+ *      * --key-column
+ *      * --value-column
+ *      * --separator
+ *      * --worker
+ *      * --workers
+ *  * libfilesums (filesums.h)
+ *    * Splits the file over child processes, and collects their
+ *      results with epoll.
+ *  * Output
+ *    * Writes the sums (and statistics) as text, JSON, CSV or binary
+ *      records, either as the results arrive or once they all have.
+ * 
+ *  * Metrics
+ *    * Writes an OpenMetrics textfile about the run (--metrics-file).
+ * 
+ *  * Worker
+ *    * Serves blocks to coordinators (--worker), instead of summing a file.
  * 
- * Together, the three pieces (argp, child process handling, and epoll)
- * make up the core of the program.
+ * The program itself only parses arguments and writes output;
+ * the summing is done by the library.
  ***/
 
 
@@ -57,7 +100,7 @@ limitations under the License.
 // Program information for --help output.
 const char * argp_program_version = "File Summer";
 static char doc[] = "A program for summation.";
-static char args_doc[] = "";
+static char args_doc[] = "[FILE...]";
 
 // "Keys" for the command line arguments/flags.
 enum OPTION_KEYS {
@@ -65,7 +108,38 @@ enum OPTION_KEYS {
   OUTPUT_FILE = 'o', // -o <output> default to "-" for stdout
   CHILD_COUNT = 'c', // -c <number of children>
   // (Child Count) = (File Byte Count)/(BLOCK_SIZE)
-  BLOCK_SIZE = 256 // No short option "--block-size".
+  BLOCK_SIZE = 256, // No short option "--block-size".
+  AUTO = 257, // No short option "--auto".
+  TUNE_CACHE = 258, // No short option "--tune-cache".
+  NUMA = 259, // No short option "--numa".
+  STATS = 260, // No short option "--stats".
+  READER = 261, // No short option "--reader".
+  HUGE_PAGES = 262, // No short option "--huge-pages".
+  DIRECT = 263, // No short option "--direct".
+  DROP_CACHE = 264, // No short option "--drop-cache".
+  PREFETCH = 265, // No short option "--prefetch".
+  DELIMITER = 266, // No short option "--delimiter".
+  WIDTH = 267, // No short option "--width".
+  SIGNED = 268, // No short option "--signed".
+  FORMAT = 269, // No short option "--format".
+  STREAM = 270, // No short option "--stream".
+  METRICS_FILE = 271, // No short option "--metrics-file".
+  TRACE = 272, // No short option "--trace".
+  COUNTERS = 273, // No short option "--counters".
+  WORKER = 274, // No short option "--worker".
+  WORKERS = 275, // No short option "--workers".
+  CACHE = 276, // No short option "--cache".
+  CACHE_DIR = 277, // No short option "--cache-dir".
+  SPAWN = 278, // No short option "--spawn".
+  POOL = 279, // No short option "--pool".
+  ASYNC = 280, // No short option "--async".
+  OFFSET = 281, // No short option "--offset".
+  LENGTH = 282, // No short option "--length".
+  RECORDS = 283, // No short option "--records".
+  WHERE = 284, // No short option "--where".
+  KEY_COLUMN = 285, // No short option "--key-column".
+  VALUE_COLUMN = 286, // No short option "--value-column".
+  SEPARATOR = 287 // No short option "--separator".
 };
 
 static struct argp_option options[] = {
@@ -105,9 +179,326 @@ static struct argp_option options[] = {
     0,
     "The number of children to spawn, with n >= 1. "
     "Should not be used with '--block-size'."},
+  // For the --auto argument.
+  {
+    "auto",
+    AUTO,
+    0,
+    ARGP_LONG_ONLY,
+    "Pick the child count and block size from the CPUs available,"
+    " the cgroup CPU quota, the file size and how much of the file"
+    " is already cached. Should not be used with '--child-count'"
+    " or '--block-size'."
+  },
+  // For the --tune-cache argument.
+  {
+    "tune-cache",
+    TUNE_CACHE,
+    "FILE",
+    ARGP_LONG_ONLY,
+    "Where '--auto' remembers the fastest settings for this host."
+    " Defaults to \"$XDG_CACHE_HOME/file-sums/auto-tune\"."
+  },
+  // For the --cache argument.
+  {
+    "cache",
+    CACHE,
+    0,
+    ARGP_LONG_ONLY,
+    "Remember each file's result, and output it again without reading"
+    " the file as long as its device, inode, size and timestamps and the"
+    " format and block options are the same."
+  },
+  // For the --cache-dir argument.
+  {
+    "cache-dir",
+    CACHE_DIR,
+    "DIR",
+    ARGP_LONG_ONLY,
+    "Where '--cache' keeps the results. Implies '--cache'."
+    " Defaults to \"$XDG_CACHE_HOME/file-sums/results\"."
+  },
+  // For the --numa argument.
+  {
+    "numa",
+    NUMA,
+    0,
+    ARGP_LONG_ONLY,
+    "Pin each child to a CPU, grouping the children per NUMA node"
+    " so each node reads one contiguous part of the file."
+  },
+  // For the --stats argument.
+  {
+    "stats",
+    STATS,
+    0,
+    ARGP_LONG_ONLY,
+    "Also output the bytes, time and throughput of each child"
+    " and of each NUMA node."
+  },
+  // For the --reader argument.
+  {
+    "reader",
+    READER,
+    "READER",
+    ARGP_LONG_ONLY,
+    "How children read the file: \"stdio\" (the default),"
+    " \"read\" (large read buffers) or \"mmap\" (a mapping of the file)."
+  },
+  // For the --huge-pages argument.
+  {
+    "huge-pages",
+    HUGE_PAGES,
+    0,
+    ARGP_LONG_ONLY,
+    "Back read buffers with huge pages (falling back to transparent"
+    " huge pages), and ask for huge pages on file mappings."
+  },
+  // For the --direct argument.
+  {
+    "direct",
+    DIRECT,
+    0,
+    ARGP_LONG_ONLY,
+    "Read with O_DIRECT, bypassing the page cache, for files that"
+    " won't be read again. Implies '--reader=read'."
+  },
+  // For the --drop-cache argument.
+  {
+    "drop-cache",
+    DROP_CACHE,
+    0,
+    ARGP_LONG_ONLY,
+    "Drop the file from the page cache as it is read"
+    " (posix_fadvise DONTNEED). A lighter alternative to '--direct'."
+  },
+  // For the --prefetch argument.
+  {
+    "prefetch",
+    PREFETCH,
+    "SIZE",
+    ARGP_LONG_ONLY,
+    "Ask the kernel to read SIZE bytes (e.g. 64M) ahead of each child."
+    " The window moves along with '--reader=read' and '--reader=mmap';"
+    " with stdio only the start of each block is prefetched."
+  },
+  // For the --delimiter argument.
+  {
+    "delimiter",
+    DELIMITER,
+    "CHAR",
+    ARGP_LONG_ONLY,
+    "Records end at CHAR (a character, \"newline\", \"tab\" or"
+    " \"comma\"), and each record's first '--width' digits make its"
+    " number. Defaults to \"none\": every '--width' digits make a number."
+  },
+  // For the --width argument.
+  {
+    "width",
+    WIDTH,
+    "DIGITS",
+    ARGP_LONG_ONLY,
+    "Digits per number, from 1 to 19. Defaults to 3."
+  },
+  // For the --signed argument.
+  {
+    "signed",
+    SIGNED,
+    0,
+    ARGP_LONG_ONLY,
+    "A '-' before a record's digits makes it negative."
+    " Needs '--delimiter'."
+  },
+  // For the --where argument.
+  {
+    "where",
+    WHERE,
+    "FILTER",
+    ARGP_LONG_ONLY,
+    "Only sum the numbers that pass every ','-separated clause of"
+    " FILTER: \">N\", \">=N\", \"<N\", \"<=N\", \"A..B\", \"=A|B|...\""
+    " (one of them), \"!=A|B|...\" (none of them) or \"%M=R\" (the"
+    " remainder of dividing by M is R), e.g. '>500,%2=0'. Records then"
+    " counts the numbers that passed."
+  },
+  // For the --key-column argument.
+  {
+    "key-column",
+    KEY_COLUMN,
+    "N",
+    ARGP_LONG_ONLY,
+    "Sum each key separately: records (lines, or up to '--delimiter')"
+    " are split into fields at '--separator', and field N (from 1) is"
+    " a record's key. Needs '--value-column'. The sum of each key is"
+    " output before the final sum, in key order."
+  },
+  // For the --value-column argument.
+  {
+    "value-column",
+    VALUE_COLUMN,
+    "N",
+    ARGP_LONG_ONLY,
+    "With '--key-column': field N is a record's value, whose first"
+    " '--width' digits (19 unless given) make its number."
+  },
+  // For the --separator argument.
+  {
+    "separator",
+    SEPARATOR,
+    "CHAR",
+    ARGP_LONG_ONLY,
+    "With '--key-column': fields end at CHAR (a character, \"tab\" or"
+    " \"comma\"). Defaults to \"comma\"."
+  },
+  // For the --format argument.
+  {
+    "format",
+    FORMAT,
+    "FORMAT",
+    ARGP_LONG_ONLY,
+    "How to write the results: \"text\" (the default), \"json\","
+    " \"csv\" or \"bin\" (fixed size little endian records)."
+  },
+  // For the --stream argument.
+  {
+    "stream",
+    STREAM,
+    0,
+    ARGP_LONG_ONLY,
+    "Write each block's result as soon as it arrives (JSON as one"
+    " object per line), instead of once every block is done."
+    " Text output always streams."
+  },
+  // For the --metrics-file argument.
+  {
+    "metrics-file",
+    METRICS_FILE,
+    "FILE",
+    ARGP_LONG_ONLY,
+    "Write the run's metrics (files, bytes, records, durations,"
+    " children, reassigned blocks, failures; over all the input files)"
+    " to FILE as an OpenMetrics textfile, e.g. for the node_exporter"
+    " textfile collector. Updated every second while the results"
+    " arrive, and replaced atomically."
+  },
+  // For the --trace argument.
+  {
+    "trace",
+    TRACE,
+    "FILE",
+    ARGP_LONG_ONLY,
+    "Record how long stat, fork, open, parse, the pipe write and"
+    " collecting took, and write it to FILE as a Chrome trace"
+    " (for chrome://tracing or ui.perfetto.dev)."
+  },
+  // For the --counters argument.
+  {
+    "counters",
+    COUNTERS,
+    0,
+    ARGP_LONG_ONLY,
+    "Count cycles, instructions, branch misses and last level cache"
+    " misses while each child sums its block, and output the IPC and"
+    " misses per byte. Implies '--stats'."
+  },
+  // For the --spawn argument.
+  {
+    "spawn",
+    SPAWN,
+    0,
+    ARGP_LONG_ONLY,
+    "Start the children with posix_spawn (running this program again)"
+    " instead of fork, so starting them costs the same however much"
+    " memory this process has."
+  },
+  // For the --pool argument.
+  {
+    "pool",
+    POOL,
+    "WORKERS",
+    ARGP_LONG_ONLY,
+    "Fork this many workers once, and have them sum the blocks of every"
+    " input file instead of forking children per file. Workers are"
+    " replaced after 10000 blocks or 64 MB of memory growth."
+  },
+  // For the --async argument.
+  {
+    "async",
+    ASYNC,
+    "DEPTH",
+    OPTION_ARG_OPTIONAL | ARGP_LONG_ONLY,
+    "Sum the input files in this process instead of forking, with a"
+    " thread per CPU that keeps DEPTH files (64 by default) in flight"
+    " with io_uring, for many small files. Each file is one block."
+  },
+  // For the --offset argument.
+  {
+    "offset",
+    OFFSET,
+    "BYTES",
+    ARGP_LONG_ONLY,
+    "Sum only from this byte of the file (\"64K\" and the like work),"
+    " as if the file started there. Only the range is split over the"
+    " children."
+  },
+  // For the --length argument.
+  {
+    "length",
+    LENGTH,
+    "BYTES",
+    ARGP_LONG_ONLY,
+    "Sum only this many bytes (from '--offset'), as if the file ended"
+    " there."
+  },
+  // For the --records argument.
+  {
+    "records",
+    RECORDS,
+    "START[:COUNT]",
+    ARGP_LONG_ONLY,
+    "Sum only COUNT records (all the rest by default) from record"
+    " number START, counting from 0. Files of same length lines are"
+    " jumped into directly; others get an index of where the records"
+    " start, built once and kept in the cache directory with '--cache'."
+  },
+  // For the --worker argument.
+  {
+    "worker",
+    WORKER,
+    "[HOST:]PORT",
+    ARGP_LONG_ONLY,
+    "Run as a worker: sum the blocks that coordinators ('--workers')"
+    " send to this port, instead of summing a file. The reader options"
+    " apply to the worker's reads. Port 0 picks a free port. Listens on"
+    " loopback without a HOST (0.0.0.0 for every interface); any"
+    " coordinator that reaches it can have it read any file."
+  },
+  // For the --workers argument.
+  {
+    "workers",
+    WORKERS,
+    "HOST:PORT,...",
+    ARGP_LONG_ONLY,
+    "Hand the blocks to these workers over TCP instead of to children,"
+    " one block per worker at a time, moving blocks of workers that go"
+    " away to the others. The workers must see the input file at the"
+    " same absolute path. Use '--child-count' or '--block-size' for the"
+    " number of blocks."
+  },
   {0}
 };
 
+// The --format values.
+enum OUTPUT_FORMAT {
+  FORMAT_TEXT,
+  FORMAT_JSON,
+  FORMAT_CSV,
+  FORMAT_BIN
+};
+
+// Size of the output buffer.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
 // Option/argument structure
 //  ; the argp_parse function will construct/modify this
 //  ; and it will be available globally.
@@ -116,28 +507,86 @@ static struct argp_option options[] = {
 struct program_options {
   char * input_file;
   FILE * output_file;
-  u_int16_t child_count;
-  u_int64_t block_size;
-  // Keep track of whether block/child args are used.
+  // How the library should sum the file
+  // (child count, block size, readers...).
+  struct fs_options sum;
+  enum OUTPUT_FORMAT format;
+  bool stream; // Write partials as they arrive.
+  char * metrics_file; // NULL for no metrics.
+  char * worker; // Address to serve blocks on, or NULL.
+  // Files to sum after input_file.
+  char ** more_inputs;
+  int more_input_count;
+  int pool_workers; // Workers of the --pool, or 0 for none.
+  bool async; // Sum the files with fs_sum_files (--async).
+  bool ranged; // Whether --offset, --length or --records was used.
+  // Keep track of whether block/child/width args are used.
   bool _used_block;
   bool _used_child;
-
-  struct stat _stat_buf;
+  bool _used_width;
 };
 
 // Default values for options.
+// (The library's options are set by fs_options_init in main.)
 struct program_options program_options = {
   // "-" will mean that standard input (stdin) should be used.
   .input_file = "-",
   .output_file = NULL,
-  .child_count = 1,
-  // block_size of one indicates the block size should be
-  // based on the child_count
-  .block_size = 0,
+  .format = FORMAT_TEXT,
+  .stream = false,
+  .metrics_file = NULL,
+  .worker = NULL,
+  .more_inputs = NULL,
+  .more_input_count = 0,
+  .pool_workers = 0,
+  .async = false,
+  .ranged = false,
   ._used_block = false,
-  ._used_child = false
+  ._used_child = false,
+  ._used_width = false
 };
 
+/***
+ * parse_size: Parses a size such as "4096", "64K", "8M" or "1G".
+ *   Returns 0 if it isn't a valid size.
+ */
+u_int64_t parse_size (char * arg) {
+  char * end;
+  u_int64_t size = strtoull(arg, &end, 10);
+  switch ( toupper(*end) ) {
+    case 'G':
+      size *= 1024;
+      // Fall through.
+    case 'M':
+      size *= 1024;
+      // Fall through.
+    case 'K':
+      size *= 1024;
+      end += 1;
+      break;
+  }
+  return end == arg || *end != '\0' ? 0 : size;
+}
+
+/***
+ * parse_delimiter: Parses a --delimiter value.
+ *   Returns -2 if it isn't a valid delimiter.
+ */
+int parse_delimiter (char * arg) {
+  if ( strcmp(arg, "none") == 0 )
+    return FS_NO_DELIMITER;
+  if ( strcmp(arg, "newline") == 0 || strcmp(arg, "\\n") == 0 )
+    return '\n';
+  if ( strcmp(arg, "tab") == 0 || strcmp(arg, "\\t") == 0 )
+    return '\t';
+  if ( strcmp(arg, "comma") == 0 )
+    return ',';
+  // Digits and '-' are part of the numbers.
+  if ( strlen(arg) != 1 || isdigit((unsigned char)arg[0]) || arg[0] == '-' )
+    return -2;
+  return (unsigned char)arg[0];
+}
+
 /***
  * Parses command-line arguments, adding values to
  * the program_options global.
@@ -154,9 +603,9 @@ static error_t parse_opt (int key, char * arg, struct argp_state * state) {
       // will use to indicate no block size.
 
       // Should not be used with --child-count
-      if ( arguments->_used_child )
+      if ( arguments->_used_child || arguments->sum.auto_tune )
         return EINVAL;
-      arguments->block_size = atoi(arg);
+      arguments->sum.block_size = atoi(arg);
       arguments->_used_block = true;
       break;
     case INPUT_FILE:
@@ -169,6 +618,8 @@ static error_t parse_opt (int key, char * arg, struct argp_state * state) {
         arguments->output_file = stdout;
       else
         arguments->output_file = fopen(arg, "w");
+      if ( arguments->output_file == NULL )
+        return errno;
       break;
     case CHILD_COUNT:
       // Doesn't detect errors, unfortunately.
@@ -178,13 +629,169 @@ static error_t parse_opt (int key, char * arg, struct argp_state * state) {
       // will use to indicate no block size.
 
       // Should not be used with --child-count
-      if ( arguments->_used_block )
+      if ( arguments->_used_block || arguments->sum.auto_tune )
         return EINVAL;
-      arguments->child_count = atoi(arg);
+      arguments->sum.child_count = atoi(arg);
       arguments->_used_child = true;
       // Should be more than zero children.
-      if ( arguments->child_count <= 0 )
+      if ( arguments->sum.child_count <= 0 )
+        return EINVAL;
+      break;
+    case AUTO:
+      // Picks its own child count, so it can't be mixed with the
+      // manual options; and it measures this host, not workers.
+      if ( arguments->_used_block || arguments->_used_child || arguments->sum.workers != NULL )
+        return EINVAL;
+      arguments->sum.auto_tune = true;
+      break;
+    case TUNE_CACHE:
+      arguments->sum.tune_cache = arg;
+      break;
+    case CACHE:
+      arguments->sum.result_cache = true;
+      break;
+    case CACHE_DIR:
+      arguments->sum.result_cache = true;
+      arguments->sum.result_cache_dir = arg;
+      break;
+    case NUMA:
+      arguments->sum.numa = true;
+      break;
+    case STATS:
+      arguments->sum.stats = true;
+      break;
+    case READER:
+      if ( strcmp(arg, "stdio") == 0 )
+        arguments->sum.reader = FS_READER_STDIO;
+      else if ( strcmp(arg, "read") == 0 )
+        arguments->sum.reader = FS_READER_READ;
+      else if ( strcmp(arg, "mmap") == 0 )
+        arguments->sum.reader = FS_READER_MMAP;
+      else
+        return EINVAL;
+      break;
+    case HUGE_PAGES:
+      arguments->sum.huge_pages = true;
+      break;
+    case DIRECT:
+      arguments->sum.direct = true;
+      break;
+    case DROP_CACHE:
+      arguments->sum.drop_cache = true;
+      break;
+    case PREFETCH:
+      arguments->sum.prefetch = parse_size(arg);
+      if ( arguments->sum.prefetch == 0 )
+        return EINVAL;
+      break;
+    case DELIMITER:
+      arguments->sum.delimiter = parse_delimiter(arg);
+      if ( arguments->sum.delimiter == -2 )
+        return EINVAL;
+      break;
+    case WIDTH:
+      arguments->sum.width = atoi(arg);
+      if ( arguments->sum.width < 1 || arguments->sum.width > 19 )
+        return EINVAL;
+      arguments->_used_width = true;
+      break;
+    case SIGNED:
+      arguments->sum.is_signed = true;
+      break;
+    case WHERE:
+      arguments->sum.where = arg;
+      break;
+    case KEY_COLUMN:
+      arguments->sum.key_column = atoi(arg);
+      if ( arguments->sum.key_column < 1 )
+        return EINVAL;
+      break;
+    case VALUE_COLUMN:
+      arguments->sum.value_column = atoi(arg);
+      if ( arguments->sum.value_column < 1 )
+        return EINVAL;
+      break;
+    case SEPARATOR:
+      arguments->sum.separator = parse_delimiter(arg);
+      if ( arguments->sum.separator < 0 || arguments->sum.separator == '\n' )
+        return EINVAL;
+      break;
+    case FORMAT:
+      if ( strcmp(arg, "text") == 0 )
+        arguments->format = FORMAT_TEXT;
+      else if ( strcmp(arg, "json") == 0 )
+        arguments->format = FORMAT_JSON;
+      else if ( strcmp(arg, "csv") == 0 )
+        arguments->format = FORMAT_CSV;
+      else if ( strcmp(arg, "bin") == 0 )
+        arguments->format = FORMAT_BIN;
+      else
+        return EINVAL;
+      break;
+    case STREAM:
+      arguments->stream = true;
+      break;
+    case METRICS_FILE:
+      arguments->metrics_file = arg;
+      break;
+    case TRACE:
+      arguments->sum.trace_file = arg;
+      break;
+    case COUNTERS:
+      arguments->sum.counters = true;
+      arguments->sum.stats = true;
+      break;
+    case SPAWN:
+      arguments->sum.spawn = true;
+      break;
+    case POOL:
+      arguments->pool_workers = atoi(arg);
+      if ( arguments->pool_workers < 1 )
+        return EINVAL;
+      break;
+    case ASYNC:
+      arguments->async = true;
+      if ( arg != NULL && ( arguments->sum.async_depth = atoi(arg) ) < 1 )
+        return EINVAL;
+      break;
+    case OFFSET:
+      arguments->sum.range_offset = parse_size(arg);
+      if ( arguments->sum.range_offset == 0 && strcmp(arg, "0") != 0 )
+        return EINVAL;
+      arguments->ranged = true;
+      break;
+    case LENGTH:
+      arguments->sum.range_length = parse_size(arg);
+      if ( arguments->sum.range_length == 0 )
+        return EINVAL;
+      arguments->ranged = true;
+      break;
+    case RECORDS: {
+      char * end;
+      arguments->sum.record_start = strtoull(arg, &end, 10);
+      if ( end == arg || ( *end != '\0' && *end != ':' ) )
         return EINVAL;
+      if ( *end == ':' ) {
+        char * count = end + 1;
+        arguments->sum.record_count = strtoull(count, &end, 10);
+        if ( end == count || *end != '\0' || arguments->sum.record_count == 0 )
+          return EINVAL;
+      }
+      arguments->ranged = true;
+      break;
+    }
+    case ARGP_KEY_ARGS:
+      // Files after the options are summed one after another.
+      arguments->more_inputs = state->argv + state->next;
+      arguments->more_input_count = state->argc - state->next;
+      break;
+    case WORKER:
+      arguments->worker = arg;
+      break;
+    case WORKERS:
+      if ( arguments->sum.auto_tune )
+        return EINVAL;
+      arguments->sum.workers = arg;
       break;
     default:
       // An unknown argument was passed along.
@@ -216,371 +823,821 @@ void handle_options (int argc, char ** argv) {
   // use standard output.
   if ( program_options.output_file == NULL )
     program_options.output_file = stdout;
+  // Fully buffered, so thousands of partials don't cost thousands of
+  // writes; streamed output is flushed once no more results are ready.
+  setvbuf(program_options.output_file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+  // Text output has always been written as the results arrive.
+  if ( program_options.format == FORMAT_TEXT )
+    program_options.stream = true;
+  // Without a delimiter (or fields) there is nowhere for a '-' to go.
+  if ( program_options.sum.is_signed && program_options.sum.delimiter == FS_NO_DELIMITER
+      && program_options.sum.key_column == 0 )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--signed' needs '--delimiter'");
+  if ( ( program_options.sum.key_column == 0 ) != ( program_options.sum.value_column == 0 ) )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--key-column' and '--value-column' go together");
+  if ( program_options.sum.key_column != 0 && program_options.sum.key_column == program_options.sum.value_column )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: the key and value columns must differ");
+  if ( program_options.sum.key_column != 0
+      && ( program_options.sum.separator != 0 ? program_options.sum.separator : ',' ) == program_options.sum.delimiter )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--separator' must differ from '--delimiter'");
+  // Groups are collected from children (or from the stream).
+  if ( program_options.sum.key_column != 0 && ( program_options.async || program_options.pool_workers > 0
+      || program_options.sum.workers != NULL ) )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--key-column' can't be used with '--async', '--pool' or '--workers'");
+  if ( program_options.sum.key_column != 0 && program_options.format == FORMAT_BIN )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--key-column' can't be used with '--format=bin'");
+  if ( program_options.sum.key_column != 0 && program_options.sum.result_cache )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--key-column' can't be used with '--cache'");
+  // Values are whole numbers, unless told otherwise.
+  if ( program_options.sum.key_column != 0 && !program_options._used_width )
+    program_options.sum.width = 19;
+  // The async engine opens the files itself, in this process.
+  if ( program_options.async && strcmp("-", program_options.input_file) == 0
+      && program_options.more_input_count == 0 )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--async' needs input files");
+  if ( program_options.async && ( program_options.pool_workers > 0 || program_options.sum.workers != NULL ) )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--async' can't be used with '--pool' or '--workers'");
+  // A range is a part of a file, found by its offset.
+  if ( ( program_options.sum.range_offset > 0 || program_options.sum.range_length > 0 )
+      && ( program_options.sum.record_start > 0 || program_options.sum.record_count > 0 ) )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--records' can't be used with '--offset' or '--length'");
+  if ( program_options.ranged && strcmp("-", program_options.input_file) == 0
+      && program_options.more_input_count == 0 )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: a range needs input files");
+  if ( program_options.sum.where != NULL && program_options.sum.workers != NULL )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--where' can't be used with '--workers'");
+  if ( program_options.ranged && ( program_options.async || program_options.sum.workers != NULL ) )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: a range can't be used with '--async' or '--workers'");
+  // Workers open the file themselves, so it can't be a stream.
+  if ( program_options.sum.workers != NULL && strcmp("-", program_options.input_file) == 0
+      && program_options.more_input_count == 0 )
+    error(EXIT_FAILURE, EINVAL, "Error parsing agruments: '--workers' needs '--input'");
 }
 
 /***
  *
- * Child Handling Section
+ * Output Section
  *
  */
 
-// This will be written to the pipe by the children.
-struct child_result {
-  u_int16_t child_num;
-  u_int64_t sum;
-};
+/***
+* print_counters: Outputs the --counters part of a stats line: the
+*   IPC, and the branch and LLC misses per byte ("n/a" for the
+*   counters that weren't available).
+*/
+void print_counters (u_int64_t bytes, u_int64_t cycles, u_int64_t instructions, u_int64_t branch_misses, u_int64_t llc_misses) {
+  FILE * out = program_options.output_file;
 
-// Basic arguments/variables needed by the children.
-struct child_info {
-  int fds[2]; // Target for pipe.
-  u_int64_t seek_to; // Start in file.
-  u_int64_t read_to; // Where the child should stop reading.
-  u_int16_t child_num; // For identification.
-  struct epoll_event event_structure;
-  struct child_result result;
-};
+  if ( cycles != (u_int64_t)-1 && instructions != (u_int64_t)-1 && cycles > 0 )
+    fprintf(out, ", %lu cycles, %lu instructions, IPC %.2f", cycles, instructions, (double)instructions / cycles);
+  else
+    fprintf(out, ", IPC n/a");
+  if ( branch_misses != (u_int64_t)-1 && bytes > 0 )
+    fprintf(out, ", branch misses/byte %.5f", (double)branch_misses / bytes);
+  else
+    fprintf(out, ", branch misses/byte n/a");
+  if ( llc_misses != (u_int64_t)-1 && bytes > 0 )
+    fprintf(out, ", LLC misses/byte %.5f", (double)llc_misses / bytes);
+  else
+    fprintf(out, ", LLC misses/byte n/a");
+}
+
+/***
+* print_stats: Outputs the --stats lines, per child and per NUMA node.
+*   A node's throughput is its bytes over its slowest child's time,
+*   since the children on a node run at the same time.
+*
+* `result` (struct fs_result *): The result, with its partials.
+*/
+void print_stats (struct fs_result * result) {
+  // The nodes that have been output already.
+  bool * node_done = calloc(result->child_count, sizeof(bool));
+
+  for ( int i = 0; i < result->child_count; i++ ) {
+    struct fs_partial * partial = &result->partials[i];
+    double seconds = partial->nanoseconds / 1e9;
+    fprintf(
+      program_options.output_file,
+      "Child %d Stats: %lu bytes, %lu records, %.6f s, %.1f MB/s, first byte %.6f s, node %d, cpu %d, pages %s",
+      partial->child_num,
+      partial->bytes,
+      partial->records,
+      seconds,
+      seconds > 0 ? partial->bytes / seconds / 1e6 : 0,
+      partial->first_byte_ns / 1e9,
+      partial->node,
+      partial->cpu,
+      fs_page_kind_name(partial->page_kind)
+    );
+    if ( partial->dtlb_misses != (u_int64_t)-1 )
+      fprintf(program_options.output_file, ", dTLB misses %lu", partial->dtlb_misses);
+    else
+      fprintf(program_options.output_file, ", dTLB misses n/a");
+    if ( program_options.sum.counters )
+      print_counters(partial->bytes, partial->cycles, partial->instructions, partial->branch_misses, partial->llc_misses);
+    fputc('\n', program_options.output_file);
+  }
 
-// Pre-definition, so child_list can reference itself.
-struct child_list;
+  // One line per node, in the order the nodes first appear.
+  for ( int i = 0; i < result->child_count; i++ ) {
+    int node = result->partials[i].node;
+    int children = 0;
+    u_int64_t bytes = 0;
+    u_int64_t nanoseconds = 0;
+    if ( node_done[i] )
+      continue;
+    for ( int j = i; j < result->child_count; j++ ) {
+      struct fs_partial * partial = &result->partials[j];
+      if ( partial->node != node )
+        continue;
+      node_done[j] = true;
+      children += 1;
+      bytes += partial->bytes;
+      if ( partial->nanoseconds > nanoseconds )
+        nanoseconds = partial->nanoseconds;
+    }
+    fprintf(
+      program_options.output_file,
+      "Node %d Stats: %d children, %lu bytes, %.1f MB/s\n",
+      node,
+      children,
+      bytes,
+      nanoseconds ? bytes / (nanoseconds / 1e9) / 1e6 : 0
+    );
+  }
+  free(node_done);
 
-// Child list structure.
-struct child_list {
-  struct child_list * next;
-  struct child_info child_info;
+  // The counters over all the children that had them.
+  if ( program_options.sum.counters ) {
+    u_int64_t bytes = 0;
+    u_int64_t totals[4] = {0};
+    for ( int i = 0; i < result->child_count; i++ ) {
+      struct fs_partial * partial = &result->partials[i];
+      u_int64_t values[4] = { partial->cycles, partial->instructions, partial->branch_misses, partial->llc_misses };
+      bytes += partial->bytes;
+      for ( int j = 0; j < 4; j++ )
+        if ( totals[j] != (u_int64_t)-1 )
+          totals[j] = values[j] != (u_int64_t)-1 ? totals[j] + values[j] : (u_int64_t)-1;
+    }
+    fprintf(program_options.output_file, "Counter Stats: %lu bytes", bytes);
+    print_counters(bytes, totals[0], totals[1], totals[2], totals[3]);
+    fputc('\n', program_options.output_file);
+  }
+}
+
+// Start of --format=bin output, followed by a little endian u16
+// version, u16 flags, u64 file size, u64 block size, u32 child
+// count and u32 reserved.
+#define BIN_MAGIC "FSUM"
+#define BIN_VERSION 1
+// BIN_FLAG_SIGNED: the sums are two's complement.
+#define BIN_FLAG_SIGNED 1
+
+// The --format=bin record types. Every record is a u32 type, u32 child
+// (the child count for BIN_FINAL), then u64 sum, records, seek_to and
+// read_to (0 and the file size for BIN_FINAL): 40 bytes in all.
+enum BIN_RECORD {
+  BIN_PARTIAL = 1,
+  BIN_FINAL = 2
 };
 
 /***
-* open_and_seek_to: Opens a file, seeks to a given position
-* and then returns the opened/seeked stream.
+* print_number: Outputs a sum, signed for signed formats.
+*/
+void print_number (u_int64_t sum) {
+  if ( program_options.sum.is_signed )
+    fprintf(program_options.output_file, "%ld", (int64_t)sum);
+  else
+    fprintf(program_options.output_file, "%lu", sum);
+}
+
+/***
+* print_sum: Outputs a sum line, signed for signed formats.
 *
-* `path` (char *): The path to the file to open.
-* `position` (u_int64_t): The position within the file to seek to.
+* `label` (const char *): What the sum is of ("Child 0", "Final").
+* `sum` (u_int64_t): The sum.
 */
-FILE * open_and_seek_to (char * path, u_int64_t position) {
-  FILE * file = fopen(path, "r");
-  fseek(file, position, SEEK_SET);
-  return file;
+void print_sum (const char * label, u_int64_t sum) {
+  fprintf(program_options.output_file, "%s Sum: ", label);
+  print_number(sum);
+  fputc('\n', program_options.output_file);
 }
 
 /***
-* handle_stdin: Handles the case where the input "file"
-* is the standard input.
+* put_le: Outputs the low `bytes` bytes of `value`, little endian.
 */
-void handle_stdin (FILE * file, int fd, u_int16_t child_num) {
-  // Where the results will be written to.
-  struct child_result result = {0};
-  // Sets the child_num so the parent will
-  // know which child returned a result.
-  result.child_num = child_num;
-
-  // These will hold the digits of each number/line.
-  // An extra is used for the null terminator.
-  char buf[4] = {0};
-  // Will hold the character currently read from the stream.
-  int c;
-  // Will hold how many digits have been read on the current line.
-  // Any more than three digits/characters will be ignored, preventing
-  // an overflow error.
-  int c_count = 0;
-  // Loop that reads to the end of the input stream,
-  // reading/summing digits along the way.
-  while ( ( c = fgetc(file) ) != EOF ) {
-    // Reads the first three digits per line into the "buf"
-    // array.
-    if ( c_count < 3 && isdigit(c) ) {
-      buf[c_count] = c;
-      c_count += 1;
-    }
-    // When three digits have been acquired,
-    // use atoi to turn them into an int.
-    if ( c_count >= 3 ) {
-      // Add the current number to the total sum.
-      result.sum += atoi(buf);
-      // Reset the current number.
-      c_count = 0;
-    }
+void put_le (u_int64_t value, int bytes) {
+  for ( int i = 0; i < bytes; i++ )
+    fputc(( value >> ( i * 8 ) ) & 0xff, program_options.output_file);
+}
+
+/***
+* put_bin_record: Outputs one --format=bin record.
+*/
+void put_bin_record (enum BIN_RECORD type, int child, u_int64_t sum, u_int64_t records, u_int64_t seek_to, u_int64_t read_to) {
+  put_le(type, 4);
+  put_le(child, 4);
+  put_le(sum, 8);
+  put_le(records, 8);
+  put_le(seek_to, 8);
+  put_le(read_to, 8);
+}
+
+/***
+* print_json_partial: Outputs a partial as a JSON object.
+*
+* `partial` (struct fs_partial *): The partial.
+* `typed` (bool): Whether to start with "type": "partial" (for --stream).
+*/
+void print_json_partial (struct fs_partial * partial, bool typed) {
+  fprintf(
+    program_options.output_file,
+    "{%s\"child\": %d, \"seek_to\": %lu, \"read_to\": %lu, \"sum\": ",
+    typed ? "\"type\": \"partial\", " : "",
+    partial->child_num,
+    partial->seek_to,
+    partial->read_to
+  );
+  print_number(partial->sum);
+  fprintf(program_options.output_file, ", \"records\": %lu", partial->records);
+  if ( program_options.sum.stats )
+    fprintf(
+      program_options.output_file,
+      ", \"bytes\": %lu, \"nanoseconds\": %lu",
+      partial->bytes,
+      partial->nanoseconds
+    );
+  // Counters that weren't available come out as null.
+  if ( program_options.sum.counters ) {
+    const char * names[4] = { "cycles", "instructions", "branch_misses", "llc_misses" };
+    u_int64_t values[4] = { partial->cycles, partial->instructions, partial->branch_misses, partial->llc_misses };
+    for ( int i = 0; i < 4; i++ )
+      if ( values[i] != (u_int64_t)-1 )
+        fprintf(program_options.output_file, ", \"%s\": %lu", names[i], values[i]);
+      else
+        fprintf(program_options.output_file, ", \"%s\": null", names[i]);
   }
- 
-  // Write the result to the pipe.
-  write(fd, &result, sizeof(result));
-  // Close the pipe.
-  close(fd);
+  fputc('}', program_options.output_file);
 }
 
 /***
-* handle_file: Handle the case where a file/path is passed along
-*   as the input file. This means that some "seeking" logic needs to be used.
+* print_csv_partial: Outputs a partial as a CSV row.
 */
-void handle_file (FILE * file, int fd, u_int16_t child_num, u_int64_t seek_to, u_int64_t read_to) {
-  // Keep track of currentposition in file, so the child
-  // knows when to stop reading numbers.
-  u_int64_t pos = seek_to;
-  // Will be passed along to the parent.
-  struct child_result result = {0};
-  // So the parent knows which child returned results.
-  result.child_num = child_num;
-
-  // Hold the digits
-  char buf[4] = {0};
-  // Hold the current character.
-  int c;
-  // Hold the current digit place (hundred, ten, one).
-  int c_count = 0;
-  // Loop until the child reaches the end of their block,
-  // or until an EOF.
-  while ( pos <= read_to && ( c = fgetc(file) ) != EOF ) {
-    // read digits into buf
-    if ( c_count < 3 && isdigit(c) ) {
-      buf[c_count] = c;
-      c_count += 1;
+void print_csv_partial (struct fs_partial * partial) {
+  fprintf(
+    program_options.output_file,
+    "partial,%d,%lu,%lu,",
+    partial->child_num,
+    partial->seek_to,
+    partial->read_to
+  );
+  print_number(partial->sum);
+  fprintf(program_options.output_file, ",%lu,%lu,%lu%s\n", partial->records, partial->bytes, partial->nanoseconds,
+      program_options.sum.key_column != 0 ? "," : "");
+}
+
+/***
+* print_key: Outputs a group's key, quoted for JSON or CSV. JSON
+*   escapes quotes, backslashes and control characters; CSV doubles
+*   quotes.
+*/
+void print_key (const struct fs_group * group) {
+  FILE * out = program_options.output_file;
+
+  fputc('"', out);
+  for ( size_t i = 0; i < group->key_length; i++ ) {
+    unsigned char c = group->key[i];
+    if ( program_options.format == FORMAT_CSV ) {
+      if ( c == '"' )
+        fputc('"', out);
+      fputc(c, out);
+    } else if ( c == '"' || c == '\\' ) {
+      fprintf(out, "\\%c", c);
+    } else if ( c < 0x20 ) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
     }
-    // Add the digit results into the sum.
-    if ( c_count >= 3 ) {
-      result.sum += atoi(buf);
-      c_count = 0;
+  }
+  fputc('"', out);
+}
+
+/***
+* output_groups: Outputs the sum of each key, with --key-column.
+*/
+void output_groups (struct fs_result * result) {
+  FILE * out = program_options.output_file;
+
+  if ( program_options.format == FORMAT_JSON )
+    fputs("\"groups\": [", out);
+  for ( u_int64_t i = 0; i < result->group_count; i++ ) {
+    struct fs_group * group = &result->groups[i];
+    switch ( program_options.format ) {
+      case FORMAT_TEXT:
+        fprintf(out, "Key %.*s Sum: ", (int)group->key_length, group->key);
+        print_number(group->sum);
+        fputc('\n', out);
+        break;
+      case FORMAT_JSON:
+        fputs(i > 0 ? ", {\"key\": " : "{\"key\": ", out);
+        print_key(group);
+        fputs(", \"sum\": ", out);
+        print_number(group->sum);
+        fprintf(out, ", \"records\": %lu}", group->records);
+        break;
+      case FORMAT_CSV:
+        fputs("group,,,,", out);
+        print_number(group->sum);
+        fprintf(out, ",%lu,,,", group->records);
+        print_key(group);
+        fputc('\n', out);
+        break;
+      case FORMAT_BIN:
+        // Not allowed with --key-column.
+        break;
     }
-    pos += 1;
   }
- 
-  // Send the results to the parent.
-  write(fd, &result, sizeof(result));
-  close(fd);
+  if ( program_options.format == FORMAT_JSON )
+    fputs("], ", out);
 }
 
-// The children will end up here after forking.
-int child_handler (struct child_info child_info) {
-  // Will hold whether standard input is being used.
-  bool is_stdin = false;
-  // Will hold the input file.
-  FILE * file;
-  // Where to stop.
-  u_int64_t read_to;
+/***
+* output_partial: Outputs one block's result, in the --format.
+*   Only called as results arrive when streaming.
+*/
+void output_partial (struct fs_partial * partial) {
+  char label[32];
 
-  // Check whther the standard input should be used.
-  if ( strcmp(program_options.input_file, "-") == 0 ) {
-    is_stdin = true;
+  switch ( program_options.format ) {
+    case FORMAT_TEXT:
+      // Print the Child Number and the sum the child calculated.
+      snprintf(label, sizeof(label), "Child %d", partial->child_num);
+      print_sum(label, partial->sum);
+      break;
+    case FORMAT_JSON:
+      print_json_partial(partial, program_options.stream);
+      if ( program_options.stream )
+        fputc('\n', program_options.output_file);
+      break;
+    case FORMAT_CSV:
+      print_csv_partial(partial);
+      break;
+    case FORMAT_BIN:
+      put_bin_record(BIN_PARTIAL, partial->child_num, partial->sum, partial->records, partial->seek_to, partial->read_to);
+      break;
+  }
+}
+
+/***
+* output_begin: Outputs what is known before any results arrive.
+*
+* `result` (struct fs_result *): The result, with the size filled in.
+* `is_file` (bool): Whether the input is a file (not a stream).
+*/
+void output_begin (struct fs_result * result, bool is_file) {
+  switch ( program_options.format ) {
+    case FORMAT_TEXT:
+      if ( is_file && program_options.ranged )
+        fprintf(program_options.output_file, "Range: %lu bytes from %lu\n", result->size, result->offset);
+      else if ( is_file )
+        fprintf(program_options.output_file, "File size: %lu\n", result->size);
+      break;
+    case FORMAT_JSON:
+      if ( program_options.stream )
+        fprintf(
+          program_options.output_file,
+          "{\"type\": \"start\", \"file_size\": %lu, \"block_size\": %lu, \"children\": %d}\n",
+          result->size,
+          result->block_size,
+          result->child_count
+        );
+      break;
+    case FORMAT_CSV:
+      fprintf(program_options.output_file, "type,child,seek_to,read_to,sum,records,bytes,nanoseconds%s\n",
+          program_options.sum.key_column != 0 ? ",key" : "");
+      break;
+    case FORMAT_BIN:
+      fputs(BIN_MAGIC, program_options.output_file);
+      put_le(BIN_VERSION, 2);
+      put_le(program_options.sum.is_signed ? BIN_FLAG_SIGNED : 0, 2);
+      put_le(result->size, 8);
+      put_le(result->block_size, 8);
+      put_le(result->child_count, 4);
+      put_le(0, 4);
+      break;
   }
+}
 
-  // -1 indicates the file should be read to the end.
-  if ( !is_stdin && child_info.read_to == -1 )
-    read_to = program_options._stat_buf.st_size;
-  else if ( !is_stdin )
-    read_to = child_info.read_to;
+/***
+* output_end: Outputs the final result (and, unless streaming, every
+*   block's result in child order).
+*
+* `result` (struct fs_result *): The finished result.
+* `is_file` (bool): Whether the input is a file (not a stream).
+*/
+void output_end (struct fs_result * result, bool is_file) {
+  FILE * out = program_options.output_file;
 
-  // Set the "file" variable to either the passed file
-  // or the standard input.
-  if ( is_stdin )
-    file = stdin;
-  else
-    // Open the file for reading and seek to the
-    // start of the block that this child is responsible for.
-    file = open_and_seek_to(program_options.input_file, child_info.seek_to);
-
-  // Handle reading/summing based on if a file
-  // or standard input is being used as input.
-  if ( is_stdin ) 
-    handle_stdin(file, child_info.fds[1], child_info.child_num);
-  else
-    handle_file(file, child_info.fds[1], child_info.child_num, child_info.seek_to, read_to);
-  
-  // Will cause the child to exit with a success status code.
-  return 0;
+  if ( program_options.format == FORMAT_JSON && !program_options.stream ) {
+    fprintf(
+      out,
+      "{\"file_size\": %lu, \"block_size\": %lu, \"children\": %d, \"partials\": [",
+      result->size,
+      result->block_size,
+      result->child_count
+    );
+    for ( int i = 0; i < result->child_count; i++ ) {
+      fputs(i > 0 ? ", " : "", out);
+      print_json_partial(&result->partials[i], false);
+    }
+    fputs("], ", out);
+  } else if ( !program_options.stream ) {
+    for ( int i = 0; i < result->child_count; i++ )
+      output_partial(&result->partials[i]);
+  }
+
+  if ( program_options.format == FORMAT_JSON && program_options.stream )
+    fputs("{\"type\": \"final\", ", out);
+  if ( program_options.sum.key_column != 0 )
+    output_groups(result);
+
+  switch ( program_options.format ) {
+    case FORMAT_TEXT:
+      print_sum("Final", result->sum);
+      if ( program_options.sum.stats ) {
+        print_stats(result);
+        if ( is_file )
+          fprintf(
+            out,
+            "Page Cache Stats: %.1f%% cached before, %.1f%% after\n",
+            result->cached_before * 100,
+            result->cached_after * 100
+          );
+        if ( program_options.sum.result_cache ) {
+          int reused = 0;
+          for ( int i = 0; i < result->child_count; i++ )
+            reused += result->partials[i].reused;
+          if ( result->from_cache )
+            fprintf(out, "Result Cache Stats: hit\n");
+          else
+            fprintf(out, "Result Cache Stats: miss, %d of %d blocks reused\n", reused, result->child_count);
+        }
+      }
+      break;
+    case FORMAT_JSON:
+      fputs("\"sum\": ", out);
+      print_number(result->sum);
+      fprintf(out, ", \"records\": %lu", result->records);
+      if ( program_options.sum.stats && is_file )
+        fprintf(out, ", \"cached_before\": %.3f, \"cached_after\": %.3f", result->cached_before, result->cached_after);
+      fputs("}\n", out);
+      break;
+    case FORMAT_CSV:
+      fputs("final,,,,", out);
+      print_number(result->sum);
+      fprintf(out, ",%lu,,%s\n", result->records, program_options.sum.key_column != 0 ? "," : "");
+      break;
+    case FORMAT_BIN:
+      put_bin_record(BIN_FINAL, result->child_count, result->sum, result->records, 0, result->size);
+      break;
+  }
+}
+
+/***
+ *
+ * Metrics Section
+ *
+ */
+
+// How often the metrics file is rewritten while the results arrive.
+#define METRICS_INTERVAL_NS 1000000000ULL
+
+// When the run started, for the duration metric.
+struct timespec run_started;
+// When the metrics file was last written.
+struct timespec metrics_written;
+
+// The metrics of a run, over all of its files.
+struct run_metrics {
+  u_int64_t files;
+  u_int64_t bytes;
+  u_int64_t records;
+  u_int64_t start_ns;
+  u_int64_t collect_ns;
+  u_int64_t finish_ns;
+  u_int64_t children;
+  u_int64_t partials;
+  u_int64_t reassigned_blocks;
+  u_int64_t cache_hits;
+};
+
+// Those of the files that are done.
+struct run_metrics metrics_done;
+
+/***
+* metrics_add: Adds a file's result to a run's metrics.
+*/
+void metrics_add (struct run_metrics * metrics, const struct fs_result * result) {
+  metrics->files += 1;
+  if ( result->partials != NULL )
+    for ( int i = 0; i < result->child_count; i++ )
+      metrics->bytes += result->partials[i].bytes;
+  metrics->records += result->records;
+  metrics->start_ns += result->start_ns;
+  metrics->collect_ns += result->collect_ns;
+  metrics->finish_ns += result->finish_ns;
+  metrics->children += result->child_count;
+  metrics->partials += result->partial_count;
+  metrics->reassigned_blocks += result->reassigned_blocks;
+  metrics->cache_hits += result->from_cache;
+}
+
+/***
+* nanoseconds_since: The time from `start` until now.
+*/
+u_int64_t nanoseconds_since (struct timespec * start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
 }
 
-// Creates a child process and child information.
-struct child_list * add_child (int epoll_fd, struct child_list * list_head, int seek_to, int read_to) {
-  // Allocate new child memory/info.
-  struct child_list * new_child = malloc(sizeof(struct child_list));
-  // Will eventually hold which child
-  // number this child is.
-  int child_num = 0;
-  // Will be used for looping to the last node
-  // in the list.
-  struct child_list * current = list_head;
-  // Will hold the result from "fork" system call.
-  pid_t fork_result;
-
-  // Create child pipes.
-  int result = pipe(new_child->child_info.fds);
-  if ( result == -1 ) { // pipe returns -1 to indicate an error.
-    perror("Error creating pipes for child");
-    exit(1);
+/***
+* print_metric: Outputs the metadata and sample of an unlabelled gauge.
+*/
+void print_metric (FILE * file, const char * name, const char * unit, const char * help, double value) {
+  fprintf(file, "# TYPE %s gauge\n", name);
+  if ( unit != NULL )
+    fprintf(file, "# UNIT %s %s\n", name, unit);
+  fprintf(file, "# HELP %s %s\n%s %.10g\n", name, help, name, value);
+}
+
+/***
+* write_metrics: Writes the --metrics-file, if there is one, for the
+*   whole run: the files that are done and the current one. The file
+*   is written under a temporary name and renamed over the old one,
+*   so a collector never sees a half written file.
+*
+* `result` (struct fs_result *): The current file's result, so far
+*   (NULL for none).
+* `running` (bool): Whether results are still arriving.
+* `failed` (bool): Whether the run failed.
+*/
+void write_metrics (struct fs_result * result, bool running, bool failed) {
+  struct run_metrics metrics = metrics_done;
+  char temp_path[4160];
+  FILE * file;
+
+  if ( program_options.metrics_file == NULL )
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &metrics_written);
+  if ( result != NULL )
+    metrics_add(&metrics, result);
+
+  snprintf(temp_path, sizeof(temp_path), "%s.%d", program_options.metrics_file, getpid());
+  file = fopen(temp_path, "w");
+  if ( file == NULL ) {
+    fprintf(stderr, "Warn: could not write metrics file %s.\n", program_options.metrics_file);
+    return;
   }
-  // Go to end of list.
-  while ( current->next != NULL ) {
-    child_num += 1;
-    current = current->next;
+  print_metric(file, "file_sums_files", NULL, "Input files of the run, so far.", metrics.files);
+  print_metric(file, "file_sums_bytes", "bytes", "Bytes read by the children.", metrics.bytes);
+  print_metric(file, "file_sums_records", NULL, "Numbers summed.", metrics.records);
+  print_metric(file, "file_sums_duration_seconds", "seconds", "Time since the run started.",
+      nanoseconds_since(&run_started) / 1e9);
+  fprintf(file, "# TYPE file_sums_phase_seconds gauge\n");
+  fprintf(file, "# UNIT file_sums_phase_seconds seconds\n");
+  fprintf(file, "# HELP file_sums_phase_seconds Time spent in each phase of the run, over its files.\n");
+  fprintf(file, "file_sums_phase_seconds{phase=\"start\"} %.9g\n", metrics.start_ns / 1e9);
+  fprintf(file, "file_sums_phase_seconds{phase=\"collect\"} %.9g\n", metrics.collect_ns / 1e9);
+  fprintf(file, "file_sums_phase_seconds{phase=\"finish\"} %.9g\n", metrics.finish_ns / 1e9);
+  print_metric(file, "file_sums_workers", NULL, "Child processes of the run, over its files.", metrics.children);
+  print_metric(file, "file_sums_partials", NULL, "Children that have returned their sum.", metrics.partials);
+  print_metric(file, "file_sums_reassigned_blocks", NULL,
+      "Blocks handed to another worker after theirs was lost or died.", metrics.reassigned_blocks);
+  print_metric(file, "file_sums_cache_hit", NULL, "Files whose result came from the result cache.",
+      metrics.cache_hits);
+  print_metric(file, "file_sums_failures", NULL, "Whether the run failed (1) or not (0).", failed);
+  print_metric(file, "file_sums_running", NULL, "Whether results are still arriving.", running);
+  print_metric(file, "file_sums_last_update_timestamp_seconds", "seconds", "When this file was written.",
+      (double)time(NULL));
+  fprintf(file, "# EOF\n");
+  if ( fclose(file) != 0 || rename(temp_path, program_options.metrics_file) != 0 ) {
+    fprintf(stderr, "Warn: could not write metrics file %s.\n", program_options.metrics_file);
+    unlink(temp_path);
   }
-  
-  // Set child properties.
-  new_child->child_info.child_num = child_num;
-
-  // Set child block boundaries.
-  new_child->child_info.seek_to = seek_to;
-  new_child->child_info.read_to = read_to;
-
-  // Fork child process.
-  fork_result = fork();
-
-  if ( fork_result == -1 ) { // An error occured.
-    perror("Error forking child.");
-    exit(1);
-  } else if ( fork_result == 0 ) { // Child:
-    // Call child_handler, exiting with the return value of that
-    // function.
-    exit(child_handler(new_child->child_info));
+}
+
+/***
+ *
+ * Worker Section
+ *
+ */
+
+/***
+* run_worker: Serves blocks to coordinators on the --worker address.
+*   Says which port it listens on (on stderr), for port 0. Only
+*   returns on failure.
+*/
+void run_worker (void) {
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  int port = 0;
+  int fd = fs_worker_listen(program_options.worker);
+
+  if ( fd == -1 ) {
+    perror(fs_last_error());
+    exit(EXIT_FAILURE);
+  }
+  if ( getsockname(fd, (struct sockaddr *)&address, &length) == 0 ) {
+    if ( address.ss_family == AF_INET )
+      port = ntohs(((struct sockaddr_in *)&address)->sin_port);
+    else if ( address.ss_family == AF_INET6 )
+      port = ntohs(((struct sockaddr_in6 *)&address)->sin6_port);
   }
+  fprintf(stderr, "Worker listening on port %d.\n", port);
+  fs_worker_serve(fd, &program_options.sum);
+  perror(fs_last_error());
+  exit(EXIT_FAILURE);
+}
 
-  // Register pipes with epoll so the parent process knows when
-  // the child writes to the pipe.
-  new_child->child_info.event_structure.events = EPOLLIN;
-  new_child->child_info.event_structure.data.fd = \
-    new_child->child_info.fds[0];
+/***
+* fail_run: Reports a failed step, records the failure in the
+*   metrics file and exits.
+*/
+void fail_run (struct fs_result * result) {
+  perror(fs_last_error());
+  write_metrics(result, false, true);
+  exit(EXIT_FAILURE);
+}
 
-  epoll_ctl(
-      epoll_fd,
-      EPOLL_CTL_ADD,
-      new_child->child_info.fds[0],
-      &new_child->child_info.event_structure);
+/***
+* sum_file: Sums an input file, writing the output as the results arrive.
+*/
+void sum_file (const char * path) {
+  // Will hold the final sum, and each child's sum.
+  struct fs_result result;
+  // One child's result, as it arrives.
+  struct fs_partial partial;
+  // The children summing the file.
+  struct fs_job * job;
+  int status;
+
+  // Start the children; this also checks the input file.
+  job = fs_job_start(path, &program_options.sum, &result);
+  if ( job == NULL )
+    fail_run(&result);
+  output_begin(&result, true);
+  // A cached result was tuned on an earlier run.
+  if ( program_options.sum.auto_tune && !result.from_cache )
+    fprintf(
+      stderr,
+      "Auto: %d children (%d CPUs, quota %.1f, %.0f%% cached).\n",
+      result.child_count,
+      result.cpus,
+      result.quota,
+      result.cached * 100
+    );
 
-  // Add the child to the linked list.
-  current->next = new_child;
+  // Output each child's sum as it arrives, flushing once
+  // there are no more results waiting.
+  while ( ( status = fs_job_next(job, &partial) ) == 1 ) {
+    // Keep the metrics current on long runs.
+    if ( program_options.metrics_file != NULL && nanoseconds_since(&metrics_written) >= METRICS_INTERVAL_NS )
+      write_metrics(&result, true, false);
+    if ( !program_options.stream )
+      continue;
+    output_partial(&partial);
+    if ( !fs_job_ready(job) )
+      fflush(program_options.output_file);
+  }
+  if ( fs_job_finish(job) == -1 )
+    fail_run(&result);
 
-  // Return the child node in the linked list.
-  return new_child;
+  // This should be after children have returned results.
+  // Output the final sum:
+  output_end(&result, true);
+  metrics_add(&metrics_done, &result);
+  fs_result_free(&result);
 }
 
-int main (int argc, char ** argv) {
-  // Will hold the final sum.
-  long final_sum = 0;
-  // Will hold the number of children that have yet to
-  // return their sum.
-  u_int16_t waiting_for = 0;
-
-  // Use epoll to watch file descriptors.
-  // Note that the argument "1" is discarded and it doesn't
-  // matter what it is set to.
-  int epoll_fd = epoll_create(1);
-  // The list head for children.
-  struct child_list list_head = {0};
-
-  if ( epoll_fd == -1) { // epoll_create returns -1 on error.
-    perror("epoll create");
+/***
+* sum_files_async: Sums all the input files at once with the async
+*   engine (--async), then writes their output in order. Files that
+*   failed are reported, and make the run fail once the rest are out.
+*/
+void sum_files_async (void) {
+  bool has_input = strcmp("-", program_options.input_file) != 0;
+  int count = program_options.more_input_count + has_input;
+  const char ** paths = calloc(count, sizeof(char *));
+  struct fs_result * results = calloc(count, sizeof(struct fs_result));
+  int * errors = calloc(count, sizeof(int));
+  bool failed = false;
+
+  if ( paths == NULL || results == NULL || errors == NULL ) {
+    perror("Error allocating files");
     exit(EXIT_FAILURE);
   }
+  if ( has_input )
+    paths[0] = program_options.input_file;
+  for ( int i = 0; i < program_options.more_input_count; i++ )
+    paths[has_input + i] = program_options.more_inputs[i];
+
+  // Per file errors are reported below.
+  fs_sum_files(paths, count, &program_options.sum, results, errors);
+  for ( int i = 0; i < count; i++ ) {
+    if ( errors[i] != 0 ) {
+      fprintf(stderr, "Error summing %s: %s\n", paths[i], strerror(errors[i]));
+      failed = true;
+      continue;
+    }
+    output_begin(&results[i], true);
+    if ( program_options.stream )
+      output_partial(&results[i].partials[0]);
+    output_end(&results[i], true);
+    metrics_add(&metrics_done, &results[i]);
+    fs_result_free(&results[i]);
+  }
+  free(paths);
+  free(results);
+  free(errors);
+  write_metrics(NULL, false, failed);
+  if ( failed ) {
+    fflush(program_options.output_file);
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main (int argc, char ** argv) {
+  // Will hold the final sum of a stream.
+  struct fs_result result;
+
+  // With --spawn, the children are this program run again; they
+  // sum their block in here and exit.
+  fs_child_main(argc, argv);
+
+  clock_gettime(CLOCK_MONOTONIC, &run_started);
 
   // Handle/process the arguments/options.
   // This will handle the user arguments
   // and fill in the program_options global.
+  fs_options_init(&program_options.sum);
   handle_options(argc, argv);
 
-  // Will hold the output file,
-  // including the standard output if that's what's desired.
-  FILE * file;
-  // Will hold input file information.
-  struct stat stat_buf;
-  // Will hold the return value of a stat operation.
-  // Used to detect errors.
-  int stat_result;
+  if ( program_options.worker != NULL )
+    run_worker();
 
-  if ( strcmp("-", program_options.input_file) == 0 ) {
+  if ( strcmp("-", program_options.input_file) == 0 && program_options.more_input_count == 0 ) {
     // Warnings because standard input is not seekable.
-    if (program_options.block_size) {
+    if (program_options.sum.block_size) {
       fprintf(
         stderr,
         "Warn: using stdin... ignoring block size %lu.\n",
-        program_options.block_size
+        program_options.sum.block_size
       );
-      program_options.block_size = 0;
+      program_options.sum.block_size = 0;
     }
-    if ( program_options.child_count > 1 ) {
+    if ( program_options.sum.child_count > 1 ) {
       fprintf(
         stderr,
         "Warn: using stdin... ignoring child count %d.\n",
-        program_options.child_count
+        program_options.sum.child_count
       );
-      program_options.child_count = 1;
+      program_options.sum.child_count = 1;
     } 
-    file = stdin;
-  } else {
-    // Get file information/stats.
-    stat_result = stat(program_options.input_file, &program_options._stat_buf);
-    // Stat error.
-    if ( stat_result == -1 ) {
-      perror("Error checking input file");
-      exit(EXIT_FAILURE);
+    if ( program_options.sum.auto_tune ) {
+      fprintf(stderr, "Warn: using stdin... ignoring --auto.\n");
+      program_options.sum.auto_tune = false;
     }
-    fprintf(program_options.output_file, "File size: %lu\n", program_options._stat_buf.st_size);
-    // Flush the writes output file.
-    // Without this, there was a problem with the above printf repeating.
-    fflush(program_options.output_file);
-  }
 
-  // Handles the case where block_size or child_count are used.
-  if ( program_options.block_size > 0 ) {
-    // Set how many children should be spawned given a block size.
-    program_options.child_count = program_options._stat_buf.st_size / program_options.block_size;
-  } else {
-    // Divide the files into blocks for the children.
-    program_options.block_size = program_options._stat_buf.st_size / program_options.child_count;
+    if ( fs_sum_fd(STDIN_FILENO, &program_options.sum, &result) == -1 )
+      fail_run(&result);
+    output_begin(&result, false);
+    if ( program_options.stream )
+      output_partial(&result.partials[0]);
+    output_end(&result, false);
+    write_metrics(&result, false, false);
+    fs_result_free(&result);
+    return 0;
   }
 
-  // Set how many children will need to be waited on.
-  waiting_for = program_options.child_count;
-
-  // Create the children.
-  for ( int i = 0; i < program_options.child_count; i++ ) {
-    // Set the block the child will be responsible for.
-    u_int64_t seek_to = i * program_options.block_size;
-    u_int64_t read_to;
-    // The last child will read to the end of the file/stream.
-    // The add_child function interprets -1 as
-    // an indication that the child should read to the end
-    // of the file.
-    if ( (i + 1) == program_options.child_count )
-      read_to = -1;
-    else // Otherwise, the child should read to just before the start of the next block.
-     read_to = (i+1)*program_options.block_size - 1;
-    // Add the child with the given block boundaries.
-    add_child(epoll_fd, &list_head, seek_to, read_to);
+  if ( program_options.async ) {
+    sum_files_async();
+    return 0;
   }
 
-  // Keep polling for pipe output until all the children
-  // have returned some results.
-  while (waiting_for > 0) {
-    // If an event occurs, it'll be put into
-    // this structure:
-    struct epoll_event ev;
-    // This call will block until a pipe
-    // is readable:
-    epoll_wait(epoll_fd, &ev, 1, -1);
-
-    // Note that the above call hasn't set a timeout
-    // so it might get indefinitely stuck if one of the children
-    // fails.
-
-    // Read the output sent by the child into "result"
-    struct child_result result;
-    ssize_t bytes = read(ev.data.fd, &result, sizeof(struct child_result));
-
-    // If the message is meaningful, it's probably expected output:
-    if ( bytes > 0 ) {
-      // Print the Child Number and the sum the child calculated.
-      fprintf(program_options.output_file, "Child %d Sum: %lu\n", result.child_num, result.sum);
-      // Add the child's result to the final_sum.
-      final_sum += result.sum;
-      // Wait for one less child.
-      waiting_for -= 1;
-      // Stop polling for events on this child.
-      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ev.data.fd, NULL);
-    } else { // Something unexpected. Stop polling the child.
-      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ev.data.fd, NULL);
+  // The pool's workers are forked once, for all the files.
+  if ( program_options.pool_workers > 0 ) {
+    program_options.sum.pool = fs_pool_create(program_options.pool_workers, 0, 0);
+    if ( program_options.sum.pool == NULL ) {
+      perror(fs_last_error());
+      exit(EXIT_FAILURE);
     }
   }
-
-  // This should be after children have returned results.
-  // Output the final sum:
-  fprintf(program_options.output_file, "Final Sum: %lu\n", final_sum);
-
+  if ( strcmp("-", program_options.input_file) != 0 )
+    sum_file(program_options.input_file);
+  for ( int i = 0; i < program_options.more_input_count; i++ )
+    sum_file(program_options.more_inputs[i]);
+  fs_pool_destroy(program_options.sum.pool);
+  write_metrics(NULL, false, false);
   return 0;
 }